@@ -0,0 +1,143 @@
+"""Generate usb_layouts.py, the ctypes structures matching usb_mapper.c
+
+The source goes through the C preprocessor with the same flags as the DLL,
+so each build variant gets the layouts it was actually compiled with:
+
+    python gen_layouts.py -o usb_layouts.py usb_mapper.c -DUSB_MAPPER_EXTENDED=0
+
+The makefile runs this next to every DLL it builds. Any flag the script
+doesn't recognise is passed on to the compiler.
+"""
+import argparse
+import re
+import subprocess
+import sys
+
+# Structures that cross the DLL boundary, in the order they are emitted
+STRUCTS = [
+    "USBDeviceInfo",
+    "USBDeviceRecord",
+    "USBHubRecord",
+    "USBRecordChange",
+    "USBDeviceFilter",
+    "USBExtendedInfo",
+    "USBRootLoad",
+    "USBFreePort",
+    "TopologySummary",
+    "ScanStats",
+    "HubScanStats",
+    "PortScanStats",
+    "USBSnapshotFileHeader",
+    "BackgroundScannerStatus",
+    "USBPortEvent",
+    "USBPortCounters",
+    "PortMonitorStatus",
+]
+
+# C field types and the ctypes they map to
+C_TYPES = {
+    "char": "c_char",
+    "signed char": "c_byte",
+    "unsigned char": "c_ubyte",
+    "short": "c_short",
+    "unsigned short": "c_ushort",
+    "int": "c_int",
+    "unsigned int": "c_uint",
+    "long long": "c_longlong",
+    "unsigned long long": "c_ulonglong",
+    "double": "c_double",
+}
+
+# Appended to the source so the preprocessor expands the feature mask too
+FEATURES_MARKER = "__gen_layouts_features__"
+
+
+def preprocess(cc, source, flags):
+    with open(source, encoding="utf-8") as f:
+        text = f.read()
+    text += "\n%s USB_MAPPER_FEATURES\n" % FEATURES_MARKER
+
+    result = subprocess.run([cc, "-E", "-P", *flags, "-x", "c", "-"], input=text,
+                            capture_output=True, text=True)
+    if result.returncode != 0:
+        sys.exit("gen_layouts: preprocessing failed:\n" + result.stderr)
+    return result.stdout
+
+
+def evaluate(expression, what):
+    # Only integer arithmetic survives preprocessing of these expressions
+    if not re.fullmatch(r"[\s\d()+\-*/|<>!=&xXa-fA-FuUlL]+", expression):
+        sys.exit("gen_layouts: can't evaluate %s: %s" % (what, expression))
+    return int(eval(re.sub(r"(?<=[\da-fA-F])[uUlL]+\b", "", expression)))
+
+
+def struct_body(text, name):
+    # The body is the brace group right before "} name;"
+    match = re.search(r"\}\s*%s\s*;" % name, text)
+    if match is None:
+        sys.exit("gen_layouts: typedef %s not found" % name)
+
+    end = match.start()
+    depth = 0
+    for start in range(end, -1, -1):
+        if text[start] == "}":
+            depth += 1
+        elif text[start] == "{":
+            depth -= 1
+            if depth == 0:
+                break
+    if not re.search(r"typedef\s+struct(\s+\w+)?\s*$", text[:start]):
+        sys.exit("gen_layouts: %s is not a plain struct typedef" % name)
+    return text[start + 1:end]
+
+
+def parse_fields(name, body):
+    fields = []
+    for declaration in body.split(";"):
+        declaration = " ".join(declaration.split())
+        if not declaration:
+            continue
+
+        match = re.fullmatch(r"(.+?) (\w+)(?: ?\[(.+)\])?", declaration)
+        if match is None or match.group(1) not in C_TYPES:
+            sys.exit("gen_layouts: %s: unsupported field '%s'" % (name, declaration))
+
+        ctype = C_TYPES[match.group(1)]
+        if match.group(3) is not None:
+            ctype += " * %d" % evaluate(match.group(3), "%s.%s" % (name, match.group(2)))
+        fields.append((match.group(2), ctype))
+    return fields
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source")
+    parser.add_argument("-o", "--output", default="usb_layouts.py")
+    parser.add_argument("--cc", default="gcc")
+    args, flags = parser.parse_known_args()
+
+    text = preprocess(args.cc, args.source, flags)
+    marker = re.search(r"%s (.+)" % FEATURES_MARKER, text)
+    features = evaluate(marker.group(1), "USB_MAPPER_FEATURES")
+
+    lines = [
+        "# Generated by gen_layouts.py from %s - do not edit." % args.source,
+        "# Rebuild with make; the DLL and this file must come from the same build.",
+        "from ctypes import (Structure, c_char, c_byte, c_ubyte, c_short, c_ushort, c_int,",
+        "                    c_uint, c_longlong, c_ulonglong, c_double)",
+        "",
+        "# GetMapperFeatures() of the matching DLL",
+        "FEATURES = 0x%02X" % features,
+    ]
+    for name in STRUCTS:
+        lines += ["", "class %s(Structure):" % name, "    _fields_ = ["]
+        lines += ['        ("%s", %s),' % field
+                  for field in parse_fields(name, struct_body(text, name))]
+        lines.append("    ]")
+
+    with open(args.output, "w", encoding="utf-8", newline="\n") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,49 +1,488 @@
 import ctypes
-from ctypes import Structure, c_int, c_char, c_ushort
+from ctypes import c_int, c_ushort, c_void_p, c_uint
+import contextlib
+import importlib.util
 import json
+import mmap
+import os
+import threading
 
-# Define the structure matching our C struct
-class USBDeviceInfo(Structure):
-    _fields_ = [
-        ("hubIndex", c_int),
-        ("portNumber", c_int),
-        ("deviceDesc", c_char * 256),
-        ("devicePath", c_char * 512),
-        ("isHub", c_int),
-        ("speed", c_int),
-        ("vendorId", c_ushort),
-        ("productId", c_ushort),
+# Structures shared with the DLL. gen_layouts.py writes them per build into
+# the usb_layouts.py next to the DLL; the first DLL loaded binds them here, so
+# they always match the DLL they were built with.
+_LAYOUT_NAMES = (
+    "USBDeviceInfo", "USBDeviceRecord", "USBHubRecord", "USBRecordChange",
+    "USBDeviceFilter", "USBExtendedInfo", "USBRootLoad", "USBFreePort", "TopologySummary",
+    "ScanStats", "HubScanStats", "PortScanStats", "USBSnapshotFileHeader",
+    "BackgroundScannerStatus", "USBPortEvent", "USBPortCounters", "PortMonitorStatus",
+)
+_layouts_path = None
+
+# GetMapperFeatures() bits: which build variant the DLL is
+USB_FEATURE_DESCRIPTIONS = 0x01
+USB_FEATURE_EXTENDED = 0x02
+USB_FEATURE_STATS = 0x04
+USB_FEATURE_ETW = 0x08
+
+USB_RECORD_FLAG_HUB = 0x01
+
+# USBHubRecord.scanFlags, set by overlapped and bounded scans
+USB_HUB_SCAN_TIMED_OUT = 0x01
+USB_HUB_SCAN_FAILED = 0x02
+USB_HUB_SCAN_SKIPPED = 0x04
+USB_HUB_SCAN_PARTIAL = 0x08
+USB_HUB_SCAN_UNRESOLVED = 0x10  # cascaded hub with no upstream port found; not a root
+
+# USBRecordChange.kind
+USB_CHANGE_ADDED = 1
+USB_CHANGE_REMOVED = 2
+USB_CHANGE_MODIFIED = 3
+
+# USBRecordChange.fields
+USB_CHANGE_FIELD_VENDOR = 0x01
+USB_CHANGE_FIELD_PRODUCT = 0x02
+USB_CHANGE_FIELD_SPEED = 0x04
+USB_CHANGE_FIELD_FLAGS = 0x08
+USB_CHANGE_FIELD_ADDRESS = 0x10
+
+# USBDeviceFilter.flags
+USB_FILTER_HUBS_ONLY = 0x01
+USB_FILTER_DEVICES_ONLY = 0x02
+
+# USBDeviceFilter.speedMask bits
+USB_FILTER_SPEED_LOW = 0x01
+USB_FILTER_SPEED_FULL = 0x02
+USB_FILTER_SPEED_HIGH = 0x04
+USB_FILTER_SPEED_SUPER = 0x08
+USB_FILTER_SPEED_UNKNOWN = 0x10
+USB_FILTER_SPEED_SUPERPLUS = 0x20  # USB_FILTER_SPEED_SUPER also takes these
+
+USB_FILTER_MAX_IDS = 16
+
+# GetDeviceExtendedInfo() field mask
+USB_EXT_SERIAL_NUMBER = 0x01
+USB_EXT_CONFIG_DESC = 0x02
+USB_EXT_SPEED_V2 = 0x04
+USB_EXT_PORT_CONNECTOR = 0x08
+USB_EXT_ALL = 0x0F
+
+# USBExtendedInfo.supportedProtocols
+USB_EXT_PROTOCOL_USB110 = 0x01
+USB_EXT_PROTOCOL_USB200 = 0x02
+USB_EXT_PROTOCOL_USB300 = 0x04
+
+# USBExtendedInfo.speedFlags
+USB_EXT_SPEED_OPERATING_SS = 0x01
+USB_EXT_SPEED_CAPABLE_SS = 0x02
+USB_EXT_SPEED_OPERATING_SSPLUS = 0x04
+USB_EXT_SPEED_CAPABLE_SSPLUS = 0x08
+
+# USBExtendedInfo.portFlags
+USB_EXT_PORT_USER_CONNECTABLE = 0x01
+USB_EXT_PORT_DEBUG_CAPABLE = 0x02
+USB_EXT_PORT_MULTIPLE_COMPANIONS = 0x04
+USB_EXT_PORT_TYPE_C = 0x08
+
+# USBSnapshotFileHeader of a file written by SaveSnapshot(). The record
+# array, hub records and string table follow at the given offsets, stored
+# as they are in memory.
+USB_SNAPSHOT_MAGIC = 0x54425355
+USB_SNAPSHOT_VERSION = 2
+
+# StartBackgroundScanner() flags
+USB_SCANNER_ON_CHANGE = 0x01
+USB_SCANNER_FULL = 0x02
+
+# USBPortEvent.kind
+USB_PORT_EVENT_STATUS = 1
+USB_PORT_EVENT_REENUMERATED = 2
+USB_PORT_EVENT_HUB_LOST = 3
+
+# USB_CONNECTION_STATUS values reported by the port monitor
+_CONNECTION_STATUS_NAMES = {
+    0: "no_device",
+    1: "connected",
+    2: "failed_enumeration",
+    3: "general_failure",
+    4: "overcurrent",
+    5: "not_enough_power",
+    6: "not_enough_bandwidth",
+    7: "hub_nested_too_deeply",
+    8: "in_legacy_hub",
+    9: "enumerating",
+    10: "reset",
+}
+
+_PORT_EVENT_NAMES = {
+    USB_PORT_EVENT_STATUS: "status",
+    USB_PORT_EVENT_REENUMERATED: "reenumerated",
+    USB_PORT_EVENT_HUB_LOST: "hub_lost",
+}
+
+# FILETIME of the Unix epoch, in 100 ns units
+_FILETIME_UNIX_EPOCH = 116444736000000000
+
+# Default StartTopologyPublisher() section name and size
+DEFAULT_PUBLISHER_NAME = "Local\\UsbMapperTopology"
+DEFAULT_PUBLISHER_CAPACITY = 1 << 20
+
+# RescanHub() flags
+RESCAN_DESCENDANTS = 0x01
+
+# EnumerateUSBDevicesInContext() modes
+ENUM_MODE_SERIAL = 0
+ENUM_MODE_PARALLEL = 1
+ENUM_MODE_OVERLAPPED = 2
+ENUM_MODE_SESSION = 3
+ENUM_MODE_BOUNDED = 4
+
+_MODE_NAMES = {
+    ENUM_MODE_SERIAL: "serial",
+    ENUM_MODE_PARALLEL: "parallel",
+    ENUM_MODE_OVERLAPPED: "overlapped",
+    ENUM_MODE_SESSION: "session",
+    ENUM_MODE_BOUNDED: "bounded",
+}
+
+# Callback invoked by the DLL after watch mode patches the topology
+TopologyChangeCallback = ctypes.WINFUNCTYPE(None, c_int, c_int)
+
+# Callback invoked by the DLL for each device of a streaming scan; return 0 to
+# stop. Declared with the structures, as it takes a USBDeviceRecord.
+USBDeviceCallback = None
+
+# InitializeMapper() flags
+USB_INIT_ASYNC = 0x01
+
+# Loaded DLLs by path, shared by every mapper in the process
+_loaded_dlls = {}
+_loaded_dlls_lock = threading.Lock()
+
+
+def _find_dll(dll_path):
+    possible_paths = [
+        dll_path,  # As provided
+        os.path.join(os.path.dirname(__file__), dll_path),  # Same dir as script
+        os.path.join(os.getcwd(), dll_path),  # Current working directory
+        os.path.abspath(dll_path),  # Absolute path
     ]
+    
+    for path in possible_paths:
+        if os.path.exists(path):
+            return path
+    
+    raise RuntimeError(
+        f"Could not find {dll_path}!\n"
+        f"Searched in:\n" + "\n".join(f"  - {p}" for p in possible_paths) +
+        f"\n\nCurrent directory: {os.getcwd()}"
+    )
 
-class USBTopologyMapper:
-    def __init__(self, dll_path="usb_mapper.dll"):
-        """Initialize the USB mapper by loading the DLL"""
-        import os
-        
-        # Try to find the DLL
-        possible_paths = [
-            dll_path,  # As provided
-            os.path.join(os.path.dirname(__file__), dll_path),  # Same dir as script
-            os.path.join(os.getcwd(), dll_path),  # Current working directory
-            os.path.abspath(dll_path),  # Absolute path
-        ]
+
+def _declare_signatures(dll, features):
+    dll.EnumerateUSBDevices.argtypes = []
+    dll.EnumerateUSBDevices.restype = c_int
+    
+    dll.EnumerateUSBDevicesParallel.argtypes = [c_int]
+    dll.EnumerateUSBDevicesParallel.restype = c_int
+    
+    dll.EnumerateUSBDevicesAsync.argtypes = []
+    dll.EnumerateUSBDevicesAsync.restype = c_int
+    
+    dll.GetDeviceCount.argtypes = []
+    dll.GetDeviceCount.restype = c_int
+    
+    dll.GetDeviceInfo.argtypes = [c_int, ctypes.POINTER(USBDeviceInfo)]
+    dll.GetDeviceInfo.restype = c_int
+    
+    dll.GetAllDeviceInfo.argtypes = [ctypes.POINTER(USBDeviceInfo), c_int]
+    dll.GetAllDeviceInfo.restype = c_int
+    
+    dll.GetDeviceRecords.argtypes = [ctypes.POINTER(USBDeviceRecord), c_int]
+    dll.GetDeviceRecords.restype = c_int
+    
+    dll.GetStringTable.argtypes = [ctypes.c_char_p, c_int]
+    dll.GetStringTable.restype = c_int
+    
+    dll.GetHubCount.argtypes = []
+    dll.GetHubCount.restype = c_int
+    
+    dll.GetHubRecords.argtypes = [ctypes.POINTER(USBHubRecord), c_int]
+    dll.GetHubRecords.restype = c_int
+    
+    dll.GetDeviceDescription.argtypes = [c_int, ctypes.c_char_p, c_int]
+    dll.GetDeviceDescription.restype = c_int
+    
+    dll.FindRecordByPortPath.argtypes = [ctypes.c_char_p]
+    dll.FindRecordByPortPath.restype = c_int
+    
+    dll.FindRecordsByVidPid.argtypes = [ctypes.c_ushort, ctypes.c_ushort,
+                                        ctypes.POINTER(c_int), c_int]
+    dll.FindRecordsByVidPid.restype = c_int
+    
+    dll.FindHub.argtypes = [ctypes.c_char_p]
+    dll.FindHub.restype = c_int
+    
+    dll.FindRecordByLocation.argtypes = [ctypes.c_char_p]
+    dll.FindRecordByLocation.restype = c_int
+    
+    dll.GetPortPath.argtypes = [c_int, ctypes.c_char_p, c_int]
+    dll.GetPortPath.restype = c_int
+    
+    dll.RescanHub.argtypes = [ctypes.c_char_p, c_int]
+    dll.RescanHub.restype = c_int
+    
+    dll.GetTopologyGeneration.argtypes = []
+    dll.GetTopologyGeneration.restype = c_int
+    
+    dll.GetSeenDeviceCount.argtypes = []
+    dll.GetSeenDeviceCount.restype = c_int
+    
+    dll.IsTopologyTruncated.argtypes = []
+    dll.IsTopologyTruncated.restype = c_int
+    
+    dll.StartTopologyWatch.argtypes = [TopologyChangeCallback]
+    dll.StartTopologyWatch.restype = c_int
+    
+    dll.StopTopologyWatch.argtypes = []
+    dll.StopTopologyWatch.restype = None
+    
+    dll.GetTopologyChangeEvent.argtypes = []
+    dll.GetTopologyChangeEvent.restype = c_void_p
+    
+    dll.OpenTopologySession.argtypes = []
+    dll.OpenTopologySession.restype = c_void_p
+    
+    dll.RefreshTopology.argtypes = [c_void_p]
+    dll.RefreshTopology.restype = c_int
+    
+    dll.CloseTopologySession.argtypes = [c_void_p]
+    dll.CloseTopologySession.restype = None
+    
+    dll.InvalidateTopologySession.argtypes = [c_void_p]
+    dll.InvalidateTopologySession.restype = None
+    
+    dll.OpenTopologySessionInContext.argtypes = [c_void_p]
+    dll.OpenTopologySessionInContext.restype = c_void_p
+    
+    dll.CreateMapperContext.argtypes = []
+    dll.CreateMapperContext.restype = c_void_p
+    
+    dll.DestroyMapperContext.argtypes = [c_void_p]
+    dll.DestroyMapperContext.restype = None
+    
+    dll.EnumerateUSBDevicesInContext.argtypes = [c_void_p, c_int, c_int]
+    dll.EnumerateUSBDevicesInContext.restype = c_int
+    
+    dll.EnumerateUSBDevicesBounded.argtypes = [c_void_p, c_int, c_int]
+    dll.EnumerateUSBDevicesBounded.restype = c_int
+    
+    dll.SetHubCircuitBreaker.argtypes = [c_void_p, c_int, c_int]
+    dll.SetHubCircuitBreaker.restype = c_int
+    
+    dll.EnumerateUSBDevicesStreaming.argtypes = [c_void_p, USBDeviceCallback, c_void_p]
+    dll.EnumerateUSBDevicesStreaming.restype = c_int
+    
+    dll.RescanHubInContext.argtypes = [c_void_p, ctypes.c_char_p, c_int]
+    dll.RescanHubInContext.restype = c_int
+    
+    dll.AcquireTopologySnapshot.argtypes = [c_void_p]
+    dll.AcquireTopologySnapshot.restype = c_void_p
+    
+    dll.ReleaseTopologySnapshot.argtypes = [c_void_p]
+    dll.ReleaseTopologySnapshot.restype = None
+    
+    dll.SnapshotGetSummary.argtypes = [c_void_p, ctypes.POINTER(TopologySummary)]
+    dll.SnapshotGetSummary.restype = None
+    
+    dll.SnapshotGetAllDeviceInfo.argtypes = [c_void_p, ctypes.POINTER(USBDeviceInfo), c_int]
+    dll.SnapshotGetAllDeviceInfo.restype = c_int
+    
+    dll.SnapshotGetDeviceRecords.argtypes = [c_void_p, ctypes.POINTER(USBDeviceRecord), c_int]
+    dll.SnapshotGetDeviceRecords.restype = c_int
+    
+    dll.SnapshotGetHubRecords.argtypes = [c_void_p, ctypes.POINTER(USBHubRecord), c_int]
+    dll.SnapshotGetHubRecords.restype = c_int
+    
+    dll.SnapshotGetStringTable.argtypes = [c_void_p, ctypes.c_char_p, c_int]
+    dll.SnapshotGetStringTable.restype = c_int
+    
+    dll.SnapshotSave.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.SnapshotSave.restype = c_int
+    
+    dll.SaveSnapshot.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.SaveSnapshot.restype = c_int
+    
+    dll.LoadSnapshot.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.LoadSnapshot.restype = c_int
+    
+    dll.StartBackgroundScannerInContext.argtypes = [c_void_p, c_int, c_int, c_int]
+    dll.StartBackgroundScannerInContext.restype = c_int
+    
+    dll.StopBackgroundScanner.argtypes = []
+    dll.StopBackgroundScanner.restype = None
+    
+    dll.GetBackgroundScannerStatus.argtypes = [ctypes.POINTER(BackgroundScannerStatus)]
+    dll.GetBackgroundScannerStatus.restype = None
+    
+    dll.GetBackgroundScanEvent.argtypes = []
+    dll.GetBackgroundScanEvent.restype = c_void_p
+    
+    dll.StartPortMonitor.argtypes = [c_int]
+    dll.StartPortMonitor.restype = c_int
+    
+    dll.StopPortMonitor.argtypes = []
+    dll.StopPortMonitor.restype = None
+    
+    dll.GetPortMonitorStatus.argtypes = [ctypes.POINTER(PortMonitorStatus)]
+    dll.GetPortMonitorStatus.restype = None
+    
+    dll.GetPortMonitorCounters.argtypes = [ctypes.POINTER(USBPortCounters), c_int]
+    dll.GetPortMonitorCounters.restype = c_int
+    
+    dll.GetPortMonitorEvents.argtypes = [ctypes.c_char_p, c_int,
+                                         ctypes.POINTER(USBPortEvent), c_int]
+    dll.GetPortMonitorEvents.restype = c_int
+    
+    dll.ResetPortMonitorCounters.argtypes = []
+    dll.ResetPortMonitorCounters.restype = None
+    
+    dll.StartTopologyPublisher.argtypes = [c_void_p, ctypes.c_char_p, c_int]
+    dll.StartTopologyPublisher.restype = c_int
+    
+    dll.StopTopologyPublisher.argtypes = []
+    dll.StopTopologyPublisher.restype = None
+    
+    dll.OpenTopologyReader.argtypes = [ctypes.c_char_p]
+    dll.OpenTopologyReader.restype = c_void_p
+    
+    dll.CloseTopologyReader.argtypes = [c_void_p]
+    dll.CloseTopologyReader.restype = None
+    
+    dll.GetTopologyReaderSequence.argtypes = [c_void_p]
+    dll.GetTopologyReaderSequence.restype = c_uint
+    
+    dll.RefreshFromTopologyReader.argtypes = [c_void_p, c_void_p]
+    dll.RefreshFromTopologyReader.restype = c_int
+    
+    dll.SnapshotGetString.argtypes = [c_void_p, c_uint, ctypes.POINTER(c_int)]
+    dll.SnapshotGetString.restype = c_void_p
+    
+    dll.SnapshotGetStringW.argtypes = [c_void_p, c_uint, ctypes.c_wchar_p, c_int]
+    dll.SnapshotGetStringW.restype = c_int
+    
+    dll.SnapshotGetDeviceDescription.argtypes = [c_void_p, c_int, ctypes.c_char_p, c_int]
+    dll.SnapshotGetDeviceDescription.restype = c_int
+    
+    dll.SnapshotFindRecordByPortPath.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.SnapshotFindRecordByPortPath.restype = c_int
+    
+    dll.SnapshotFindRecordsByVidPid.argtypes = [c_void_p, ctypes.c_ushort,
+                                                ctypes.c_ushort,
+                                                ctypes.POINTER(c_int), c_int]
+    dll.SnapshotFindRecordsByVidPid.restype = c_int
+    
+    dll.SnapshotFindHub.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.SnapshotFindHub.restype = c_int
+    
+    dll.SnapshotFindRecordByLocation.argtypes = [c_void_p, ctypes.c_char_p]
+    dll.SnapshotFindRecordByLocation.restype = c_int
+    
+    dll.SnapshotGetPortPath.argtypes = [c_void_p, c_int, ctypes.c_char_p, c_int]
+    dll.SnapshotGetPortPath.restype = c_int
+    
+    dll.SnapshotGetChanges.argtypes = [c_void_p, ctypes.POINTER(USBRecordChange), c_int,
+                                       ctypes.POINTER(c_int)]
+    dll.SnapshotGetChanges.restype = c_int
+    
+    dll.SnapshotGetTopologyHash.argtypes = [c_void_p]
+    dll.SnapshotGetTopologyHash.restype = ctypes.c_ulonglong
+    
+    dll.GetTopologyHash.argtypes = [c_void_p]
+    dll.GetTopologyHash.restype = ctypes.c_ulonglong
+    
+    dll.SnapshotFilterRecords.argtypes = [c_void_p, ctypes.POINTER(USBDeviceFilter),
+                                          ctypes.POINTER(c_int),
+                                          ctypes.POINTER(USBDeviceRecord), c_int]
+    dll.SnapshotFilterRecords.restype = c_int
+    
+    # Compiled out of the lean build
+    if features & USB_FEATURE_EXTENDED:
+        dll.GetDeviceExtendedInfo.argtypes = [c_void_p, c_int, c_uint,
+                                              ctypes.POINTER(USBExtendedInfo)]
+        dll.GetDeviceExtendedInfo.restype = c_int
         
-        dll_found = None
-        for path in possible_paths:
-            if os.path.exists(path):
-                dll_found = path
-                print(f"Found DLL at: {path}")
-                break
+        dll.GetDeviceConfigDescriptor.argtypes = [c_void_p, c_int, ctypes.c_char_p, c_int]
+        dll.GetDeviceConfigDescriptor.restype = c_int
         
-        if not dll_found:
-            raise RuntimeError(
-                f"Could not find {dll_path}!\n"
-                f"Searched in:\n" + "\n".join(f"  - {p}" for p in possible_paths) +
-                f"\n\nCurrent directory: {os.getcwd()}"
-            )
+        dll.GetControllerLoad.argtypes = [c_void_p, ctypes.POINTER(USBRootLoad), c_int]
+        dll.GetControllerLoad.restype = c_int
         
+        dll.FindFreePorts.argtypes = [c_void_p, c_int, ctypes.POINTER(USBFreePort), c_int]
+        dll.FindFreePorts.restype = c_int
+    
+    dll.SetScanStatsEnabled.argtypes = [c_int]
+    dll.SetScanStatsEnabled.restype = c_int
+    
+    dll.GetScanStats.argtypes = [c_void_p, ctypes.POINTER(ScanStats)]
+    dll.GetScanStats.restype = c_int
+    
+    dll.GetHubScanStats.argtypes = [c_void_p, ctypes.POINTER(HubScanStats), c_int]
+    dll.GetHubScanStats.restype = c_int
+    
+    dll.GetPortScanStats.argtypes = [c_void_p, ctypes.POINTER(PortScanStats), c_int]
+    dll.GetPortScanStats.restype = c_int
+    
+    dll.InitializeMapper.argtypes = [c_int]
+    dll.InitializeMapper.restype = c_int
+    
+    dll.ShutdownMapper.argtypes = []
+    dll.ShutdownMapper.restype = None
+
+
+def _read_layouts(dll_found):
+    """Import the usb_layouts.py that make wrote next to a DLL"""
+    path = os.path.join(os.path.dirname(os.path.abspath(dll_found)), "usb_layouts.py")
+    if _layouts_path is not None and os.path.normcase(path) != os.path.normcase(_layouts_path):
+        raise RuntimeError(
+            f"{dll_found} needs {path}, but this process already uses {_layouts_path}.\n"
+            f"Load one build variant per process."
+        )
+    if not os.path.exists(path):
+        raise RuntimeError(
+            f"Could not find {path}!\n"
+            f"make writes it next to the DLL; rebuild so both come from the same build."
+        )
+    
+    spec = importlib.util.spec_from_file_location("usb_layouts", path)
+    layouts = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(layouts)
+    return path, layouts
+
+
+def _bind_layouts(path, layouts):
+    global _layouts_path, USBDeviceCallback
+    if _layouts_path is not None:
+        return
+    
+    globals().update((name, getattr(layouts, name)) for name in _LAYOUT_NAMES)
+    USBDeviceCallback = ctypes.WINFUNCTYPE(c_int, ctypes.POINTER(layouts.USBDeviceRecord),
+                                           ctypes.c_char_p, ctypes.c_char_p, c_void_p)
+    _layouts_path = path
+
+
+def _load_dll(dll_path):
+    """Load the DLL once per process and return (dll, features)
+
+    The first load declares the signatures and starts the DLL warming up
+    in the background, so the first scan doesn't pay the cold start.
+    """
+    with _loaded_dlls_lock:
+        if dll_path in _loaded_dlls:
+            return _loaded_dlls[dll_path]
+        
+        dll_found = _find_dll(dll_path)
         try:
-            self.dll = ctypes.WinDLL(dll_found)
+            dll = ctypes.WinDLL(dll_found)
         except OSError as e:
             raise RuntimeError(
                 f"Failed to load DLL from {dll_found}\n"
@@ -55,43 +494,860 @@ class USBTopologyMapper:
                 f"Your Python: {ctypes.sizeof(ctypes.c_voidp) * 8}-bit"
             )
         
-        # Define function signatures
-        self.dll.EnumerateUSBDevices.argtypes = []
-        self.dll.EnumerateUSBDevices.restype = c_int
+        # The structures must come from the same build variant
+        layouts_path, layouts = _read_layouts(dll_found)
+        dll.GetMapperFeatures.argtypes = []
+        dll.GetMapperFeatures.restype = c_int
+        features = dll.GetMapperFeatures()
+        if features != layouts.FEATURES:
+            raise RuntimeError(
+                f"{dll_found} was built with features 0x{features:02X} but "
+                f"{layouts_path} matches 0x{layouts.FEATURES:02X}.\n"
+                f"Rebuild with make so both come from the same build."
+            )
+        _bind_layouts(layouts_path, layouts)
+        
+        _declare_signatures(dll, features)
+        dll.InitializeMapper(USB_INIT_ASYNC)
         
-        self.dll.GetDeviceCount.argtypes = []
-        self.dll.GetDeviceCount.restype = c_int
+        _loaded_dlls[dll_path] = (dll, features)
+        return dll, features
+
+class USBTopologyMapper:
+    def __init__(self, dll_path="usb_mapper.dll"):
+        """Initialize the USB mapper by loading the DLL"""
+        self.dll, self.features = _load_dll(dll_path)
         
-        self.dll.GetDeviceInfo.argtypes = [c_int, ctypes.POINTER(USBDeviceInfo)]
-        self.dll.GetDeviceInfo.restype = c_int
+        # Keeps the ctypes callback alive while the DLL holds it
+        self._watch_callback = None
     
-    def enumerate(self):
-        """Enumerate USB devices and return as Python list"""
+    def enumerate(self, parallel=False, workers=0, overlapped=False, context=None):
+        """Enumerate USB devices and return as Python list
+        
+        With parallel=True hubs are probed on a native thread pool of
+        `workers` threads (0 = one per CPU). With overlapped=True every
+        port query is issued at once through an I/O completion port.
+        Result order is the same in every mode. `context` is a handle from
+        create_context(); None scans into the shared results.
+        """
         # Call the enumeration function
-        count = self.dll.EnumerateUSBDevices()
+        if context is not None:
+            mode = (ENUM_MODE_OVERLAPPED if overlapped else
+                    ENUM_MODE_PARALLEL if parallel else ENUM_MODE_SERIAL)
+            count = self.dll.EnumerateUSBDevicesInContext(context, mode, workers)
+        elif overlapped:
+            count = self.dll.EnumerateUSBDevicesAsync()
+        elif parallel:
+            count = self.dll.EnumerateUSBDevicesParallel(workers)
+        else:
+            count = self.dll.EnumerateUSBDevices()
+        
+        if count < 0:
+            raise RuntimeError("Failed to enumerate USB devices")
+        
+        return self.devices(context=context)
+    
+    def enumerate_bounded(self, deadline_ms=2000, ioctl_timeout_ms=500, context=None):
+        """Enumerate with overlapped I/O, returning within about deadline_ms
         
+        IOCTLs still outstanding after ioctl_timeout_ms are cancelled, and
+        whatever completed is returned. Check hubs() for the "scan_flags"
+        (USB_HUB_SCAN_*) of hubs that timed out, failed or were skipped.
+        """
+        count = self.dll.EnumerateUSBDevicesBounded(context, deadline_ms, ioctl_timeout_ms)
         if count < 0:
             raise RuntimeError("Failed to enumerate USB devices")
         
-        devices = []
-        
-        # Retrieve each device
-        for i in range(count):
-            info = USBDeviceInfo()
-            if self.dll.GetDeviceInfo(i, ctypes.byref(info)):
-                device = {
-                    "hub_index": info.hubIndex,
-                    "port_number": info.portNumber,
-                    "description": info.deviceDesc.decode('utf-8', errors='ignore'),
-                    "device_path": info.devicePath.decode('utf-8', errors='ignore'),
-                    "is_hub": bool(info.isHub),
-                    "speed": self._speed_to_string(info.speed),
-                    "vendor_id": f"0x{info.vendorId:04X}",
-                    "product_id": f"0x{info.productId:04X}",
-                }
-                devices.append(device)
-        
-        return devices
+        return self.devices(context=context)
+    
+    def set_circuit_breaker(self, threshold=3, cooldown_ms=30000, context=None):
+        """Skip hubs for cooldown_ms after threshold bounded scans in a row time out
+        
+        threshold=0 turns the breaker off. Resets every hub's count.
+        """
+        self.dll.SetHubCircuitBreaker(context, threshold, cooldown_ms)
+    
+    def stream(self, callback, context=None):
+        """Scan serially, calling callback(device) for each connected port
+        
+        Devices are passed as soon as their port is queried, without tree
+        links. Return False from callback to stop the scan; the previous
+        results are then kept. Returns the number of devices passed.
+        """
+        errors = []
+        
+        def on_device(record, hub_path, hub_desc, user_data):
+            try:
+                device = self._streamed_device_dict(record.contents, hub_path, hub_desc)
+                return 0 if callback(device) is False else 1
+            except Exception as exc:
+                errors.append(exc)
+                return 0
+        
+        count = self.dll.EnumerateUSBDevicesStreaming(context, USBDeviceCallback(on_device),
+                                                      None)
+        if errors:
+            raise errors[0]
+        if count < 0:
+            raise RuntimeError("Failed to enumerate USB devices")
+        return count
+    
+    def find_first(self, predicate, context=None):
+        """Return the first device for which predicate(device) is true
+        
+        The scan stops as soon as it is found. Returns None if no device
+        matches.
+        """
+        found = []
+        
+        def on_device(device):
+            if predicate(device):
+                found.append(device)
+                return False
+            return True
+        
+        self.stream(on_device, context=context)
+        return found[0] if found else None
+    
+    def _streamed_device_dict(self, rec, hub_path, hub_desc):
+        hub_path = (hub_path or b"").decode('utf-8')
+        hub_desc = (hub_desc or b"").decode('utf-8')
+        return {
+            "hub_index": rec.hubIndex,
+            "port_number": rec.portNumber,
+            "description": f"Hub: {hub_desc}, Port: {rec.portNumber}",
+            "device_path": hub_path,
+            "is_hub": bool(rec.flags & USB_RECORD_FLAG_HUB),
+            "speed": self._speed_to_string(rec.speed),
+            "vendor_id": f"0x{rec.vendorId:04X}",
+            "product_id": f"0x{rec.productId:04X}",
+            "child_hub_index": rec.childHubIndex,
+            "device_address": rec.deviceAddress,
+        }
+    
+    @contextlib.contextmanager
+    def snapshot(self, context=None):
+        """Hold one published snapshot of a context's results
+        
+        Scans publish a new snapshot rather than changing this one, so
+        every read through the handle sees the same topology.
+        """
+        snap = self.dll.AcquireTopologySnapshot(context)
+        try:
+            yield snap
+        finally:
+            self.dll.ReleaseTopologySnapshot(snap)
+    
+    def _summary(self, snap):
+        summary = TopologySummary()
+        self.dll.SnapshotGetSummary(snap, ctypes.byref(summary))
+        return summary
+    
+    def records(self, count=None, context=None):
+        """Return the DLL's current results as a ctypes USBDeviceInfo array
+        
+        Fetched with a single SnapshotGetAllDeviceInfo call. The array can
+        be wrapped without copying, e.g. numpy.ctypeslib.as_array(records).
+        count is ignored; the snapshot's own count is used.
+        """
+        with self.snapshot(context) as snap:
+            count = self._summary(snap).deviceCount
+            records = (USBDeviceInfo * count)()
+            self.dll.SnapshotGetAllDeviceInfo(snap, records, count)
+            return records
+    
+    def scan_status(self, context=None):
+        """Stored vs. seen device counts for the current results
+        
+        The result store has no fixed cap, so "truncated" is only set when
+        the DLL ran out of memory while storing a scan.
+        """
+        with self.snapshot(context) as snap:
+            summary = self._summary(snap)
+        
+        return {
+            "stored": summary.deviceCount,
+            "seen": summary.seenDeviceCount,
+            "truncated": summary.seenDeviceCount > summary.deviceCount,
+        }
+    
+    def _require_feature(self, feature, what):
+        if not self.features & feature:
+            raise NotImplementedError(f"This usb_mapper.dll was built without {what}")
+    
+    def enable_scan_stats(self, enabled=True):
+        """Turn per-phase, per-hub and per-port scan timing on or off
+        
+        Applies to every context. Returns the previous setting.
+        """
+        self._require_feature(USB_FEATURE_STATS, "scan stats")
+        return bool(self.dll.SetScanStatsEnabled(1 if enabled else 0))
+    
+    def scan_stats(self, context=None):
+        """Timings and error counts of the last full scan, or None
+        
+        Needs enable_scan_stats() before the scan. Times are microseconds.
+        Each hub lists its own ports, slowest first.
+        """
+        summary = ScanStats()
+        if not self.dll.GetScanStats(context, ctypes.byref(summary)):
+            return None
+        
+        hub_count = self.dll.GetHubScanStats(context, None, 0)
+        hub_stats = (HubScanStats * hub_count)()
+        hub_count = min(hub_count, self.dll.GetHubScanStats(context, hub_stats, hub_count))
+        
+        port_count = self.dll.GetPortScanStats(context, None, 0)
+        port_stats = (PortScanStats * port_count)()
+        port_count = min(port_count, self.dll.GetPortScanStats(context, port_stats, port_count))
+        
+        hubs = []
+        for hub in hub_stats[:hub_count]:
+            ports = [
+                {"port": p.port, "elapsed_us": p.elapsedUs, "error": p.error}
+                for p in port_stats[hub.firstPortStat:hub.firstPortStat + hub.portCount]
+            ]
+            ports.sort(key=lambda p: p["elapsed_us"], reverse=True)
+            hubs.append({
+                "hub_index": hub.hubIndex,
+                "open_failed": bool(hub.openFailed),
+                "ioctl_errors": hub.ioctlErrors,
+                "last_error": hub.lastError,
+                "open_us": hub.openUs,
+                "node_info_us": hub.nodeInfoUs,
+                "ports_us": hub.portsUs,
+                "slowest_port": hub.slowestPort,
+                "slowest_port_us": hub.slowestPortUs,
+                "ports": ports,
+            })
+        
+        return {
+            "mode": _MODE_NAMES.get(summary.mode, summary.mode),
+            "hub_count": summary.hubCount,
+            "device_count": summary.deviceCount,
+            "port_queries": summary.portQueries,
+            "failed_opens": summary.failedOpens,
+            "ioctl_errors": summary.ioctlErrors,
+            "last_error": summary.lastError,
+            "slowest_hub": summary.slowestHub if summary.slowestHub >= 0 else None,
+            "slowest_hub_us": summary.slowestHubUs,
+            "total_us": summary.totalUs,
+            "collect_hubs_us": summary.collectHubsUs,
+            "probe_us": summary.probeUs,
+            "publish_us": summary.publishUs,
+            "cached_hubs": summary.cachedHubs,
+            "hubs": hubs,
+        }
+    
+    def compact_records(self, count=None, context=None):
+        """Return (records, strings) in the compact v2 format
+        
+        records is a ctypes USBDeviceRecord array; strings is the raw string
+        table, with offsets pointing at NUL-terminated strings inside it.
+        Both come from the same snapshot. count is ignored.
+        """
+        with self.snapshot(context) as snap:
+            return self._fetch_with_strings(snap, USBDeviceRecord,
+                                            self.dll.SnapshotGetDeviceRecords,
+                                            self._summary(snap).deviceCount)
+    
+    def _fetch_with_strings(self, snap, record_type, fetch, count):
+        """Fetch a record array plus the string table of one snapshot"""
+        records = (record_type * count)()
+        fetch(snap, records, count)
+        
+        size = self.dll.SnapshotGetStringTable(snap, None, 0)
+        strings = ctypes.create_string_buffer(max(size, 1))
+        self.dll.SnapshotGetStringTable(snap, strings, size)
+        return records, strings.raw[:size]
+    
+    @staticmethod
+    def _string_reader(strings):
+        """Return a function decoding string table offsets, each once"""
+        decoded = {}
+        
+        def string_at(offset):
+            if offset not in decoded:
+                end = strings.find(b"\0", offset)
+                decoded[offset] = strings[offset:end].decode('utf-8')
+            return decoded[offset]
+        
+        return string_at
+    
+    def hubs(self, context=None):
+        """Return each hub's shared properties from the last full scan"""
+        with self.snapshot(context) as snap:
+            records, strings = self._fetch_with_strings(snap, USBHubRecord,
+                                                        self.dll.SnapshotGetHubRecords,
+                                                        self._summary(snap).hubCount)
+        string_at = self._string_reader(strings)
+        
+        return [
+            {
+                "hub_index": hub.hubIndex,
+                "description": string_at(hub.descOffset),
+                "device_path": string_at(hub.pathOffset),
+                "driver_key": string_at(hub.driverKeyOffset),
+                "location_info": string_at(hub.locationInfoOffset),
+                "location_path": string_at(hub.locationPathOffset),
+                "parent_record": hub.parentRecord,
+                "root_ordinal": hub.rootOrdinal,
+                "depth": hub.depth,
+                "first_record": hub.firstRecord,
+                "record_count": hub.recordCount,
+                "scan_flags": hub.scanFlags,
+            }
+            for hub in records
+        ]
+    
+    def unresolved_hubs(self, context=None):
+        """Cascaded hubs whose upstream port couldn't be found
+        
+        They get no root ordinal or port paths and are left out of
+        controller_load() and free_ports(), rather than posing as roots.
+        """
+        return [hub for hub in self.hubs(context)
+                if hub["scan_flags"] & USB_HUB_SCAN_UNRESOLVED]
+    
+    def string_at(self, offset, context=None):
+        """Return one string table entry, copied out of the DLL as UTF-16
+        
+        Offsets come from the compact records, e.g. hubPathOffset, and
+        only hold until the next scan publishes a new string table.
+        """
+        with self.snapshot(context) as snap:
+            length = self.dll.SnapshotGetStringW(snap, offset, None, 0)
+            if length < 0:
+                raise IndexError(offset)
+            
+            buffer = ctypes.create_unicode_buffer(length + 1)
+            self.dll.SnapshotGetStringW(snap, offset, buffer, length + 1)
+        return buffer.value
+    
+    def device_description(self, index, context=None):
+        """Build one device's description in the DLL, on demand"""
+        with self.snapshot(context) as snap:
+            length = self.dll.SnapshotGetDeviceDescription(snap, index, None, 0)
+            if length < 0:
+                raise IndexError(index)
+            
+            buffer = ctypes.create_string_buffer(length + 1)
+            self.dll.SnapshotGetDeviceDescription(snap, index, buffer, length + 1)
+        return buffer.value.decode('utf-8')
+    
+    def devices(self, count=None, context=None):
+        """Return the DLL's current device list without rescanning"""
+        records, strings = self.compact_records(context=context)
+        string_at = self._string_reader(strings)
+        return [self._device_dict(rec, string_at) for rec in records]
+    
+    def find_devices(self, vendor_ids=(), products=(), speed_mask=0, hubs_only=False,
+                     devices_only=False, hub_path_prefix="", context=None):
+        """Return only the devices matching a filter, without rescanning
+        
+        vendor_ids is a list of VIDs and products a list of (vid, pid)
+        pairs; a device passes if it matches either (or both are empty).
+        speed_mask combines USB_FILTER_SPEED_* bits. Matching runs in the
+        DLL, so rejected devices are never copied into Python. Each dict
+        carries its "index" in the full device list.
+        """
+        device_filter = self._make_filter(vendor_ids, products, speed_mask, hubs_only,
+                                          devices_only, hub_path_prefix)
+        with self.snapshot(context) as snap:
+            count = self.dll.SnapshotFilterRecords(snap, ctypes.byref(device_filter),
+                                                   None, None, 0)
+            if count < 0:
+                raise MemoryError("USB device filter ran out of memory")
+            
+            indices = (c_int * count)()
+            records, strings = self._fetch_with_strings(
+                snap, USBDeviceRecord,
+                lambda s, out, n: self.dll.SnapshotFilterRecords(
+                    s, ctypes.byref(device_filter), indices, out, n),
+                count)
+        string_at = self._string_reader(strings)
+        
+        return [dict(self._device_dict(rec, string_at), index=index)
+                for index, rec in zip(indices, records)]
+    
+    @staticmethod
+    def _make_filter(vendor_ids, products, speed_mask, hubs_only, devices_only,
+                     hub_path_prefix):
+        vendor_ids = list(vendor_ids)
+        products = list(products)
+        if len(vendor_ids) > USB_FILTER_MAX_IDS or len(products) > USB_FILTER_MAX_IDS:
+            raise ValueError(f"At most {USB_FILTER_MAX_IDS} vendor IDs and products")
+        
+        device_filter = USBDeviceFilter()
+        device_filter.flags = ((USB_FILTER_HUBS_ONLY if hubs_only else 0) |
+                               (USB_FILTER_DEVICES_ONLY if devices_only else 0))
+        device_filter.speedMask = speed_mask
+        device_filter.vendorCount = len(vendor_ids)
+        for i, vid in enumerate(vendor_ids):
+            device_filter.vendorIds[i] = vid
+        device_filter.productCount = len(products)
+        for i, (vid, pid) in enumerate(products):
+            device_filter.products[i] = (vid << 16) | pid
+        device_filter.hubPathPrefix = hub_path_prefix.encode('utf-8')
+        return device_filter
+    
+    def _device_dict(self, rec, string_at):
+        return {
+            "hub_index": rec.hubIndex,
+            "port_number": rec.portNumber,
+            "description": f"Hub: {string_at(rec.hubDescOffset)}, Port: {rec.portNumber}",
+            "device_path": string_at(rec.hubPathOffset),
+            "is_hub": bool(rec.flags & USB_RECORD_FLAG_HUB),
+            "speed": self._speed_to_string(rec.speed),
+            "vendor_id": f"0x{rec.vendorId:04X}",
+            "product_id": f"0x{rec.productId:04X}",
+            "child_hub_index": rec.childHubIndex,
+            "parent_index": rec.parentIndex,
+            "first_child": rec.firstChild,
+            "next_sibling": rec.nextSibling,
+            "depth": rec.depth,
+            "device_address": rec.deviceAddress,
+        }
+    
+    def topology_hash(self, context=None):
+        """Hash of the current topology; equal hashes mean nothing changed
+        
+        A single integer read, so polling for changes needs no device list.
+        0 before the first scan.
+        """
+        return self.dll.GetTopologyHash(context)
+    
+    def changes(self, context=None):
+        """What the last scan or patch changed, keyed by hub path + port
+        
+        Returns {"generation", "base_generation", "added", "removed",
+        "changed"}, or None if the DLL couldn't build the change set.
+        base_generation is the snapshot the changes are relative to; if it
+        isn't the generation you saw last, changes were missed and a full
+        devices() comparison is needed. "changed" entries list the changed
+        fields and carry old_* values.
+        """
+        with self.snapshot(context) as snap:
+            base = c_int()
+            count = self.dll.SnapshotGetChanges(snap, None, 0, ctypes.byref(base))
+            if count < 0:
+                return None
+            
+            records, strings = self._fetch_with_strings(
+                snap, USBRecordChange,
+                lambda s, out, n: self.dll.SnapshotGetChanges(s, out, n, None), count)
+            generation = self._summary(snap).generation
+        string_at = self._string_reader(strings)
+        
+        field_names = [(USB_CHANGE_FIELD_VENDOR, "vendor_id"),
+                       (USB_CHANGE_FIELD_PRODUCT, "product_id"),
+                       (USB_CHANGE_FIELD_SPEED, "speed"),
+                       (USB_CHANGE_FIELD_FLAGS, "is_hub"),
+                       (USB_CHANGE_FIELD_ADDRESS, "device_address")]
+        result = {"generation": generation, "base_generation": base.value,
+                  "added": [], "removed": [], "changed": []}
+        
+        for change in records:
+            removed = change.kind == USB_CHANGE_REMOVED
+            entry = {
+                "device_path": string_at(change.hubPathOffset),
+                "port_number": change.portNumber,
+                "index": None if removed else change.recordIndex,
+                "is_hub": bool((change.oldFlags if removed else change.flags)
+                               & USB_RECORD_FLAG_HUB),
+                "vendor_id": f"0x{(change.oldVendorId if removed else change.vendorId):04X}",
+                "product_id": f"0x{(change.oldProductId if removed else change.productId):04X}",
+                "speed": self._speed_to_string(change.oldSpeed if removed else change.speed),
+            }
+            
+            if change.kind == USB_CHANGE_ADDED:
+                result["added"].append(entry)
+            elif removed:
+                result["removed"].append(entry)
+            else:
+                entry["fields"] = [name for bit, name in field_names if change.fields & bit]
+                entry["old_vendor_id"] = f"0x{change.oldVendorId:04X}"
+                entry["old_product_id"] = f"0x{change.oldProductId:04X}"
+                entry["old_speed"] = self._speed_to_string(change.oldSpeed)
+                entry["old_is_hub"] = bool(change.oldFlags & USB_RECORD_FLAG_HUB)
+                result["changed"].append(entry)
+        
+        return result
+    
+    def extended_info(self, index, fields=USB_EXT_ALL, context=None):
+        """Read extended descriptor data for one device, on demand
+        
+        fields is a mask of USB_EXT_* values. Each field costs a few IOCTLs
+        the first time and is then cached in the DLL until the device is
+        unplugged or replaced. Fields that couldn't be read are left out.
+        """
+        self._require_feature(USB_FEATURE_EXTENDED, "extended descriptors")
+        info = USBExtendedInfo()
+        if self.dll.GetDeviceExtendedInfo(context, index, fields, ctypes.byref(info)) < 0:
+            raise IndexError(index)
+        
+        result = {}
+        if info.fields & USB_EXT_SERIAL_NUMBER:
+            result["serial_number"] = info.serialNumber.decode('utf-8')
+        if info.fields & USB_EXT_CONFIG_DESC:
+            result["config_descriptor_length"] = info.configDescLength
+        if info.fields & USB_EXT_SPEED_V2:
+            protocols = info.supportedProtocols
+            flags = info.speedFlags
+            result["supported_protocols"] = [
+                name for bit, name in ((USB_EXT_PROTOCOL_USB110, "USB 1.1"),
+                                       (USB_EXT_PROTOCOL_USB200, "USB 2.0"),
+                                       (USB_EXT_PROTOCOL_USB300, "USB 3.x"))
+                if protocols & bit
+            ]
+            result["superspeed_capable"] = bool(flags & USB_EXT_SPEED_CAPABLE_SS)
+            result["superspeed_operating"] = bool(flags & USB_EXT_SPEED_OPERATING_SS)
+            result["superspeed_plus_capable"] = bool(flags & USB_EXT_SPEED_CAPABLE_SSPLUS)
+            result["superspeed_plus_operating"] = bool(flags & USB_EXT_SPEED_OPERATING_SSPLUS)
+        if info.fields & USB_EXT_PORT_CONNECTOR:
+            port_flags = info.portFlags
+            result["user_connectable"] = bool(port_flags & USB_EXT_PORT_USER_CONNECTABLE)
+            result["debug_capable"] = bool(port_flags & USB_EXT_PORT_DEBUG_CAPABLE)
+            result["type_c"] = bool(port_flags & USB_EXT_PORT_TYPE_C)
+            result["companion_port"] = info.companionPort or None
+            result["companion_index"] = info.companionIndex
+            result["companion_hub_index"] = (info.companionHubIndex
+                                             if info.companionHubIndex >= 0 else None)
+            result["companion_hub_path"] = info.companionHubPath.decode('utf-8')
+        return result
+    
+    def config_descriptor(self, index, context=None):
+        """Return one device's raw configuration descriptor, or None"""
+        self._require_feature(USB_FEATURE_EXTENDED, "extended descriptors")
+        length = self.dll.GetDeviceConfigDescriptor(context, index, None, 0)
+        if length < 0:
+            return None
+        
+        buffer = ctypes.create_string_buffer(length)
+        length = min(length, self.dll.GetDeviceConfigDescriptor(context, index, buffer, length))
+        return buffer.raw[:length] if length >= 0 else None
+    
+    def controller_load(self, context=None):
+        """Group the connected devices by host controller and root hub
+        
+        Each root hub gets its negotiated link rates and the isochronous
+        and interrupt bandwidth its devices' configurations reserve, plus
+        the same totals for its whole controller. Reads every device's
+        configuration descriptor the first time, so it costs IOCTLs.
+        Devices under unresolved_hubs() aren't counted.
+        """
+        self._require_feature(USB_FEATURE_EXTENDED, "the load report")
+        count = self.dll.GetControllerLoad(context, None, 0)
+        if count <= 0:
+            return []
+        
+        loads = (USBRootLoad * count)()
+        count = min(count, self.dll.GetControllerLoad(context, loads, count))
+        return [{
+            "hub_index": load.hubIndex,
+            "root": load.rootOrdinal,
+            "controller": load.controllerOrdinal,
+            "controller_desc": load.controllerDesc.decode('utf-8'),
+            "controller_path": load.controllerPath.decode('utf-8'),
+            "device_count": load.deviceCount,
+            "unread_devices": load.unreadCount,
+            "free_ports": load.freePortCount,
+            "bulk_endpoints": load.bulkEndpoints,
+            "link_kbps": load.linkKbps,
+            "periodic_bytes_per_sec": load.periodicBytesPerSec,
+            "controller_device_count": load.controllerDeviceCount,
+            "controller_link_kbps": load.controllerLinkKbps,
+            "controller_periodic_bytes_per_sec": load.controllerPeriodicBytesPerSec,
+        } for load in loads[:count]]
+    
+    def free_ports(self, min_speed=0, limit=None, context=None):
+        """Return free ports that can carry min_speed, least loaded first
+        
+        min_speed uses the record speed numbering (2 = High, 3 = Super,
+        4 = Super+). Ports are ordered by their host controller's reserved
+        bandwidth, so taking them in turn spreads devices across
+        controllers.
+        """
+        self._require_feature(USB_FEATURE_EXTENDED, "the load report")
+        count = self.dll.FindFreePorts(context, min_speed, None, 0)
+        if count <= 0:
+            return []
+        if limit is not None:
+            count = min(count, limit)
+        
+        ports = (USBFreePort * count)()
+        count = min(count, self.dll.FindFreePorts(context, min_speed, ports, count))
+        return [{
+            "hub_index": port.hubIndex,
+            "port": port.portNumber,
+            "depth": port.depth,
+            "root": port.rootOrdinal,
+            "controller": port.controllerOrdinal,
+            "max_speed": self._speed_to_string(port.maxSpeed),
+            "type_c": bool(port.portFlags & USB_EXT_PORT_TYPE_C),
+            "root_periodic_bytes_per_sec": port.rootPeriodicBytesPerSec,
+            "controller_link_kbps": port.controllerLinkKbps,
+            "controller_periodic_bytes_per_sec": port.controllerPeriodicBytesPerSec,
+        } for port in ports[:count]]
+    
+    def find_port(self, port_path, context=None):
+        """Return the device index at a port path like "root3.2.4", or None
+        
+        Root hubs are numbered from 0, ports from 1.
+        """
+        with self.snapshot(context) as snap:
+            index = self.dll.SnapshotFindRecordByPortPath(snap, port_path.encode('ascii'))
+        return index if index >= 0 else None
+    
+    def find_by_vid_pid(self, vendor_id, product_id, context=None):
+        """Return the device indices with a VID/PID, in device order
+        
+        Looked up in a hash index the DLL keeps with each scan, so this
+        costs the same however many devices are attached.
+        """
+        with self.snapshot(context) as snap:
+            count = self.dll.SnapshotFindRecordsByVidPid(snap, vendor_id, product_id, None, 0)
+            indices = (c_int * count)()
+            count = min(count, self.dll.SnapshotFindRecordsByVidPid(snap, vendor_id, product_id,
+                                                                    indices, count))
+        return list(indices[:count])
+    
+    def find_hub(self, path, context=None):
+        """Return the hub index with a device path or location path, or None"""
+        with self.snapshot(context) as snap:
+            hub_index = self.dll.SnapshotFindHub(snap, path.encode('utf-8'))
+        return hub_index if hub_index >= 0 else None
+    
+    def find_location(self, location_path, context=None):
+        """Return the device index at a location path, or None
+        
+        A device's location path is its hub's plus "#USB(port)", e.g.
+        "PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)".
+        """
+        with self.snapshot(context) as snap:
+            index = self.dll.SnapshotFindRecordByLocation(snap, location_path.encode('utf-8'))
+        return index if index >= 0 else None
+    
+    def port_path(self, index, context=None):
+        """Return the "rootN.p.p" port path of a device index"""
+        with self.snapshot(context) as snap:
+            length = self.dll.SnapshotGetPortPath(snap, index, None, 0)
+            if length < 0:
+                raise IndexError(index)
+            
+            buffer = ctypes.create_string_buffer(length + 1)
+            self.dll.SnapshotGetPortPath(snap, index, buffer, length + 1)
+        return buffer.value.decode('ascii')
+    
+    def rescan_hub(self, target, descendants=False, context=None):
+        """Re-query one hub (and optionally its subtree) in the cached topology
+        
+        target is a hub device path, a location path, or a port path such as
+        "root3" or "root3.2". Needs a prior full enumerate(). Returns the
+        number of devices now in the rescanned subtree.
+        """
+        flags = RESCAN_DESCENDANTS if descendants else 0
+        count = self.dll.RescanHubInContext(context, target.encode('utf-8'), flags)
+        if count < 0:
+            raise LookupError(f"No cached USB hub matches {target!r}")
+        return count
+    
+    def open_session(self, context=None):
+        """Open a TopologySession that keeps hub handles between refreshes"""
+        return TopologySession(self, context)
+    
+    def create_context(self):
+        """Create a TopologyContext whose results no other caller touches"""
+        return TopologyContext(self)
+    
+    def start_publisher(self, name=DEFAULT_PUBLISHER_NAME,
+                        capacity=DEFAULT_PUBLISHER_CAPACITY, context=None):
+        """Share this process's scans with other processes
+        
+        Every snapshot published to `context` from now on, by any scan,
+        session or watch patch, is copied into the named shared-memory
+        section. Other processes read it with attach_reader().
+        """
+        if not self.dll.StartTopologyPublisher(context, name.encode('utf-8'), capacity):
+            raise RuntimeError(f"Failed to start topology publisher {name!r}")
+    
+    def stop_publisher(self):
+        self.dll.StopTopologyPublisher()
+    
+    def attach_reader(self, name=DEFAULT_PUBLISHER_NAME):
+        """Follow another process's publisher instead of scanning
+        
+        See TopologyReader.
+        """
+        return TopologyReader(self, name)
+    
+    def start_watch(self, callback=None):
+        """Keep the topology current from device arrival/removal notifications
+        
+        Only the hub whose child changed is re-queried. `callback(hub_index,
+        device_count)` runs on a native thread after each patch; hub_index is
+        -1 after a full rescan. Read results with devices().
+        """
+        self._watch_callback = TopologyChangeCallback(callback or (lambda hub, count: None))
+        
+        if not self.dll.StartTopologyWatch(self._watch_callback):
+            self._watch_callback = None
+            raise RuntimeError("Failed to start USB topology watch")
+    
+    def stop_watch(self):
+        """Stop watch mode"""
+        self.dll.StopTopologyWatch()
+        self._watch_callback = None
+    
+    def wait_for_change(self, timeout_ms=0xFFFFFFFF):
+        """Block until watch mode patches the topology; False on timeout"""
+        event = self.dll.GetTopologyChangeEvent()
+        if not event:
+            raise RuntimeError("USB topology watch is not running")
+        return self._wait_event(event, timeout_ms)
+    
+    @staticmethod
+    def _wait_event(event, timeout_ms):
+        kernel32 = ctypes.WinDLL("kernel32")
+        kernel32.WaitForSingleObject.argtypes = [c_void_p, ctypes.c_uint32]
+        kernel32.WaitForSingleObject.restype = ctypes.c_uint32
+        return kernel32.WaitForSingleObject(event, timeout_ms) == 0
+    
+    def start_background_scanner(self, interval_ms=5000, on_change=True, full=False,
+                                 debounce_ms=0, context=None):
+        """Refresh on a native thread instead of from a Python timer
+        
+        Scans every `interval_ms` (0 = only on changes) and, with
+        on_change, once plug/unplug bursts have been quiet for
+        `debounce_ms` (0 = 250). full=True queries every hub on every scan
+        rather than only those with notifications. Read results with
+        devices(); reads never wait for a scan in progress.
+        """
+        flags = ((USB_SCANNER_ON_CHANGE if on_change else 0) |
+                 (USB_SCANNER_FULL if full else 0))
+        if not self.dll.StartBackgroundScannerInContext(context, interval_ms, debounce_ms,
+                                                        flags):
+            raise RuntimeError("Failed to start USB background scanner")
+    
+    def stop_background_scanner(self):
+        self.dll.StopBackgroundScanner()
+    
+    def background_scanner_status(self):
+        status = BackgroundScannerStatus()
+        self.dll.GetBackgroundScannerStatus(ctypes.byref(status))
+        return {
+            "running": bool(status.running),
+            "scan_count": status.scanCount,
+            "notification_scans": status.notificationScans,
+            "coalesced_notifications": status.coalescedNotifications,
+            "last_device_count": status.lastDeviceCount,
+            "last_error": status.lastError,
+            "last_scan_us": status.lastScanUs,
+        }
+    
+    def wait_for_scan(self, timeout_ms=0xFFFFFFFF):
+        """Block until the background scanner finishes a scan; False on timeout"""
+        event = self.dll.GetBackgroundScanEvent()
+        if not event:
+            raise RuntimeError("USB background scanner is not running")
+        return self._wait_event(event, timeout_ms)
+    
+    def start_port_monitor(self, interval_ms=1000):
+        """Track connection changes on every hub port on a native thread
+        
+        Plug/unplug notifications re-query the affected hub, and every
+        `interval_ms` (0 = only on notifications) each port gets one cheap
+        status query, which catches overcurrent and failed enumerations.
+        Read the results with port_counters() and port_events().
+        """
+        if not self.dll.StartPortMonitor(interval_ms):
+            raise RuntimeError("Failed to start USB port monitor")
+    
+    def stop_port_monitor(self):
+        """Stop the port monitor and drop its counters"""
+        self.dll.StopPortMonitor()
+    
+    def port_monitor_status(self):
+        status = PortMonitorStatus()
+        self.dll.GetPortMonitorStatus(ctypes.byref(status))
+        return {
+            "running": bool(status.running),
+            "pass_count": status.passCount,
+            "notification_passes": status.notificationPasses,
+            "hub_reloads": status.hubReloads,
+            "hub_count": status.hubCount,
+            "port_count": status.portCount,
+            "port_queries": status.portQueries,
+            "last_pass_us": status.lastPassUs,
+        }
+    
+    @staticmethod
+    def _filetime_to_unix(filetime):
+        return (filetime - _FILETIME_UNIX_EPOCH) / 1e7 if filetime else None
+    
+    def port_counters(self, flaky_only=False):
+        """Per-port change counters from the port monitor
+        
+        flaky_only keeps the ports with at least one disconnect, reset or
+        error status. Times are Unix seconds.
+        """
+        count = self.dll.GetPortMonitorCounters(None, 0)
+        counters = (USBPortCounters * count)()
+        count = min(count, self.dll.GetPortMonitorCounters(counters, count))
+        
+        ports = []
+        for c in counters[:count]:
+            failures = (c.enumerationFailures + c.overcurrents + c.powerFailures +
+                        c.otherFailures)
+            if flaky_only and not (c.disconnects or c.reenumerations or c.resets or failures):
+                continue
+            ports.append({
+                "hub_path": c.hubPath.decode('utf-8'),
+                "port": c.port,
+                "hub_present": bool(c.hubPresent),
+                "status": _CONNECTION_STATUS_NAMES.get(c.status, c.status),
+                "vendor_id": f"0x{c.vendorId:04X}",
+                "product_id": f"0x{c.productId:04X}",
+                "connects": c.connects,
+                "disconnects": c.disconnects,
+                "reenumerations": c.reenumerations,
+                "resets": c.resets,
+                "enumeration_failures": c.enumerationFailures,
+                "overcurrents": c.overcurrents,
+                "power_failures": c.powerFailures,
+                "other_failures": c.otherFailures,
+                "query_errors": c.queryErrors,
+                "event_count": c.eventCount,
+                "last_change": self._filetime_to_unix(c.lastChange),
+            })
+        return ports
+    
+    def port_events(self, hub_path, port):
+        """Recent connection changes of one monitored port, oldest first"""
+        path = hub_path.encode('utf-8')
+        count = self.dll.GetPortMonitorEvents(path, port, None, 0)
+        if count < 0:
+            raise ValueError(f"Port {port} of {hub_path} is not monitored")
+        
+        events = (USBPortEvent * count)()
+        count = min(count, self.dll.GetPortMonitorEvents(path, port, events, count))
+        return [
+            {
+                "time": self._filetime_to_unix(e.time),
+                "kind": _PORT_EVENT_NAMES.get(e.kind, e.kind),
+                "previous_status": _CONNECTION_STATUS_NAMES.get(e.previousStatus,
+                                                                e.previousStatus),
+                "status": _CONNECTION_STATUS_NAMES.get(e.status, e.status),
+                "device_address": e.deviceAddress,
+                "vendor_id": f"0x{e.vendorId:04X}",
+                "product_id": f"0x{e.productId:04X}",
+            }
+            for e in events[:count]
+        ]
+    
+    def reset_port_counters(self):
+        """Zero the port monitor's counters and events, keeping current statuses"""
+        self.dll.ResetPortMonitorCounters()
     
     def _speed_to_string(self, speed):
         """Convert speed code to readable string"""
@@ -100,13 +1356,18 @@ class USBTopologyMapper:
             1: "Full Speed (12 Mbps)",
             2: "High Speed (480 Mbps)",
             3: "Super Speed (5 Gbps)",
+            4: "Super Speed+ (10 Gbps or more)",
             -1: "Unknown"
         }
         return speed_map.get(speed, "Unknown")
     
-    def print_topology(self):
-        """Print the USB topology in a readable format"""
-        devices = self.enumerate()
+    def print_topology(self, devices=None):
+        """Print the USB topology in a readable format
+
+        Pass the result of enumerate() to print it without scanning again.
+        """
+        if devices is None:
+            devices = self.enumerate()
         
         if not devices:
             print("No USB devices found.")
@@ -116,28 +1377,71 @@ class USBTopologyMapper:
         print("USB TOPOLOGY MAP")
         print("=" * 70)
         
-        # Group by hub
-        hubs = {}
-        for device in devices:
-            hub_idx = device["hub_index"]
-            if hub_idx not in hubs:
-                hubs[hub_idx] = []
-            hubs[hub_idx].append(device)
-        
-        for hub_idx in sorted(hubs.keys()):
-            print(f"\n[HUB {hub_idx}]")
-            for device in sorted(hubs[hub_idx], key=lambda x: x["port_number"]):
-                print(f"  Port {device['port_number']}:")
-                print(f"    Description: {device['description']}")
-                print(f"    Speed: {device['speed']}")
-                print(f"    VID: {device['vendor_id']}, PID: {device['product_id']}")
-                print(f"    Type: {'Hub (cascaded)' if device['is_hub'] else 'Device'}")
+        # The tree comes from the links in the dicts alone, so it matches
+        # whichever scan or context produced them
+        def linked(index):
+            return index if 0 <= index < len(devices) else -1
+        
+        def print_port(index, indent):
+            device = devices[index]
+            pad = "  " * indent
+            print(f"{pad}  Port {device['port_number']}:")
+            print(f"{pad}    Description: {device['description']}")
+            print(f"{pad}    Speed: {device['speed']}")
+            print(f"{pad}    VID: {device['vendor_id']}, PID: {device['product_id']}")
+            print(f"{pad}    Type: {'Hub (cascaded)' if device['is_hub'] else 'Device'}")
+            
+            # Ports of a cascaded hub are nested under the port it hangs off
+            child = linked(device["first_child"])
+            while child >= 0:
+                print_port(child, indent + 2)
+                child = linked(devices[child]["next_sibling"])
+        
+        # A hub's records are contiguous, so its first one starts the chain
+        for index, device in enumerate(devices):
+            if device["parent_index"] >= 0 or (
+                    index > 0 and devices[index - 1]["hub_index"] == device["hub_index"]):
+                continue
+            
+            print(f"\n[HUB {device['hub_index']}]")
+            while index >= 0:
+                print_port(index, 0)
+                index = linked(devices[index]["next_sibling"])
         
         print("\n" + "=" * 70)
     
-    def to_json(self, filepath=None):
-        """Export topology to JSON"""
-        devices = self.enumerate()
+    def save_snapshot(self, filepath, context=None):
+        """Write the current results to a compact binary file
+        
+        Much smaller and faster than to_json(). Returns the file size.
+        """
+        size = self.dll.SaveSnapshot(context, os.fspath(filepath).encode('utf-8'))
+        if size < 0:
+            raise RuntimeError(f"Failed to save snapshot to {filepath}")
+        return size
+    
+    def load_snapshot(self, filepath, context=None):
+        """Make a saved file the current results, as if it had been scanned
+        
+        Queries, changes() and topology_hash() then work on the loaded
+        topology. Returns its device count.
+        """
+        count = self.dll.LoadSnapshot(context, os.fspath(filepath).encode('utf-8'))
+        if count < 0:
+            raise RuntimeError(f"Failed to load snapshot from {filepath}")
+        return count
+    
+    def open_saved(self, filepath):
+        """Map a saved file and read it in place, without the DLL scanning
+        
+        See SavedTopology.
+        """
+        return SavedTopology(self, filepath)
+    
+    def to_json(self, filepath=None, devices=None):
+        """Export topology to JSON, scanning unless devices is given"""
+        if devices is None:
+            devices = self.enumerate()
         json_data = json.dumps(devices, indent=2)
         
         if filepath:
@@ -150,16 +1454,284 @@ class USBTopologyMapper:
         return json_data
 
 
+class TopologySession:
+    """Hub paths, handles and port counts kept open across refreshes
+    
+    Use as a context manager, or call close() when done:
+    
+        with mapper.open_session() as session:
+            devices = session.refresh()
+    """
+    def __init__(self, mapper, context=None):
+        self.mapper = mapper
+        self.context = context
+        self.handle = mapper.dll.OpenTopologySessionInContext(context)
+        if not self.handle:
+            raise RuntimeError("Failed to open USB topology session")
+    
+    def refresh(self, full=False):
+        """Re-query the hubs that changed since the last refresh
+        
+        Hubs with no device arriving or leaving keep their previous
+        devices. full=True queries every port again.
+        """
+        if not self.handle:
+            raise RuntimeError("USB topology session is closed")
+        
+        if full:
+            self.mapper.dll.InvalidateTopologySession(self.handle)
+        count = self.mapper.dll.RefreshTopology(self.handle)
+        if count < 0:
+            raise RuntimeError("Failed to refresh USB topology")
+        
+        return self.mapper.devices(context=self.context)
+    
+    def close(self):
+        if self.handle:
+            self.mapper.dll.CloseTopologySession(self.handle)
+            self.handle = None
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, exc_type, exc, tb):
+        self.close()
+
+
+class TopologyContext:
+    """Scan results owned by one caller
+    
+    Scans and rescans through a context publish only to it, so threads
+    with their own contexts never see each other's results. Readers get
+    an immutable snapshot and never wait for a scan in progress:
+    
+        with mapper.create_context() as ctx:
+            devices = ctx.enumerate(parallel=True)
+    """
+    def __init__(self, mapper):
+        self.mapper = mapper
+        self.handle = mapper.dll.CreateMapperContext()
+        if not self.handle:
+            raise RuntimeError("Failed to create USB mapper context")
+    
+    def _require_open(self):
+        if not self.handle:
+            raise RuntimeError("USB mapper context is closed")
+        return self.handle
+    
+    def enumerate(self, parallel=False, workers=0, overlapped=False):
+        return self.mapper.enumerate(parallel, workers, overlapped,
+                                     context=self._require_open())
+    
+    def enumerate_bounded(self, deadline_ms=2000, ioctl_timeout_ms=500):
+        return self.mapper.enumerate_bounded(deadline_ms, ioctl_timeout_ms,
+                                             context=self._require_open())
+    
+    def set_circuit_breaker(self, threshold=3, cooldown_ms=30000):
+        return self.mapper.set_circuit_breaker(threshold, cooldown_ms,
+                                               context=self._require_open())
+    
+    def devices(self):
+        return self.mapper.devices(context=self._require_open())
+    
+    def stream(self, callback):
+        return self.mapper.stream(callback, context=self._require_open())
+    
+    def find_first(self, predicate):
+        return self.mapper.find_first(predicate, context=self._require_open())
+    
+    def find_devices(self, **filters):
+        return self.mapper.find_devices(context=self._require_open(), **filters)
+    
+    def hubs(self):
+        return self.mapper.hubs(context=self._require_open())
+    
+    def unresolved_hubs(self):
+        return self.mapper.unresolved_hubs(context=self._require_open())
+    
+    def string_at(self, offset):
+        return self.mapper.string_at(offset, context=self._require_open())
+    
+    def save_snapshot(self, filepath):
+        return self.mapper.save_snapshot(filepath, context=self._require_open())
+    
+    def load_snapshot(self, filepath):
+        return self.mapper.load_snapshot(filepath, context=self._require_open())
+    
+    def snapshot(self):
+        return self.mapper.snapshot(self._require_open())
+    
+    def scan_status(self):
+        return self.mapper.scan_status(context=self._require_open())
+    
+    def scan_stats(self):
+        return self.mapper.scan_stats(context=self._require_open())
+    
+    def topology_hash(self):
+        return self.mapper.topology_hash(context=self._require_open())
+    
+    def changes(self):
+        return self.mapper.changes(context=self._require_open())
+    
+    def extended_info(self, index, fields=USB_EXT_ALL):
+        return self.mapper.extended_info(index, fields, context=self._require_open())
+    
+    def config_descriptor(self, index):
+        return self.mapper.config_descriptor(index, context=self._require_open())
+    
+    def controller_load(self):
+        return self.mapper.controller_load(context=self._require_open())
+    
+    def free_ports(self, min_speed=0, limit=None):
+        return self.mapper.free_ports(min_speed, limit, context=self._require_open())
+    
+    def find_port(self, port_path):
+        return self.mapper.find_port(port_path, context=self._require_open())
+    
+    def find_by_vid_pid(self, vendor_id, product_id):
+        return self.mapper.find_by_vid_pid(vendor_id, product_id, context=self._require_open())
+    
+    def find_hub(self, path):
+        return self.mapper.find_hub(path, context=self._require_open())
+    
+    def find_location(self, location_path):
+        return self.mapper.find_location(location_path, context=self._require_open())
+    
+    def port_path(self, index):
+        return self.mapper.port_path(index, context=self._require_open())
+    
+    def rescan_hub(self, target, descendants=False):
+        return self.mapper.rescan_hub(target, descendants, context=self._require_open())
+    
+    def open_session(self):
+        """Open a session that publishes into this context; close it first"""
+        return self.mapper.open_session(context=self._require_open())
+    
+    def close(self):
+        if self.handle:
+            self.mapper.dll.DestroyMapperContext(self.handle)
+            self.handle = None
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, exc_type, exc, tb):
+        self.close()
+
+
+class TopologyReader(TopologyContext):
+    """A context filled from another process's shared-memory publisher
+    
+    refresh() copies the publisher's latest snapshot into this context;
+    every query then works as if this process had scanned, without it
+    ever opening a hub:
+    
+        with mapper.attach_reader() as reader:
+            devices = reader.refresh()
+    """
+    def __init__(self, mapper, name=DEFAULT_PUBLISHER_NAME):
+        super().__init__(mapper)
+        self.reader = mapper.dll.OpenTopologyReader(name.encode('utf-8'))
+        if not self.reader:
+            super().close()
+            raise RuntimeError(f"No topology publisher named {name!r}")
+    
+    def sequence(self):
+        """Counter bumped by every snapshot the publisher writes"""
+        return self.mapper.dll.GetTopologyReaderSequence(self.reader)
+    
+    def refresh(self):
+        """Load the publisher's latest snapshot and return its devices"""
+        count = self.mapper.dll.RefreshFromTopologyReader(self.reader, self._require_open())
+        if count < 0:
+            raise RuntimeError("No topology published yet")
+        return self.devices()
+    
+    def close(self):
+        if self.reader:
+            self.mapper.dll.CloseTopologyReader(self.reader)
+            self.reader = None
+        super().close()
+
+
+class SavedTopology:
+    """A file written by save_snapshot(), mapped read-only
+    
+    records and hubs are ctypes arrays over the mapping itself, so opening
+    a file copies nothing. Use as a context manager, or call close():
+    
+        with mapper.open_saved("run-1234.usbsnap") as saved:
+            hubs_seen = {rec.hubIndex for rec in saved.records}
+            saved.to_json("run-1234.json")
+    """
+    def __init__(self, mapper, filepath):
+        self.mapper = mapper
+        with open(filepath, "rb") as f:
+            # Copy-on-write so ctypes can wrap it; nothing is ever written
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+        
+        try:
+            header = USBSnapshotFileHeader.from_buffer_copy(self._map)
+            if (header.magic != USB_SNAPSHOT_MAGIC or
+                    header.version != USB_SNAPSHOT_VERSION or
+                    header.recordSize != ctypes.sizeof(USBDeviceRecord) or
+                    header.hubRecordSize != ctypes.sizeof(USBHubRecord) or
+                    header.stringsOffset + header.stringTableSize > len(self._map)):
+                raise ValueError(f"{filepath} is not a compatible USB snapshot")
+            
+            self.header = header
+            self.records = (USBDeviceRecord * header.deviceCount).from_buffer(
+                self._map, header.recordsOffset)
+            self.hubs = (USBHubRecord * header.hubCount).from_buffer(
+                self._map, header.hubsOffset)
+        except Exception:
+            self._map.close()
+            raise
+    
+    def string_at(self, offset):
+        """Decode one string table entry"""
+        start = self.header.stringsOffset + offset
+        end = self._map.find(b"\0", start)
+        return self._map[start:end].decode('utf-8')
+    
+    def devices(self):
+        """The saved device list, like USBTopologyMapper.devices()"""
+        return [self.mapper._device_dict(rec, self.string_at) for rec in self.records]
+    
+    def to_json(self, filepath=None):
+        """Pretty-print the saved topology as JSON"""
+        json_data = json.dumps(self.devices(), indent=2)
+        if filepath:
+            with open(filepath, 'w') as f:
+                f.write(json_data)
+        return json_data
+    
+    def close(self):
+        if self._map is not None:
+            # The arrays hold exports of the mapping, so drop them first
+            self.records = None
+            self.hubs = None
+            self._map.close()
+            self._map = None
+    
+    def __enter__(self):
+        return self
+    
+    def __exit__(self, exc_type, exc, tb):
+        self.close()
+
+
 def main():
     try:
         mapper = USBTopologyMapper("usb_mapper.dll")
         
         print("Enumerating USB devices...\n")
-        mapper.print_topology()
+        devices = mapper.enumerate()
+        mapper.print_topology(devices)
         
         # Optionally save to JSON
         print("\nSaving to JSON...")
-        mapper.to_json("usb_topology.json")
+        mapper.to_json("usb_topology.json", devices)
         
     except Exception as e:
         print(f"Error: {e}")
@@ -1,5 +1,11 @@
+// CM_Register_Notification needs Windows 8 headers
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
 #include <windows.h>
 #include <setupapi.h>
+#include <cfgmgr32.h>
 #include <initguid.h>
 #include <usbioctl.h>
 #include <usbiodef.h>
@@ -7,19 +13,134 @@
 #include <stdlib.h>
 #include <string.h>
 
-// Note: For MinGW, link with -lsetupapi in the makefile
+// Note: For MinGW, link with -lsetupapi -lcfgmgr32 in the makefile
 // The #pragma comment is only for MSVC
 
-// Maximum devices we'll report
-#define MAX_DEVICES 256
+// Feature switches behind the makefile's build variants. Each defaults to
+// the full build; structure layouts follow them, which is why the Python
+// structures are generated per build by gen_layouts.py.
+#ifndef USB_MAPPER_DESCRIPTIONS
+#define USB_MAPPER_DESCRIPTIONS 1     // hub descriptions and location strings
+#endif
+#ifndef USB_MAPPER_EXTENDED
+#define USB_MAPPER_EXTENDED 1         // on-demand descriptors and the load report
+#endif
+#ifndef USB_MAPPER_STATS
+#define USB_MAPPER_STATS 1            // scan stats; 2 also turns them on at load
+#endif
+
+// Build with -DUSB_MAPPER_ETW (make ETW=1) to emit TraceLogging events
+// from the "NickJanes.UsbMapper" provider. Each call site is a single
+// enabled check while no trace session is listening.
+#ifdef USB_MAPPER_ETW
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+// {48256b3f-745f-4a99-9675-aa0900e87523}
+TRACELOGGING_DEFINE_PROVIDER(g_etwProvider, "NickJanes.UsbMapper",
+    (0x48256b3f, 0x745f, 0x4a99, 0x96, 0x75, 0xaa, 0x09, 0x00, 0xe8, 0x75, 0x23));
+#define USB_MAPPER_ETW_BUILT 1
+
+// Keywords, so a session can enable just the scans or the per-IOCTL events
+#define ETW_KEYWORD_SCAN  0x1
+#define ETW_KEYWORD_HUB   0x2
+#define ETW_KEYWORD_IOCTL 0x4
+
+#define ETW_SCAN_START(mode) \
+    TraceLoggingWrite(g_etwProvider, "Enumerate", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_START), \
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO), \
+        TraceLoggingKeyword(ETW_KEYWORD_SCAN), \
+        TraceLoggingInt32((mode), "Mode"))
+
+#define ETW_SCAN_STOP(mode, deviceCount, error) \
+    TraceLoggingWrite(g_etwProvider, "Enumerate", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP), \
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO), \
+        TraceLoggingKeyword(ETW_KEYWORD_SCAN), \
+        TraceLoggingInt32((mode), "Mode"), \
+        TraceLoggingInt32((deviceCount), "DeviceCount"), \
+        TraceLoggingWinError((error), "Error"))
+
+#define ETW_HUB_OPEN_START(hubPath) \
+    TraceLoggingWrite(g_etwProvider, "HubOpen", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_START), \
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), \
+        TraceLoggingKeyword(ETW_KEYWORD_HUB), \
+        TraceLoggingString((hubPath), "HubPath"))
+
+#define ETW_HUB_OPEN_STOP(hubPath, error) \
+    TraceLoggingWrite(g_etwProvider, "HubOpen", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP), \
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), \
+        TraceLoggingKeyword(ETW_KEYWORD_HUB), \
+        TraceLoggingString((hubPath), "HubPath"), \
+        TraceLoggingWinError((error), "Error"))
+
+// port is 0 for hub-wide IOCTLs. Overlapped IOCTLs log the stop event when
+// their completion packet is dequeued.
+#define ETW_IOCTL_START(ioctl, hubPath, port) \
+    TraceLoggingWrite(g_etwProvider, "DeviceIoControl", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_START), \
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), \
+        TraceLoggingKeyword(ETW_KEYWORD_IOCTL), \
+        TraceLoggingHexUInt32((ioctl), "IoControlCode"), \
+        TraceLoggingString((hubPath), "HubPath"), \
+        TraceLoggingInt32((port), "Port"))
+
+#define ETW_IOCTL_STOP(ioctl, hubPath, port, error) \
+    TraceLoggingWrite(g_etwProvider, "DeviceIoControl", \
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP), \
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), \
+        TraceLoggingKeyword(ETW_KEYWORD_IOCTL), \
+        TraceLoggingHexUInt32((ioctl), "IoControlCode"), \
+        TraceLoggingString((hubPath), "HubPath"), \
+        TraceLoggingInt32((port), "Port"), \
+        TraceLoggingWinError((error), "Error"))
+#else
+#define ETW_SCAN_START(mode) ((void)0)
+#define ETW_SCAN_STOP(mode, deviceCount, error) ((void)0)
+#define ETW_HUB_OPEN_START(hubPath) ((void)0)
+#define ETW_HUB_OPEN_STOP(hubPath, error) ((void)0)
+#define ETW_IOCTL_START(ioctl, hubPath, port) ((void)0)
+#define ETW_IOCTL_STOP(ioctl, hubPath, port, error) ((void)0)
+#define USB_MAPPER_ETW_BUILT 0
+#endif
+
+// GetMapperFeatures() bits, one per switch above
+#define USB_FEATURE_DESCRIPTIONS 0x01
+#define USB_FEATURE_EXTENDED     0x02
+#define USB_FEATURE_STATS        0x04
+#define USB_FEATURE_ETW          0x08
+
+// Plain arithmetic, so gen_layouts.py can evaluate the expansion
+#define USB_MAPPER_FEATURES (USB_MAPPER_DESCRIPTIONS * USB_FEATURE_DESCRIPTIONS | \
+                             USB_MAPPER_EXTENDED * USB_FEATURE_EXTENDED | \
+                             (USB_MAPPER_STATS > 0) * USB_FEATURE_STATS | \
+                             USB_MAPPER_ETW_BUILT * USB_FEATURE_ETW)
+
+// String limits for hub paths and descriptions. Driver keys use
+// MAX_DESC_LEN too, so it can't go much below 64.
+#ifndef MAX_PATH_LEN
 #define MAX_PATH_LEN 512
+#endif
+#ifndef MAX_DESC_LEN
 #define MAX_DESC_LEN 256
+#endif
+
+// Description strings shrink to the terminator when they are compiled out
+#if USB_MAPPER_DESCRIPTIONS
+#define USB_DESCRIPTION_LEN MAX_DESC_LEN
+#else
+#define USB_DESCRIPTION_LEN 1
+#endif
 
-// Simplified structure for returning to Python
+// Simplified structure for returning to Python (v1 compatibility layout,
+// expanded on demand from USBDeviceRecord)
 typedef struct {
     int hubIndex;
     int portNumber;
-    char deviceDesc[MAX_DESC_LEN];
+    char deviceDesc[USB_DESCRIPTION_LEN];
     char devicePath[MAX_PATH_LEN];
     int isHub;
     int speed;  // 0=Low, 1=Full, 2=High, 3=Super
@@ -27,48 +148,438 @@ typedef struct {
     unsigned short productId;
 } USBDeviceInfo;
 
-// Global array to store results (simple approach for DLL)
-static USBDeviceInfo g_devices[MAX_DEVICES];
-static int g_deviceCount = 0;
+// USBDeviceRecord.flags
+#define USB_RECORD_FLAG_HUB 0x01
 
-// Function to get device property string
-BOOL GetDeviceProperty(HDEVINFO deviceInfoSet, PSP_DEVINFO_DATA deviceInfoData, 
-                       DWORD property, char* buffer, DWORD bufferSize) {
-    DWORD dataType;
-    DWORD requiredSize;
+// Compact v2 record. Strings are offsets into the string table returned
+// by GetStringTable(); every port on a hub shares the same two strings.
+typedef struct {
+    int hubIndex;
+    unsigned short portNumber;
+    unsigned short vendorId;
+    unsigned short productId;
+    signed char speed;            // 0=Low, 1=Full, 2=High, 3=Super, 4=SuperPlus, -1=Unknown
+    unsigned char flags;          // USB_RECORD_FLAG_*
+    unsigned int hubPathOffset;
+    unsigned int hubDescOffset;
     
-    if (SetupDiGetDeviceRegistryPropertyA(deviceInfoSet, deviceInfoData, property,
-                                          &dataType, (PBYTE)buffer, bufferSize, 
-                                          &requiredSize)) {
-        return TRUE;
+    // Tree links, rebuilt whenever the records change. Links are record
+    // indices, -1 if none.
+    int childHubIndex;            // hub attached to this port, if it is a hub
+    int parentIndex;              // port record that this record's hub hangs off
+    int firstChild;               // first record on childHubIndex
+    int nextSibling;              // next record on the same hub
+    unsigned short depth;         // 0 for ports on a root hub
+    unsigned short deviceAddress; // USB address, new each time the device enumerates
+} USBDeviceRecord;
+
+// Interned NUL-terminated strings addressed by byte offset. Offset 0 is
+// always the empty string.
+typedef struct {
+    char* data;
+    unsigned int size;
+    unsigned int capacity;
+    unsigned int* slots;          // open-addressed offsets, 0 = free
+    unsigned int slotCount;
+    unsigned int used;
+} StringTable;
+
+// Bump allocator over a chain of blocks. Resetting rewinds every block
+// for reuse instead of freeing it.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    ArenaBlock* tail;
+    ArenaBlock* current;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static unsigned int HashString(const char* str) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
     }
-    return FALSE;
+    return hash;
 }
 
-// Function to open a device handle
-HANDLE OpenDeviceHandle(const char* devicePath) {
-    HANDLE hDevice = CreateFileA(
-        devicePath,
+// Empty the table but keep its buffers for the next scan
+static void StringTableReset(StringTable* table) {
+    table->size = 0;
+    table->used = 0;
+    if (table->slots != NULL) {
+        memset(table->slots, 0, table->slotCount * sizeof(unsigned int));
+    }
+}
+
+static BOOL StringTableGrowSlots(StringTable* table) {
+    unsigned int slotCount = table->slotCount ? table->slotCount * 2 : 64;
+    unsigned int* slots = (unsigned int*)calloc(slotCount, sizeof(unsigned int));
+    if (slots == NULL) {
+        return FALSE;
+    }
+    
+    for (unsigned int i = 0; i < table->slotCount; i++) {
+        unsigned int offset = table->slots[i];
+        if (offset == 0) {
+            continue;
+        }
+        unsigned int slot = HashString(table->data + offset) & (slotCount - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        slots[slot] = offset;
+    }
+    
+    free(table->slots);
+    table->slots = slots;
+    table->slotCount = slotCount;
+    return TRUE;
+}
+
+// Return the offset of str, adding it if it isn't in the table yet.
+// Falls back to the empty string if memory runs out.
+static unsigned int StringTableIntern(StringTable* table, const char* str) {
+    if (table->size == 0) {
+        if (table->capacity == 0) {
+            table->data = (char*)malloc(4096);
+            if (table->data == NULL) {
+                return 0;
+            }
+            table->capacity = 4096;
+        }
+        table->data[0] = '\0';
+        table->size = 1;
+    }
+    
+    if (str == NULL || str[0] == '\0') {
+        return 0;
+    }
+    
+    // Keep the load factor under 1/2
+    if ((table->used + 1) * 2 > table->slotCount && !StringTableGrowSlots(table)) {
+        return 0;
+    }
+    
+    unsigned int slot = HashString(str) & (table->slotCount - 1);
+    while (table->slots[slot] != 0) {
+        if (strcmp(table->data + table->slots[slot], str) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & (table->slotCount - 1);
+    }
+    
+    unsigned int length = (unsigned int)strlen(str) + 1;
+    if (table->size + length > table->capacity) {
+        unsigned int capacity = table->capacity;
+        while (table->size + length > capacity) {
+            capacity *= 2;
+        }
+        char* grown = (char*)realloc(table->data, capacity);
+        if (grown == NULL) {
+            return 0;
+        }
+        table->data = grown;
+        table->capacity = capacity;
+    }
+    
+    unsigned int offset = table->size;
+    memcpy(table->data + offset, str, length);
+    table->size += length;
+    table->slots[slot] = offset;
+    table->used++;
+    return offset;
+}
+
+// Make dst a copy of src, reusing dst's buffers where they are big enough
+static BOOL StringTableCopy(StringTable* dst, const StringTable* src) {
+    if (src->size > dst->capacity) {
+        char* grown = (char*)realloc(dst->data, src->capacity);
+        if (grown == NULL) {
+            return FALSE;
+        }
+        dst->data = grown;
+        dst->capacity = src->capacity;
+    }
+    
+    if (src->slotCount != dst->slotCount) {
+        unsigned int* slots = (unsigned int*)malloc((src->slotCount ? src->slotCount : 1) *
+                                                    sizeof(unsigned int));
+        if (slots == NULL) {
+            return FALSE;
+        }
+        free(dst->slots);
+        dst->slots = slots;
+        dst->slotCount = src->slotCount;
+    }
+    
+    if (src->size > 0) {
+        memcpy(dst->data, src->data, src->size);
+    }
+    if (src->slotCount > 0) {
+        memcpy(dst->slots, src->slots, src->slotCount * sizeof(unsigned int));
+    }
+    dst->size = src->size;
+    dst->used = src->used;
+    return TRUE;
+}
+
+static void* ArenaAlloc(Arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    
+    // Use the first retained block with room before adding a new one
+    ArenaBlock* block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+    
+    if (block == NULL) {
+        size_t blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = NULL;
+        block->size = blockSize;
+        block->used = 0;
+        
+        if (arena->tail != NULL) {
+            arena->tail->next = block;
+        } else {
+            arena->head = block;
+        }
+        arena->tail = block;
+    }
+    
+    arena->current = block;
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static void ArenaReset(Arena* arena) {
+    for (ArenaBlock* block = arena->head; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->head;
+}
+
+static void ArenaFree(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->tail = NULL;
+    arena->current = NULL;
+}
+
+// Every Win32 call the scan paths make to discover hubs and talk to them
+// goes through this table. g_win32Backend is the real thing; the benchmark
+// in usb_mapper_bench.c installs a synthetic topology in its place. Strings
+// come back from Windows as UTF-16 and device paths go in as UTF-8.
+typedef struct {
+    HDEVINFO (*GetClassDevs)(const GUID* classGuid, DWORD flags);
+    BOOL (*EnumDeviceInterfaces)(HDEVINFO deviceInfoSet, const GUID* classGuid,
+                                 DWORD memberIndex,
+                                 PSP_DEVICE_INTERFACE_DATA interfaceData);
+    BOOL (*GetDeviceInterfaceDetail)(HDEVINFO deviceInfoSet,
+                                     PSP_DEVICE_INTERFACE_DATA interfaceData,
+                                     PSP_DEVICE_INTERFACE_DETAIL_DATA_W detail,
+                                     DWORD detailSize, PDWORD requiredSize,
+                                     PSP_DEVINFO_DATA deviceInfoData);
+    BOOL (*GetDeviceRegistryProperty)(HDEVINFO deviceInfoSet, PSP_DEVINFO_DATA deviceInfoData,
+                                      DWORD property, PBYTE buffer, DWORD bufferSize);
+    BOOL (*DestroyDeviceInfoList)(HDEVINFO deviceInfoSet);
+    HANDLE (*OpenDevice)(const char* devicePath, DWORD flags);
+    BOOL (*IoControl)(HANDLE hDevice, DWORD ioctl, LPVOID buffer, DWORD bufferSize,
+                      LPDWORD bytesReturned, LPOVERLAPPED overlapped);
+    BOOL (*GetOverlappedResult)(HANDLE hDevice, LPOVERLAPPED overlapped,
+                                LPDWORD bytesReturned, BOOL wait);
+    BOOL (*BindCompletionPort)(HANDLE hDevice, HANDLE iocp, ULONG_PTR key);
+    BOOL (*CancelIo)(HANDLE hDevice);
+    BOOL (*CloseDevice)(HANDLE hDevice);
+} UsbBackend;
+
+static HDEVINFO Win32GetClassDevs(const GUID* classGuid, DWORD flags) {
+    return SetupDiGetClassDevs(classGuid, NULL, NULL, flags);
+}
+
+static BOOL Win32EnumDeviceInterfaces(HDEVINFO deviceInfoSet, const GUID* classGuid,
+                                      DWORD memberIndex,
+                                      PSP_DEVICE_INTERFACE_DATA interfaceData) {
+    return SetupDiEnumDeviceInterfaces(deviceInfoSet, NULL, classGuid, memberIndex,
+                                       interfaceData);
+}
+
+static BOOL Win32GetDeviceInterfaceDetail(HDEVINFO deviceInfoSet,
+                                          PSP_DEVICE_INTERFACE_DATA interfaceData,
+                                          PSP_DEVICE_INTERFACE_DETAIL_DATA_W detail,
+                                          DWORD detailSize, PDWORD requiredSize,
+                                          PSP_DEVINFO_DATA deviceInfoData) {
+    return SetupDiGetDeviceInterfaceDetailW(deviceInfoSet, interfaceData, detail, detailSize,
+                                            requiredSize, deviceInfoData);
+}
+
+static BOOL Win32GetDeviceRegistryProperty(HDEVINFO deviceInfoSet,
+                                           PSP_DEVINFO_DATA deviceInfoData,
+                                           DWORD property, PBYTE buffer, DWORD bufferSize) {
+    DWORD dataType;
+    DWORD requiredSize;
+    return SetupDiGetDeviceRegistryPropertyW(deviceInfoSet, deviceInfoData, property,
+                                             &dataType, buffer, bufferSize, &requiredSize);
+}
+
+static BOOL Win32DestroyDeviceInfoList(HDEVINFO deviceInfoSet) {
+    return SetupDiDestroyDeviceInfoList(deviceInfoSet);
+}
+
+static HANDLE Win32OpenDevice(const char* devicePath, DWORD flags) {
+    WCHAR widePath[MAX_PATH_LEN];
+    
+    if (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, devicePath, -1,
+                            widePath, MAX_PATH_LEN) == 0) {
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    return CreateFileW(
+        widePath,
         GENERIC_WRITE | GENERIC_READ,
         FILE_SHARE_WRITE | FILE_SHARE_READ,
         NULL,
         OPEN_EXISTING,
-        0,
+        flags,
         NULL
     );
-    return hDevice;
+}
+
+static BOOL Win32IoControl(HANDLE hDevice, DWORD ioctl, LPVOID buffer, DWORD bufferSize,
+                           LPDWORD bytesReturned, LPOVERLAPPED overlapped) {
+    return DeviceIoControl(hDevice, ioctl, buffer, bufferSize, buffer, bufferSize,
+                           bytesReturned, overlapped);
+}
+
+static BOOL Win32GetOverlappedResult(HANDLE hDevice, LPOVERLAPPED overlapped,
+                                     LPDWORD bytesReturned, BOOL wait) {
+    return GetOverlappedResult(hDevice, overlapped, bytesReturned, wait);
+}
+
+static BOOL Win32BindCompletionPort(HANDLE hDevice, HANDLE iocp, ULONG_PTR key) {
+    return CreateIoCompletionPort(hDevice, iocp, key, 0) != NULL;
+}
+
+static BOOL Win32CancelIo(HANDLE hDevice) {
+    return CancelIoEx(hDevice, NULL);
+}
+
+static BOOL Win32CloseDevice(HANDLE hDevice) {
+    return CloseHandle(hDevice);
+}
+
+static const UsbBackend g_win32Backend = {
+    Win32GetClassDevs,
+    Win32EnumDeviceInterfaces,
+    Win32GetDeviceInterfaceDetail,
+    Win32GetDeviceRegistryProperty,
+    Win32DestroyDeviceInfoList,
+    Win32OpenDevice,
+    Win32IoControl,
+    Win32GetOverlappedResult,
+    Win32BindCompletionPort,
+    Win32CancelIo,
+    Win32CloseDevice
+};
+
+static const UsbBackend* g_backend = &g_win32Backend;
+
+// Convert UTF-16 to UTF-8 in out. inChars < 0 reads up to the terminator.
+// A string that doesn't fit is cut at a character boundary, so out is
+// always valid UTF-8; unpaired surrogates become U+FFFD. Returns the length.
+static int WideToUtf8(const WCHAR* in, int inChars, char* out, int capacity) {
+    int len = 0;
+    
+    if (capacity <= 0) {
+        return 0;
+    }
+    
+    for (int i = 0; (inChars < 0 || i < inChars) && in[i] != L'\0'; i++) {
+        unsigned int c = in[i];
+        
+        if (c >= 0xD800 && c <= 0xDBFF && (inChars < 0 || i + 1 < inChars) &&
+            in[i + 1] >= 0xDC00 && in[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[i + 1] - 0xDC00);
+            i++;
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD;
+        }
+        
+        int n = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+        if (len + n >= capacity) {
+            break;
+        }
+        
+        if (n == 1) {
+            out[len++] = (char)c;
+        } else if (n == 2) {
+            out[len++] = (char)(0xC0 | (c >> 6));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        } else if (n == 3) {
+            out[len++] = (char)(0xE0 | (c >> 12));
+            out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        } else {
+            out[len++] = (char)(0xF0 | (c >> 18));
+            out[len++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[len++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    
+    out[len] = '\0';
+    return len;
+}
+
+// Function to get device property string, as UTF-8. bufferSize is in bytes.
+BOOL GetDeviceProperty(HDEVINFO deviceInfoSet, PSP_DEVINFO_DATA deviceInfoData, 
+                       DWORD property, char* buffer, DWORD bufferSize) {
+    WCHAR wide[MAX_PATH_LEN];
+    
+    ZeroMemory(wide, sizeof(wide));
+    if (!g_backend->GetDeviceRegistryProperty(deviceInfoSet, deviceInfoData, property,
+                                              (PBYTE)wide, sizeof(wide) - sizeof(WCHAR))) {
+        return FALSE;
+    }
+    
+    WideToUtf8(wide, -1, buffer, (int)bufferSize);
+    return TRUE;
+}
+
+// Function to open a device handle with extra CreateFile flags
+HANDLE OpenDeviceHandleEx(const char* devicePath, DWORD flags) {
+    return g_backend->OpenDevice(devicePath, flags);
+}
+
+// Function to open a device handle
+HANDLE OpenDeviceHandle(const char* devicePath) {
+    return OpenDeviceHandleEx(devicePath, 0);
 }
 
 // Query USB hub node information
 BOOL GetHubNodeInfo(HANDLE hHub, PUSB_NODE_INFORMATION nodeInfo) {
     DWORD bytesReturned;
-    return DeviceIoControl(
+    return g_backend->IoControl(
         hHub,
         IOCTL_USB_GET_NODE_INFORMATION,
         nodeInfo,
         sizeof(USB_NODE_INFORMATION),
-        nodeInfo,
-        sizeof(USB_NODE_INFORMATION),
         &bytesReturned,
         NULL
     );
@@ -80,140 +591,6600 @@ BOOL GetPortConnectorProperties(HANDLE hHub, int portIndex,
     DWORD bytesReturned;
     connInfo->ConnectionIndex = portIndex;
     
-    return DeviceIoControl(
+    return g_backend->IoControl(
         hHub,
         IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
         connInfo,
         sizeof(USB_NODE_CONNECTION_INFORMATION_EX),
-        connInfo,
-        sizeof(USB_NODE_CONNECTION_INFORMATION_EX),
         &bytesReturned,
         NULL
     );
 }
 
-// Main enumeration function - exported to Python
-__declspec(dllexport) int EnumerateUSBDevices() {
-    HDEVINFO deviceInfoSet;
-    SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
-    PSP_DEVICE_INTERFACE_DETAIL_DATA_A deviceInterfaceDetailData;
-    DWORD requiredSize;
-    DWORD hubIndex = 0;
+// HubEntry/USBHubRecord.scanFlags, set by overlapped and bounded scans and,
+// for USB_HUB_SCAN_UNRESOLVED, whenever the tree is rebuilt
+#define USB_HUB_SCAN_TIMED_OUT  0x01  // IOCTLs were cancelled at the timeout or deadline
+#define USB_HUB_SCAN_FAILED     0x02  // the open or an IOCTL failed
+#define USB_HUB_SCAN_SKIPPED    0x04  // circuit breaker open, the hub wasn't queried
+#define USB_HUB_SCAN_PARTIAL    0x08  // some of the hub's ports are missing
+#define USB_HUB_SCAN_UNRESOLVED 0x10  // a cascaded hub no port record links to; not a root
+
+// A hub discovered through SetupAPI, ready to be probed
+typedef struct {
+    char devicePath[MAX_PATH_LEN];
+    char hubDesc[USB_DESCRIPTION_LEN];
+    char driverKey[MAX_DESC_LEN];
+    char locationInfo[USB_DESCRIPTION_LEN];
+    char locationPath[MAX_PATH_LEN];  // first entry of SPDRP_LOCATION_PATHS
+    DEVINST devInst;
+    unsigned int pathOffset;      // in the snapshot's strings, set when published
+    unsigned int descOffset;
+    unsigned int driverKeyOffset;
+    unsigned int locationInfoOffset;
+    unsigned int locationPathOffset;
+    unsigned int scanFlags;       // USB_HUB_SCAN_*
     
-    // Reset global state
-    g_deviceCount = 0;
-    memset(g_devices, 0, sizeof(g_devices));
+    // Tree position, rebuilt with the record links
+    int parentRecord;             // port record this hub is attached to, or -1
+    int rootOrdinal;              // position among root hubs, or -1
+    int depth;
+    int firstRecord;              // this hub's records are contiguous
+    int recordCount;
+    int portTableOffset;          // into the snapshot's portTable, indexed by port number
+    int maxPort;
+} HubEntry;
+
+// Per-hub properties shared by every record on the hub. Strings are
+// offsets into the string table, like USBDeviceRecord.
+typedef struct {
+    int hubIndex;
+    unsigned int pathOffset;
+    unsigned int descOffset;
+    unsigned int driverKeyOffset;
+    unsigned int locationInfoOffset;
+    unsigned int locationPathOffset;
+    int parentRecord;             // port record this hub is attached to, or -1
+    int rootOrdinal;              // position among root hubs, or -1
+    int depth;                    // 0 for root hubs
+    int firstRecord;              // first of recordCount contiguous records
+    int recordCount;
+    unsigned int scanFlags;       // USB_HUB_SCAN_*
+} USBHubRecord;
+
+// USBRecordChange.kind
+#define USB_CHANGE_ADDED    1
+#define USB_CHANGE_REMOVED  2
+#define USB_CHANGE_MODIFIED 3
+
+// USBRecordChange.fields, set for USB_CHANGE_MODIFIED
+#define USB_CHANGE_FIELD_VENDOR  0x01
+#define USB_CHANGE_FIELD_PRODUCT 0x02
+#define USB_CHANGE_FIELD_SPEED   0x04
+#define USB_CHANGE_FIELD_FLAGS   0x08
+#define USB_CHANGE_FIELD_ADDRESS 0x10    // re-enumerated, e.g. unplugged and replugged
+
+// One record that differs from the previous snapshot, keyed by hub path
+// and port. Values of the side that doesn't exist are 0, speed -1.
+typedef struct {
+    unsigned char kind;           // USB_CHANGE_*
+    unsigned char fields;         // USB_CHANGE_FIELD_*
+    unsigned short portNumber;
+    unsigned int hubPathOffset;   // into this snapshot's string table
+    int recordIndex;              // in this snapshot, -1 if removed
+    unsigned short vendorId;
+    unsigned short productId;
+    signed char speed;
+    unsigned char flags;
+    unsigned short oldVendorId;
+    unsigned short oldProductId;
+    signed char oldSpeed;
+    unsigned char oldFlags;
+} USBRecordChange;
+
+// EnumerateUSBDevicesInContext() modes, also reported in ScanStats.mode
+#define ENUM_MODE_SERIAL     0
+#define ENUM_MODE_PARALLEL   1
+#define ENUM_MODE_OVERLAPPED 2
+#define ENUM_MODE_SESSION    3    // RefreshTopology(), stats only
+#define ENUM_MODE_BOUNDED    4    // overlapped, within a deadline and IOCTL timeouts
+
+// Whole-scan timings and error counters. Times are in microseconds.
+typedef struct {
+    int mode;                     // ENUM_MODE_*
+    int hubCount;
+    int deviceCount;
+    int portQueries;
+    int failedOpens;              // hubs whose CreateFileA failed
+    int ioctlErrors;              // failed hub and port IOCTLs
+    unsigned int lastError;       // GetLastError() of the last failure
+    int slowestHub;               // -1 if no hub was probed
+    double slowestHubUs;
+    double totalUs;
+    double collectHubsUs;         // SetupDi hub discovery
+    double probeUs;               // opening hubs and querying ports
+    double publishUs;             // building and swapping in the snapshot
+    int cachedHubs;               // session hubs reused without any IOCTL
+} ScanStats;
+
+// Per-hub timings from the last scan
+typedef struct {
+    int hubIndex;
+    int portCount;                // ports queried
+    int openFailed;
+    int ioctlErrors;
+    unsigned int lastError;
+    int slowestPort;              // 0 if no port was queried
+    double slowestPortUs;
+    double openUs;                // CreateFileA
+    double nodeInfoUs;            // IOCTL_USB_GET_NODE_INFORMATION
+    double portsUs;               // every port query on the hub
+    int firstPortStat;            // this hub's entries in GetPortScanStats()
+} HubScanStats;
+
+// One port query from the last scan: the connection information IOCTL,
+// plus the driver key lookup for cascaded hubs
+typedef struct {
+    int hubIndex;
+    int port;
+    double elapsedUs;
+    unsigned int error;           // 0 on success
+} PortScanStats;
+
+// Stats of a context's last full scan, replaced as a whole
+typedef struct {
+    ScanStats summary;
+    HubScanStats* hubs;
+    PortScanStats* ports;
+    int portCount;
+} ScanStatsReport;
+
+static void FreeScanStatsReport(ScanStatsReport* report) {
+    if (report != NULL) {
+        free(report->hubs);
+        free(report->ports);
+        free(report);
+    }
+}
+
+// One published topology: the records, strings and hub cache of a scan
+// plus the tree tables built from them. A snapshot never changes once it
+// is published; scans and patches build the next one off to the side.
+// Freed when the last reference is released.
+typedef struct TopologySnapshot {
+    volatile LONG refCount;       // one for the owning context, one per reader
+    LONG generation;
     
-    // Get all USB hub devices
-    deviceInfoSet = SetupDiGetClassDevs(
-        &GUID_DEVINTERFACE_USB_HUB,
-        NULL,
-        NULL,
-        DIGCF_PRESENT | DIGCF_DEVICEINTERFACE
-    );
+    // Records are allocated from recordArena. The store grows without
+    // limit; droppedCount counts devices that could not be stored because
+    // memory ran out.
+    Arena recordArena;
+    USBDeviceRecord* records;
+    int recordCapacity;
+    int deviceCount;
+    int droppedCount;
+    StringTable strings;
     
-    if (deviceInfoSet == INVALID_HANDLE_VALUE) {
-        return -1;
-    }
+    // Hubs, indexed by hubIndex
+    HubEntry* hubs;
+    int hubCount;
     
-    deviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+    // Port number -> record index for every hub, and root hubs in order.
+    // Rebuilt with the tree.
+    int* portTable;
+    int portTableCapacity;
+    int* rootHubs;
+    int rootHubCapacity;
+    int rootHubCount;
     
-    // Enumerate each USB hub
-    while (SetupDiEnumDeviceInterfaces(deviceInfoSet, NULL, 
-                                       &GUID_DEVINTERFACE_USB_HUB,
-                                       hubIndex, &deviceInterfaceData)) {
-        
-        // Get required size for device path
-        SetupDiGetDeviceInterfaceDetailA(deviceInfoSet, &deviceInterfaceData,
-                                         NULL, 0, &requiredSize, NULL);
-        
-        deviceInterfaceDetailData = (PSP_DEVICE_INTERFACE_DETAIL_DATA_A)
-                                    malloc(requiredSize);
-        deviceInterfaceDetailData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
-        
-        SP_DEVINFO_DATA deviceInfoData;
-        deviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
-        
-        // Get device path
-        if (SetupDiGetDeviceInterfaceDetailA(deviceInfoSet, &deviceInterfaceData,
-                                            deviceInterfaceDetailData, requiredSize,
-                                            NULL, &deviceInfoData)) {
-            
-            // Open the hub to query its ports
-            HANDLE hHub = OpenDeviceHandle(deviceInterfaceDetailData->DevicePath);
-            if (hHub != INVALID_HANDLE_VALUE) {
-                USB_NODE_INFORMATION nodeInfo;
-                ZeroMemory(&nodeInfo, sizeof(nodeInfo));
-                
-                if (GetHubNodeInfo(hHub, &nodeInfo)) {
-                    int numPorts = nodeInfo.u.HubInformation.HubDescriptor.bNumberOfPorts;
-                    
-                    // Check each port
-                    for (int port = 1; port <= numPorts; port++) {
-                        USB_NODE_CONNECTION_INFORMATION_EX connInfo;
-                        ZeroMemory(&connInfo, sizeof(connInfo));
-                        
-                        if (GetPortConnectorProperties(hHub, port, &connInfo)) {
-                            if (connInfo.ConnectionStatus == DeviceConnected) {
-                                if (g_deviceCount < MAX_DEVICES) {
-                                    USBDeviceInfo* dev = &g_devices[g_deviceCount];
-                                    
-                                    dev->hubIndex = hubIndex;
-                                    dev->portNumber = port;
-                                    dev->isHub = connInfo.DeviceIsHub ? 1 : 0;
-                                    dev->vendorId = connInfo.DeviceDescriptor.idVendor;
-                                    dev->productId = connInfo.DeviceDescriptor.idProduct;
-                                    
-                                    // Map speed enum to simpler int
-                                    switch (connInfo.Speed) {
-                                        case UsbLowSpeed:  dev->speed = 0; break;
-                                        case UsbFullSpeed: dev->speed = 1; break;
-                                        case UsbHighSpeed: dev->speed = 2; break;
-                                        case UsbSuperSpeed: dev->speed = 3; break;
-                                        default: dev->speed = -1;
-                                    }
-                                    
-                                    // Get device description
-                                    char hubDesc[256] = {0};
-                                    GetDeviceProperty(deviceInfoSet, &deviceInfoData, 
-                                                    SPDRP_DEVICEDESC, hubDesc, sizeof(hubDesc));
-                                    snprintf(dev->deviceDesc, MAX_DESC_LEN, 
-                                            "Hub: %s, Port: %d", hubDesc, port);
-                                    
-                                    strncpy(dev->devicePath, deviceInterfaceDetailData->DevicePath, 
-                                           MAX_PATH_LEN - 1);
-                                    
-                                    g_deviceCount++;
-                                }
-                            }
-                        }
-                    }
-                }
-                
-                CloseHandle(hHub);
-            }
-        }
-        
-        free(deviceInterfaceDetailData);
-        hubIndex++;
-    }
+    // Hash indexes: open-addressed, power-of-two slot counts, -1 for an
+    // empty slot. The hub indexes map device paths, then location paths,
+    // to a hubIndex; patches that keep the hub set copy them over. The
+    // VID/PID index is rebuilt with the tree and holds the first record of
+    // each VID/PID, the rest following through vidPidNext in record order.
+    int* hubSlots;                // device path slots, then location path slots
+    int hubSlotCapacity;
+    int hubSlotCount;             // per index, 0 until built
+    int* vidPidSlots;
+    int vidPidSlotCapacity;
+    int vidPidSlotCount;          // 0 until built
+    int* vidPidNext;              // next record with the same VID/PID, or -1
+    int vidPidNextCapacity;
+    
+    // Records that differ from the snapshot published before this one, and
+    // a hash of every record's key and contents. Both are built at commit.
+    USBRecordChange* changes;
+    int changeCapacity;
+    int changeCount;              // -1 if the change set couldn't be built
+    LONG baseGeneration;          // generation diffed against, 0 for none
+    unsigned long long topologyHash;
+} TopologySnapshot;
+
+// USBDeviceFilter.flags
+#define USB_FILTER_HUBS_ONLY    0x01
+#define USB_FILTER_DEVICES_ONLY 0x02
+
+// USBDeviceFilter.speedMask bits; 0 accepts every speed
+#define USB_FILTER_SPEED_LOW     0x01
+#define USB_FILTER_SPEED_FULL    0x02
+#define USB_FILTER_SPEED_HIGH    0x04
+#define USB_FILTER_SPEED_SUPER   0x08
+#define USB_FILTER_SPEED_UNKNOWN 0x10
+#define USB_FILTER_SPEED_SUPERPLUS 0x20    // SPEED_SUPER also takes these
+
+#define USB_FILTER_MAX_IDS 16
+
+// Record predicate for SnapshotFilterRecords(). Every set condition must
+// hold. A record passes the ID lists if they are both empty, its vendor is
+// in vendorIds, or its (vendorId << 16 | productId) is in products.
+typedef struct {
+    unsigned int flags;           // USB_FILTER_*
+    unsigned int speedMask;       // USB_FILTER_SPEED_*
+    int vendorCount;
+    unsigned short vendorIds[USB_FILTER_MAX_IDS];
+    int productCount;
+    unsigned int products[USB_FILTER_MAX_IDS];
+    char hubPathPrefix[MAX_PATH_LEN];  // case-insensitive, empty for any hub
+} USBDeviceFilter;
+
+// GetDeviceExtendedInfo() field mask
+#define USB_EXT_SERIAL_NUMBER 0x01    // string descriptor iSerialNumber
+#define USB_EXT_CONFIG_DESC   0x02    // full configuration descriptor 0
+#define USB_EXT_SPEED_V2      0x04    // CONNECTION_INFORMATION_EX_V2 capabilities
+#define USB_EXT_PORT_CONNECTOR 0x08   // PORT_CONNECTOR_PROPERTIES and the companion port
+#define USB_EXT_ALL           0x0F
+
+// USBExtendedInfo.supportedProtocols, as in USB_PROTOCOLS
+#define USB_EXT_PROTOCOL_USB110 0x01
+#define USB_EXT_PROTOCOL_USB200 0x02
+#define USB_EXT_PROTOCOL_USB300 0x04
+
+// USBExtendedInfo.speedFlags, as in USB_NODE_CONNECTION_INFORMATION_EX_V2_FLAGS
+#define USB_EXT_SPEED_OPERATING_SS      0x01
+#define USB_EXT_SPEED_CAPABLE_SS        0x02
+#define USB_EXT_SPEED_OPERATING_SSPLUS  0x04
+#define USB_EXT_SPEED_CAPABLE_SSPLUS    0x08
+
+// USBExtendedInfo.portFlags, as in USB_PORT_PROPERTIES
+#define USB_EXT_PORT_USER_CONNECTABLE      0x01
+#define USB_EXT_PORT_DEBUG_CAPABLE         0x02
+#define USB_EXT_PORT_MULTIPLE_COMPANIONS   0x04
+#define USB_EXT_PORT_TYPE_C                0x08
+
+// Extended data of one device. Only the fields flagged in fields are set.
+typedef struct {
+    unsigned int fields;          // USB_EXT_*
+    unsigned int supportedProtocols;  // USB_EXT_PROTOCOL_*
+    unsigned int speedFlags;      // USB_EXT_SPEED_*
+    int configDescLength;         // bytes, see GetDeviceConfigDescriptor()
+    char serialNumber[MAX_DESC_LEN];  // UTF-8, empty if the device has none
+    
+    // USB_EXT_PORT_CONNECTOR. A USB 3 port and the USB 2 port wired to the
+    // same connector are each other's companions.
+    unsigned int portFlags;       // USB_EXT_PORT_*
+    int companionIndex;           // which companion, if the port has several
+    int companionPort;            // port number on the companion hub, 0 if none
+    int companionHubIndex;        // in the snapshot the info was read from, or -1
+    char companionHubPath[MAX_PATH_LEN];  // UTF-8 device path, empty if none
+} USBExtendedInfo;
+
+// Cached extended data for the device at (hub path, port). The vendor,
+// product and address identify the device it was read from.
+typedef struct {
+    unsigned long long pathHash;
+    char* hubPath;
+    int port;
+    unsigned short vendorId;
+    unsigned short productId;
+    unsigned short deviceAddress;
+    USBExtendedInfo info;
+    unsigned char* configDesc;    // configDescLength bytes
+} ExtendedEntry;
+
+// Consecutive timed-out bounded scans of one hub. Once timeouts reaches
+// the context's threshold the hub is skipped until openUntil.
+typedef struct {
+    unsigned long long pathHash;
+    char* hubPath;
+    int timeouts;
+    ULONGLONG openUntil;          // GetTickCount64() time, 0 while closed
+} HubBreaker;
+
+// Circuit breaker defaults for new contexts
+#define USB_BREAKER_DEFAULT_THRESHOLD   3
+#define USB_BREAKER_DEFAULT_COOLDOWN_MS 30000
+
+// Owner of a published snapshot. Each caller can keep its own context;
+// the legacy exports use g_defaultContext.
+//
+// Publishing is double-buffered: a writer fills the spare snapshot (or a
+// fresh one while readers still hold the spare) and swaps it in. Readers
+// take swapLock only long enough to add a reference, so they never wait
+// for a scan and never see a half-written topology.
+typedef struct MapperContext {
+    SRWLOCK swapLock;             // guards current
+    SRWLOCK writeLock;            // serializes writers, guards spare
+    TopologySnapshot* current;    // NULL until the first scan
+    TopologySnapshot* spare;      // the previous snapshot, reused when unreferenced
+    volatile LONG generation;
+    SRWLOCK statsLock;            // guards stats
+    ScanStatsReport* stats;       // NULL until a scan with stats enabled
+    
+    // Extended descriptors fetched on demand, kept until the device's
+    // port shows up as removed or changed in a published change set
+    SRWLOCK extLock;              // guards the ext* fields
+    ExtendedEntry* extCache;
+    int extCount;
+    int extCapacity;
+    LONG extEpoch;                // bumped whenever entries may have gone stale
     
-    SetupDiDestroyDeviceInfoList(deviceInfoSet);
+    // Called with writeLock held after each commit, while the shared-memory
+    // publisher is attached to this context
+    void (*onCommit)(struct MapperContext* ctx, const TopologySnapshot* snap);
     
-    return g_deviceCount;
+    // Hubs that keep timing out in bounded scans
+    SRWLOCK breakerLock;          // guards the breaker* fields
+    HubBreaker* breakers;
+    int breakerCount;
+    int breakerCapacity;
+    int breakerThreshold;         // 0 turns the breaker off
+    DWORD breakerCooldownMs;
+} MapperContext;
+
+static MapperContext g_defaultContext = { SRWLOCK_INIT, SRWLOCK_INIT, NULL, NULL, 0,
+                                          SRWLOCK_INIT, NULL, SRWLOCK_INIT, NULL, 0, 0, 0,
+                                          NULL, SRWLOCK_INIT, NULL, 0, 0,
+                                          USB_BREAKER_DEFAULT_THRESHOLD,
+                                          USB_BREAKER_DEFAULT_COOLDOWN_MS };
+
+static void FreeSnapshot(TopologySnapshot* snap) {
+    ArenaFree(&snap->recordArena);
+    free(snap->strings.data);
+    free(snap->strings.slots);
+    free(snap->hubs);
+    free(snap->portTable);
+    free(snap->rootHubs);
+    free(snap->hubSlots);
+    free(snap->vidPidSlots);
+    free(snap->vidPidNext);
+    free(snap->changes);
+    free(snap);
 }
 
-// Get device info by index - exported to Python
-__declspec(dllexport) int GetDeviceInfo(int index, USBDeviceInfo* outInfo) {
-    if (index < 0 || index >= g_deviceCount || outInfo == NULL) {
-        return 0;
+static void ReleaseSnapshot(TopologySnapshot* snap) {
+    if (snap != NULL && InterlockedDecrement(&snap->refCount) == 0) {
+        FreeSnapshot(snap);
+    }
+}
+
+// ctx, or the context behind the legacy exports if ctx is NULL
+static MapperContext* ResolveContext(MapperContext* ctx) {
+    return (ctx != NULL) ? ctx : &g_defaultContext;
+}
+
+// Take a reference to ctx's current snapshot, or NULL before the first scan
+static TopologySnapshot* AcquireSnapshot(MapperContext* ctx) {
+    AcquireSRWLockShared(&ctx->swapLock);
+    TopologySnapshot* snap = ctx->current;
+    if (snap != NULL) {
+        InterlockedIncrement(&snap->refCount);
+    }
+    ReleaseSRWLockShared(&ctx->swapLock);
+    return snap;
+}
+
+// Start building ctx's next snapshot and take its writeLock. The spare is
+// reused once no reader holds it; its buffers are kept and rewound. Until
+// CommitSnapshot() or AbandonSnapshot(), ctx->current can be read without
+// swapLock since only writers change it. Returns NULL if out of memory.
+static TopologySnapshot* BeginSnapshot(MapperContext* ctx) {
+    AcquireSRWLockExclusive(&ctx->writeLock);
+    
+    // The spare is unpublished, so its count can only fall from here on
+    TopologySnapshot* snap = ctx->spare;
+    ctx->spare = NULL;
+    if (snap != NULL && InterlockedCompareExchange(&snap->refCount, 0, 0) != 1) {
+        ReleaseSnapshot(snap);
+        snap = NULL;
     }
     
-    memcpy(outInfo, &g_devices[index], sizeof(USBDeviceInfo));
-    return 1;
+    if (snap == NULL) {
+        snap = (TopologySnapshot*)calloc(1, sizeof(TopologySnapshot));
+        if (snap == NULL) {
+            ReleaseSRWLockExclusive(&ctx->writeLock);
+            return NULL;
+        }
+    }
+    
+    snap->refCount = 1;
+    ArenaReset(&snap->recordArena);
+    snap->records = NULL;
+    snap->recordCapacity = 0;
+    snap->deviceCount = 0;
+    snap->droppedCount = 0;
+    StringTableReset(&snap->strings);
+    free(snap->hubs);
+    snap->hubs = NULL;
+    snap->hubCount = 0;
+    snap->rootHubCount = 0;
+    snap->hubSlotCount = 0;
+    snap->vidPidSlotCount = 0;
+    snap->changeCount = 0;
+    snap->baseGeneration = 0;
+    snap->topologyHash = 0;
+    return snap;
 }
 
-// Get total device count - exported to Python
-__declspec(dllexport) int GetDeviceCount() {
-    return g_deviceCount;
-}
\ No newline at end of file
+// Record attached to a hub port, or -1
+static int RecordAtPort(const TopologySnapshot* snap, int hubIndex, int port) {
+    if (hubIndex < 0 || hubIndex >= snap->hubCount) {
+        return -1;
+    }
+    
+    const HubEntry* hub = &snap->hubs[hubIndex];
+    if (port < 1 || port > hub->maxPort) {
+        return -1;
+    }
+    return snap->portTable[hub->portTableOffset + port];
+}
+
+static unsigned long long HashString64(const char* str) {
+    unsigned long long hash = 14695981039346656037ull;  // FNV-1a
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hash one record's key and contents. Record hashes are summed, so the
+// topology hash doesn't depend on record order.
+static unsigned long long HashRecord(unsigned long long hubHash, const USBDeviceRecord* rec) {
+    unsigned long long x = (hubHash + rec->deviceAddress * 0x9e3779b97f4a7c15ull) ^
+                           ((unsigned long long)rec->portNumber |
+                            (unsigned long long)rec->vendorId << 16 |
+                            (unsigned long long)rec->productId << 32 |
+                            (unsigned long long)(unsigned char)rec->speed << 48 |
+                            (unsigned long long)rec->flags << 56);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;  // splitmix64 finalizer
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// False if RebuildTree() couldn't allocate the port tables
+static BOOL HasPortTables(const TopologySnapshot* snap) {
+    for (int h = 0; h < snap->hubCount; h++) {
+        if (snap->hubs[h].recordCount > 0 && snap->hubs[h].maxPort < 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static USBRecordChange* AppendChange(TopologySnapshot* snap, int kind, int port) {
+    if (snap->changeCount >= snap->changeCapacity) {
+        int newCapacity = snap->changeCapacity ? snap->changeCapacity * 2 : 16;
+        USBRecordChange* grown = (USBRecordChange*)realloc(snap->changes,
+                                        newCapacity * sizeof(USBRecordChange));
+        if (grown == NULL) {
+            return NULL;
+        }
+        snap->changes = grown;
+        snap->changeCapacity = newCapacity;
+    }
+    
+    USBRecordChange* change = &snap->changes[snap->changeCount++];
+    ZeroMemory(change, sizeof(USBRecordChange));
+    change->kind = (unsigned char)kind;
+    change->portNumber = (unsigned short)port;
+    change->recordIndex = -1;
+    change->speed = -1;
+    change->oldSpeed = -1;
+    return change;
+}
+
+// Fill in snap's topology hash and its change set against previous (NULL
+// before the first publish, when every record counts as added). Hubs are
+// matched by device path, records by hub and port. snap must be
+// unpublished with its tree rebuilt; removed hubs' paths are interned into
+// its string table.
+static void DiffSnapshot(TopologySnapshot* snap, const TopologySnapshot* previous) {
+    int hubCount = snap->hubCount;
+    int prevHubCount = (previous != NULL) ? previous->hubCount : 0;
+    int slotCount = 1;
+    while (slotCount < prevHubCount * 2) {
+        slotCount *= 2;
+    }
+    
+    snap->changeCount = 0;
+    snap->baseGeneration = (previous != NULL) ? previous->generation : 0;
+    
+    // Path hashes of both hub sets, then old <-> new hub maps
+    unsigned long long* hubHash = (unsigned long long*)malloc(
+        (hubCount + prevHubCount + 1) * sizeof(unsigned long long));
+    int* oldOf = (int*)malloc((hubCount + prevHubCount + 1) * sizeof(int));
+    int* slots = (int*)calloc(slotCount, sizeof(int));
+    BOOL diffable = hubHash != NULL && oldOf != NULL && slots != NULL &&
+                    HasPortTables(snap) && (previous == NULL || HasPortTables(previous));
+    
+    if (hubHash != NULL) {
+        for (int h = 0; h < hubCount; h++) {
+            hubHash[h] = HashString64(snap->hubs[h].devicePath);
+        }
+    }
+    
+    snap->topologyHash = 0;
+    for (int i = 0; i < snap->deviceCount; i++) {
+        const char* path = snap->hubs[snap->records[i].hubIndex].devicePath;
+        unsigned long long hash = (hubHash != NULL) ? hubHash[snap->records[i].hubIndex] :
+                                                      HashString64(path);
+        snap->topologyHash += HashRecord(hash, &snap->records[i]);
+    }
+    
+    if (!diffable) {
+        snap->changeCount = -1;
+        free(hubHash);
+        free(oldOf);
+        free(slots);
+        return;
+    }
+    
+    unsigned long long* prevHash = hubHash + hubCount;
+    int* newOf = oldOf + hubCount;
+    for (int h = 0; h < prevHubCount; h++) {
+        const char* path = previous->hubs[h].devicePath;
+        prevHash[h] = HashString64(path);
+        newOf[h] = -1;
+        if (path[0] == '\0') {
+            continue;
+        }
+        
+        unsigned int slot = (unsigned int)prevHash[h] & (slotCount - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        slots[slot] = h + 1;
+    }
+    
+    for (int h = 0; h < hubCount; h++) {
+        const char* path = snap->hubs[h].devicePath;
+        oldOf[h] = -1;
+        if (path[0] == '\0' || prevHubCount == 0) {
+            continue;
+        }
+        
+        unsigned int slot = (unsigned int)hubHash[h] & (slotCount - 1);
+        while (slots[slot] != 0) {
+            int candidate = slots[slot] - 1;
+            if (prevHash[candidate] == hubHash[h] &&
+                strcmp(previous->hubs[candidate].devicePath, path) == 0) {
+                if (newOf[candidate] < 0) {
+                    oldOf[h] = candidate;
+                    newOf[candidate] = h;
+                }
+                break;
+            }
+            slot = (slot + 1) & (slotCount - 1);
+        }
+    }
+    
+    BOOL complete = TRUE;
+    for (int i = 0; i < snap->deviceCount && complete; i++) {
+        const USBDeviceRecord* rec = &snap->records[i];
+        int old = (previous != NULL) ? RecordAtPort(previous, oldOf[rec->hubIndex],
+                                                    rec->portNumber) : -1;
+        const USBDeviceRecord* prev = (old >= 0) ? &previous->records[old] : NULL;
+        
+        int fields = 0;
+        if (prev != NULL) {
+            fields = ((prev->vendorId != rec->vendorId) ? USB_CHANGE_FIELD_VENDOR : 0) |
+                     ((prev->productId != rec->productId) ? USB_CHANGE_FIELD_PRODUCT : 0) |
+                     ((prev->speed != rec->speed) ? USB_CHANGE_FIELD_SPEED : 0) |
+                     ((prev->flags != rec->flags) ? USB_CHANGE_FIELD_FLAGS : 0) |
+                     ((prev->deviceAddress != rec->deviceAddress) ?
+                      USB_CHANGE_FIELD_ADDRESS : 0);
+            if (fields == 0) {
+                continue;
+            }
+        }
+        
+        int kind = (prev != NULL) ? USB_CHANGE_MODIFIED : USB_CHANGE_ADDED;
+        USBRecordChange* change = AppendChange(snap, kind, rec->portNumber);
+        if (change == NULL) {
+            complete = FALSE;
+            break;
+        }
+        change->fields = (unsigned char)fields;
+        change->hubPathOffset = rec->hubPathOffset;
+        change->recordIndex = i;
+        change->vendorId = rec->vendorId;
+        change->productId = rec->productId;
+        change->speed = rec->speed;
+        change->flags = rec->flags;
+        if (prev != NULL) {
+            change->oldVendorId = prev->vendorId;
+            change->oldProductId = prev->productId;
+            change->oldSpeed = prev->speed;
+            change->oldFlags = prev->flags;
+        }
+    }
+    
+    for (int j = 0; previous != NULL && j < previous->deviceCount && complete; j++) {
+        const USBDeviceRecord* prev = &previous->records[j];
+        int hubIndex = newOf[prev->hubIndex];
+        if (RecordAtPort(snap, hubIndex, prev->portNumber) >= 0) {
+            continue;
+        }
+        
+        USBRecordChange* change = AppendChange(snap, USB_CHANGE_REMOVED, prev->portNumber);
+        if (change == NULL) {
+            complete = FALSE;
+            break;
+        }
+        change->hubPathOffset = (hubIndex >= 0) ? snap->hubs[hubIndex].pathOffset :
+            StringTableIntern(&snap->strings, previous->hubs[prev->hubIndex].devicePath);
+        change->oldVendorId = prev->vendorId;
+        change->oldProductId = prev->productId;
+        change->oldSpeed = prev->speed;
+        change->oldFlags = prev->flags;
+    }
+    
+    if (!complete) {
+        snap->changeCount = -1;
+    }
+    free(hubHash);
+    free(oldOf);
+    free(slots);
+}
+
+// Entry in ctx's extended cache for (hubPath, port), or -1. Needs extLock.
+static int FindExtendedEntry(const MapperContext* ctx, unsigned long long pathHash,
+                             const char* hubPath, int port) {
+    for (int i = 0; i < ctx->extCount; i++) {
+        const ExtendedEntry* entry = &ctx->extCache[i];
+        if (entry->pathHash == pathHash && entry->port == port &&
+            strcmp(entry->hubPath, hubPath) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Drop one extended cache entry. Needs extLock.
+static void RemoveExtendedEntry(MapperContext* ctx, int index) {
+    free(ctx->extCache[index].hubPath);
+    free(ctx->extCache[index].configDesc);
+    ctx->extCache[index] = ctx->extCache[--ctx->extCount];
+}
+
+// Forget extended data of every port snap's change set reports as removed
+// or changed; everything if the change set is unknown
+static void EvictExtendedInfo(MapperContext* ctx, const TopologySnapshot* snap) {
+    BOOL stale = (snap->changeCount < 0);
+    for (int i = 0; i < snap->changeCount && !stale; i++) {
+        stale = (snap->changes[i].kind != USB_CHANGE_ADDED);
+    }
+    if (!stale) {
+        return;
+    }
+    
+    AcquireSRWLockExclusive(&ctx->extLock);
+    ctx->extEpoch++;
+    if (snap->changeCount < 0) {
+        while (ctx->extCount > 0) {
+            RemoveExtendedEntry(ctx, ctx->extCount - 1);
+        }
+    }
+    for (int i = 0; i < snap->changeCount && ctx->extCount > 0; i++) {
+        const USBRecordChange* change = &snap->changes[i];
+        if (change->kind == USB_CHANGE_ADDED) {
+            continue;
+        }
+        
+        const char* hubPath = (snap->strings.data != NULL) ?
+                              snap->strings.data + change->hubPathOffset : "";
+        int index = FindExtendedEntry(ctx, HashString64(hubPath), hubPath, change->portNumber);
+        if (index >= 0) {
+            RemoveExtendedEntry(ctx, index);
+        }
+    }
+    ReleaseSRWLockExclusive(&ctx->extLock);
+}
+
+// Publish snap as ctx's current snapshot and release the writeLock. The
+// old snapshot becomes the spare; readers still holding it keep it alive.
+static void CommitSnapshot(MapperContext* ctx, TopologySnapshot* snap) {
+    DiffSnapshot(snap, ctx->current);
+    EvictExtendedInfo(ctx, snap);
+    snap->generation = InterlockedIncrement(&ctx->generation);
+    
+    AcquireSRWLockExclusive(&ctx->swapLock);
+    TopologySnapshot* previous = ctx->current;
+    ctx->current = snap;
+    ReleaseSRWLockExclusive(&ctx->swapLock);
+    
+    ctx->spare = previous;
+    if (ctx->onCommit != NULL) {
+        ctx->onCommit(ctx, snap);
+    }
+    ReleaseSRWLockExclusive(&ctx->writeLock);
+}
+
+// Drop a snapshot from BeginSnapshot() without publishing it
+static void AbandonSnapshot(MapperContext* ctx, TopologySnapshot* snap) {
+    ctx->spare = snap;
+    ReleaseSRWLockExclusive(&ctx->writeLock);
+}
+
+// Grow a retained int buffer to at least count entries
+static BOOL ReserveInts(int** buffer, int* capacity, int count) {
+    if (count <= *capacity) {
+        return TRUE;
+    }
+    
+    int newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < count) {
+        newCapacity *= 2;
+    }
+    
+    int* grown = (int*)realloc(*buffer, newCapacity * sizeof(int));
+    if (grown == NULL) {
+        return FALSE;
+    }
+    *buffer = grown;
+    *capacity = newCapacity;
+    return TRUE;
+}
+
+// Make room for capacity records, keeping the current ones. The old
+// region is reclaimed at the next ArenaReset. Only for unpublished
+// snapshots.
+static BOOL ReserveRecords(TopologySnapshot* snap, int capacity) {
+    if (capacity <= snap->recordCapacity) {
+        return TRUE;
+    }
+    
+    USBDeviceRecord* records = (USBDeviceRecord*)ArenaAlloc(&snap->recordArena,
+                                        capacity * sizeof(USBDeviceRecord));
+    if (records == NULL) {
+        return FALSE;
+    }
+    
+    if (snap->deviceCount > 0) {
+        memcpy(records, snap->records, snap->deviceCount * sizeof(USBDeviceRecord));
+    }
+    snap->records = records;
+    snap->recordCapacity = capacity;
+    return TRUE;
+}
+
+// Fill an unpublished snapshot with a copy of src (which may be NULL) so a
+// patch can be applied to it. The tree tables are left for RebuildTree().
+static BOOL CopySnapshot(TopologySnapshot* snap, const TopologySnapshot* src) {
+    if (src == NULL) {
+        return TRUE;
+    }
+    
+    // Leave headroom so patches rarely need to regrow
+    int count = src->deviceCount;
+    if (count > 0 && !ReserveRecords(snap, count + count / 4 + 16)) {
+        return FALSE;
+    }
+    if (!StringTableCopy(&snap->strings, &src->strings)) {
+        return FALSE;
+    }
+    
+    snap->hubs = (HubEntry*)malloc((src->hubCount ? src->hubCount : 1) * sizeof(HubEntry));
+    if (snap->hubs == NULL) {
+        return FALSE;
+    }
+    if (src->hubCount > 0) {
+        memcpy(snap->hubs, src->hubs, src->hubCount * sizeof(HubEntry));
+    }
+    snap->hubCount = src->hubCount;
+    
+    // The hub set is the same, so its indexes still hold
+    if (src->hubSlotCount > 0 &&
+        ReserveInts(&snap->hubSlots, &snap->hubSlotCapacity, src->hubSlotCount * 2)) {
+        memcpy(snap->hubSlots, src->hubSlots, src->hubSlotCount * 2 * sizeof(int));
+        snap->hubSlotCount = src->hubSlotCount;
+    }
+    
+    if (count > 0) {
+        memcpy(snap->records, src->records, count * sizeof(USBDeviceRecord));
+    }
+    snap->deviceCount = count;
+    snap->droppedCount = src->droppedCount;
+    return TRUE;
+}
+
+// Look up an interned string in a snapshot
+static const char* RecordString(const TopologySnapshot* snap, unsigned int offset) {
+    if (snap->strings.data == NULL || offset >= snap->strings.size) {
+        return "";
+    }
+    return snap->strings.data + offset;
+}
+
+// Called by EnumerateUSBDevicesStreaming() for each connected port as soon
+// as it has been queried. Return nonzero to go on, 0 to stop the scan.
+typedef int (WINAPI *USBDeviceCallback)(const USBDeviceRecord* record, const char* hubPath,
+                                        const char* hubDesc, void* userData);
+
+// Destination for probed devices. Fixed slabs drop devices once full,
+// growable slabs realloc as needed.
+typedef struct {
+    USBDeviceRecord* devices;
+    int count;
+    int capacity;
+    BOOL growable;
+    int dropped;                  // devices that didn't fit
+    USBDeviceCallback callback;   // streaming scans only
+    void* userData;
+    BOOL stopped;                 // the callback returned 0
+} DeviceSlab;
+
+// Upper bound on parallel workers (WaitForMultipleObjects limit)
+#define MAX_WORKERS MAXIMUM_WAIT_OBJECTS
+
+// Reserve the next record in a slab, or count it as dropped and return
+// NULL if it is full
+static USBDeviceRecord* SlabAppend(DeviceSlab* slab) {
+    if (slab->count >= slab->capacity) {
+        if (!slab->growable) {
+            slab->dropped++;
+            return NULL;
+        }
+        
+        int newCapacity = slab->capacity ? slab->capacity * 2 : 64;
+        USBDeviceRecord* grown = (USBDeviceRecord*)realloc(slab->devices,
+                                        newCapacity * sizeof(USBDeviceRecord));
+        if (grown == NULL) {
+            slab->dropped++;
+            return NULL;
+        }
+        slab->devices = grown;
+        slab->capacity = newCapacity;
+    }
+    
+    USBDeviceRecord* dev = &slab->devices[slab->count++];
+    ZeroMemory(dev, sizeof(USBDeviceRecord));
+    return dev;
+}
+
+// Read the path and description of every present USB hub from SetupAPI.
+// Returns the hub count (array in *outHubs, caller frees) or -1 on failure.
+static int QueryHubs(HubEntry** outHubs) {
+    HDEVINFO deviceInfoSet;
+    SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
+    PSP_DEVICE_INTERFACE_DETAIL_DATA_W deviceInterfaceDetailData;
+    DWORD requiredSize;
+    DWORD hubIndex = 0;
+    HubEntry* hubs = NULL;
+    int hubCount = 0;
+    int hubCapacity = 0;
+    
+    *outHubs = NULL;
+    
+    // Get all USB hub devices
+    deviceInfoSet = g_backend->GetClassDevs(
+        &GUID_DEVINTERFACE_USB_HUB,
+        DIGCF_PRESENT | DIGCF_DEVICEINTERFACE
+    );
+    
+    if (deviceInfoSet == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    
+    deviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+    
+    // Enumerate each USB hub
+    while (g_backend->EnumDeviceInterfaces(deviceInfoSet, &GUID_DEVINTERFACE_USB_HUB,
+                                           hubIndex, &deviceInterfaceData)) {
+        
+        // Get required size for device path
+        g_backend->GetDeviceInterfaceDetail(deviceInfoSet, &deviceInterfaceData,
+                                            NULL, 0, &requiredSize, NULL);
+        
+        deviceInterfaceDetailData = (PSP_DEVICE_INTERFACE_DETAIL_DATA_W)
+                                    malloc(requiredSize);
+        if (deviceInterfaceDetailData == NULL) {
+            break;
+        }
+        deviceInterfaceDetailData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+        
+        if (hubCount >= hubCapacity) {
+            int newCapacity = hubCapacity ? hubCapacity * 2 : 16;
+            HubEntry* grown = (HubEntry*)realloc(hubs, newCapacity * sizeof(HubEntry));
+            if (grown == NULL) {
+                free(deviceInterfaceDetailData);
+                break;
+            }
+            hubs = grown;
+            hubCapacity = newCapacity;
+        }
+        
+        // Every hub keeps its slot, even if its path can't be read, so
+        // hubIndex stays the SetupDiEnumDeviceInterfaces position
+        HubEntry* hub = &hubs[hubCount++];
+        ZeroMemory(hub, sizeof(HubEntry));
+        
+        SP_DEVINFO_DATA deviceInfoData;
+        deviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+        
+        // Get device path
+        if (g_backend->GetDeviceInterfaceDetail(deviceInfoSet, &deviceInterfaceData,
+                                                deviceInterfaceDetailData, requiredSize,
+                                                NULL, &deviceInfoData)) {
+            WideToUtf8(deviceInterfaceDetailData->DevicePath, -1, hub->devicePath,
+                       MAX_PATH_LEN);
+            hub->devInst = deviceInfoData.DevInst;
+            
+            // Registry properties are read once per hub, never per port
+            GetDeviceProperty(deviceInfoSet, &deviceInfoData, SPDRP_DRIVER,
+                              hub->driverKey, sizeof(hub->driverKey));
+            GetDeviceProperty(deviceInfoSet, &deviceInfoData, SPDRP_LOCATION_PATHS,
+                              hub->locationPath, sizeof(hub->locationPath));
+#if USB_MAPPER_DESCRIPTIONS
+            GetDeviceProperty(deviceInfoSet, &deviceInfoData, SPDRP_DEVICEDESC,
+                              hub->hubDesc, sizeof(hub->hubDesc));
+            GetDeviceProperty(deviceInfoSet, &deviceInfoData, SPDRP_LOCATION_INFORMATION,
+                              hub->locationInfo, sizeof(hub->locationInfo));
+#endif
+        }
+        
+        free(deviceInterfaceDetailData);
+        hubIndex++;
+    }
+    
+    g_backend->DestroyDeviceInfoList(deviceInfoSet);
+    
+    *outHubs = hubs;
+    return hubCount;
+}
+
+// Hub list kept between scans once InitializeMapper() has run. It stays
+// valid while g_hubCacheNotify is registered, and any hub arriving or
+// leaving drops it; without the notification a warmed list serves only
+// the next scan.
+static SRWLOCK g_hubCacheLock = SRWLOCK_INIT;
+static HubEntry* g_hubCache = NULL;
+static int g_hubCacheCount = -1;              // -1 while there's no list
+static LONG g_hubCacheEpoch = 0;              // bumped by every hub notification, needs the lock
+static HCMNOTIFICATION g_hubCacheNotify = NULL;
+static HANDLE g_warmupThread = NULL;          // InitializeMapper(USB_INIT_ASYNC)
+static volatile LONG g_mapperInitialized = 0;
+
+// Drop the cached hub list. Needs g_hubCacheLock.
+static void DropHubCache() {
+    free(g_hubCache);
+    g_hubCache = NULL;
+    g_hubCacheCount = -1;
+}
+
+// Cache a copy of a freshly queried hub list, unless a notification came
+// in since epoch was read
+static void StoreHubCache(const HubEntry* hubs, int count, LONG epoch) {
+    HubEntry* copy = (HubEntry*)malloc((count ? count : 1) * sizeof(HubEntry));
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, hubs, count * sizeof(HubEntry));
+    
+    AcquireSRWLockExclusive(&g_hubCacheLock);
+    if (g_hubCacheEpoch == epoch) {
+        DropHubCache();
+        g_hubCache = copy;
+        g_hubCacheCount = count;
+        copy = NULL;
+    }
+    ReleaseSRWLockExclusive(&g_hubCacheLock);
+    free(copy);
+}
+
+static DWORD CALLBACK HubCacheNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                         CM_NOTIFY_ACTION action,
+                                         PCM_NOTIFY_EVENT_DATA eventData,
+                                         DWORD eventDataSize) {
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ||
+        action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        AcquireSRWLockExclusive(&g_hubCacheLock);
+        g_hubCacheEpoch++;
+        DropHubCache();
+        ReleaseSRWLockExclusive(&g_hubCacheLock);
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI WarmupThreadProc(LPVOID param) {
+    AcquireSRWLockShared(&g_hubCacheLock);
+    LONG epoch = g_hubCacheEpoch;
+    ReleaseSRWLockShared(&g_hubCacheLock);
+    
+    HubEntry* hubs;
+    int count = QueryHubs(&hubs);
+    if (count >= 0) {
+        StoreHubCache(hubs, count, epoch);
+        free(hubs);
+    }
+    return 0;
+}
+
+// Collect every present USB hub, from the cached list when there is one.
+// A scan that starts while InitializeMapper() is warming up waits for it
+// rather than querying SetupAPI twice. Returns the hub count (array in
+// *outHubs, caller frees) or -1 on failure.
+static int CollectHubs(HubEntry** outHubs) {
+    if (g_warmupThread != NULL) {
+        WaitForSingleObject(g_warmupThread, INFINITE);
+    }
+    
+    AcquireSRWLockExclusive(&g_hubCacheLock);
+    LONG epoch = g_hubCacheEpoch;
+    if (g_hubCacheCount >= 0) {
+        int count = g_hubCacheCount;
+        HubEntry* hubs = (HubEntry*)malloc((count ? count : 1) * sizeof(HubEntry));
+        if (hubs != NULL) {
+            memcpy(hubs, g_hubCache, count * sizeof(HubEntry));
+            if (g_hubCacheNotify == NULL) {
+                DropHubCache();
+            }
+            ReleaseSRWLockExclusive(&g_hubCacheLock);
+            *outHubs = hubs;
+            return count;
+        }
+    }
+    BOOL keep = (g_hubCacheNotify != NULL);
+    ReleaseSRWLockExclusive(&g_hubCacheLock);
+    
+    int count = QueryHubs(outHubs);
+    if (count >= 0 && keep) {
+        StoreHubCache(*outHubs, count, epoch);
+    }
+    return count;
+}
+
+// Fill a device record from one port's connection information. String
+// offsets are resolved from hubIndex when the record is published.
+static void FillDeviceRecord(USBDeviceRecord* dev, int hubIndex, int port,
+                             const USB_NODE_CONNECTION_INFORMATION_EX* connInfo) {
+    dev->hubIndex = hubIndex;
+    dev->childHubIndex = -1;
+    dev->portNumber = (unsigned short)port;
+    dev->flags = connInfo->DeviceIsHub ? USB_RECORD_FLAG_HUB : 0;
+    dev->vendorId = connInfo->DeviceDescriptor.idVendor;
+    dev->productId = connInfo->DeviceDescriptor.idProduct;
+    dev->deviceAddress = connInfo->DeviceAddress;
+    
+    // Map speed enum to simpler int
+    switch (connInfo->Speed) {
+        case UsbLowSpeed:  dev->speed = 0; break;
+        case UsbFullSpeed: dev->speed = 1; break;
+        case UsbHighSpeed: dev->speed = 2; break;
+        case UsbSuperSpeed: dev->speed = 3; break;
+        default: dev->speed = -1;
+    }
+}
+
+// Build the per-device description. Only done when a caller asks for it.
+static int FormatDeviceDesc(const TopologySnapshot* snap, const USBDeviceRecord* rec,
+                            char* out, int capacity) {
+#if USB_MAPPER_DESCRIPTIONS
+    return snprintf(out, capacity, "Hub: %s, Port: %d",
+                    RecordString(snap, rec->hubDescOffset), rec->portNumber);
+#else
+    return snprintf(out, capacity, "Port: %d", rec->portNumber);
+#endif
+}
+
+// Expand a compact record into the v1 USBDeviceInfo layout
+static void ExpandRecord(const TopologySnapshot* snap, const USBDeviceRecord* rec,
+                         USBDeviceInfo* out) {
+    ZeroMemory(out, sizeof(USBDeviceInfo));
+    
+    out->hubIndex = rec->hubIndex;
+    out->portNumber = rec->portNumber;
+    out->isHub = (rec->flags & USB_RECORD_FLAG_HUB) ? 1 : 0;
+    out->speed = (rec->speed > 3) ? 3 : rec->speed;   // the v1 layout stops at Super
+    out->vendorId = rec->vendorId;
+    out->productId = rec->productId;
+    
+    FormatDeviceDesc(snap, rec, out->deviceDesc, sizeof(out->deviceDesc));
+    
+    strncpy(out->devicePath, RecordString(snap, rec->hubPathOffset), MAX_PATH_LEN - 1);
+}
+
+// Scan instrumentation switch, see SetScanStatsEnabled()
+static volatile LONG g_scanStatsEnabled = (USB_MAPPER_STATS > 1);
+static LONGLONG g_qpcFrequency = 0;
+
+static LONGLONG QpcNow() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static double QpcMicros(LONGLONG start, LONGLONG end) {
+    // Racing threads all store the same value
+    if (g_qpcFrequency == 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        g_qpcFrequency = frequency.QuadPart;
+    }
+    return (double)(end - start) * 1000000.0 / (double)g_qpcFrequency;
+}
+
+// Instrumentation for one scan in progress. A hub's entries are only
+// written by the thread probing it, so no locking is needed. The probe
+// functions get a NULL trace when stats are off and skip every timer.
+typedef struct {
+    ScanStats summary;
+    LONGLONG start;
+    LONGLONG probeStart;
+    LONGLONG probeEnd;
+    int hubCount;
+    HubScanStats* hubs;           // indexed by hubIndex
+    PortScanStats** hubPorts;     // per hub, portCount entries
+} ScanTrace;
+
+// Start tracing a scan, or return NULL if stats are off. A build without
+// them never traces, and the per-call timers fold away with the NULL.
+static ScanTrace* BeginScanTrace(int mode) {
+    if (!USB_MAPPER_STATS || !InterlockedCompareExchange(&g_scanStatsEnabled, 0, 0)) {
+        return NULL;
+    }
+    
+    ScanTrace* trace = (ScanTrace*)calloc(1, sizeof(ScanTrace));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->summary.mode = mode;
+    trace->summary.slowestHub = -1;
+    trace->start = QpcNow();
+    return trace;
+}
+
+// Hub discovery finished with hubCount hubs (-1 on failure). Without
+// memory for the per-hub tables only the phase timings are kept.
+static void TraceHubsCollected(ScanTrace* trace, int hubCount) {
+    if (trace == NULL) {
+        return;
+    }
+    
+    trace->probeStart = QpcNow();
+    trace->summary.collectHubsUs = QpcMicros(trace->start, trace->probeStart);
+    if (hubCount < 0) {
+        trace->summary.lastError = GetLastError();
+        return;
+    }
+    if (hubCount == 0) {
+        return;
+    }
+    
+    trace->hubs = (HubScanStats*)calloc(hubCount, sizeof(HubScanStats));
+    trace->hubPorts = (PortScanStats**)calloc(hubCount, sizeof(PortScanStats*));
+    if (trace->hubs == NULL || trace->hubPorts == NULL) {
+        free(trace->hubs);
+        free(trace->hubPorts);
+        trace->hubs = NULL;
+        trace->hubPorts = NULL;
+        return;
+    }
+    
+    trace->hubCount = hubCount;
+    for (int i = 0; i < hubCount; i++) {
+        trace->hubs[i].hubIndex = i;
+    }
+}
+
+// A hub's stats entry, or NULL when not tracing
+static HubScanStats* TraceHub(ScanTrace* trace, int hubIndex) {
+    if (trace == NULL || hubIndex < 0 || hubIndex >= trace->hubCount) {
+        return NULL;
+    }
+    return &trace->hubs[hubIndex];
+}
+
+// Count a failed call against a hub
+static void TraceHubError(HubScanStats* hubStats, DWORD error) {
+    if (hubStats != NULL) {
+        hubStats->ioctlErrors++;
+        hubStats->lastError = error;
+    }
+}
+
+// Record a hub open that started at start
+static void TraceHubOpen(HubScanStats* hubStats, LONGLONG start, BOOL opened, DWORD error) {
+    if (hubStats == NULL) {
+        return;
+    }
+    
+    hubStats->openUs = QpcMicros(start, QpcNow());
+    if (!opened) {
+        hubStats->openFailed = 1;
+        hubStats->lastError = error;
+    }
+}
+
+// Make room for numPorts port entries on a hub about to be queried
+static void TracePortsBegin(ScanTrace* trace, int hubIndex, int numPorts) {
+    if (TraceHub(trace, hubIndex) == NULL || numPorts <= 0 ||
+        trace->hubPorts[hubIndex] != NULL) {
+        return;
+    }
+    
+    trace->hubPorts[hubIndex] = (PortScanStats*)calloc(numPorts, sizeof(PortScanStats));
+    if (trace->hubPorts[hubIndex] != NULL) {
+        trace->hubs[hubIndex].portCount = numPorts;
+    }
+}
+
+// Record one port query between start and end
+static void TracePortSpan(ScanTrace* trace, int hubIndex, int port,
+                          LONGLONG start, LONGLONG end, DWORD error) {
+    HubScanStats* hubStats = TraceHub(trace, hubIndex);
+    if (hubStats == NULL || port < 1 || port > hubStats->portCount) {
+        return;
+    }
+    
+    PortScanStats* portStats = &trace->hubPorts[hubIndex][port - 1];
+    portStats->hubIndex = hubIndex;
+    portStats->port = port;
+    portStats->elapsedUs = QpcMicros(start, end);
+    portStats->error = error;
+    
+    if (portStats->elapsedUs > hubStats->slowestPortUs || hubStats->slowestPort == 0) {
+        hubStats->slowestPort = port;
+        hubStats->slowestPortUs = portStats->elapsedUs;
+    }
+    if (error != ERROR_SUCCESS) {
+        TraceHubError(hubStats, error);
+    }
+}
+
+// Record one port query that started at start and just finished
+static void TracePort(ScanTrace* trace, int hubIndex, int port, LONGLONG start, DWORD error) {
+    if (trace != NULL) {
+        TracePortSpan(trace, hubIndex, port, start, QpcNow(), error);
+    }
+}
+
+// Mark the end of the probe phase, before the results are published
+static void TraceProbeDone(ScanTrace* trace) {
+    if (trace != NULL) {
+        trace->probeEnd = QpcNow();
+        trace->summary.probeUs = QpcMicros(trace->probeStart, trace->probeEnd);
+    }
+}
+
+// Close out a published scan (deviceCount < 0 if it failed): total up the
+// hubs and replace ctx's stats. Frees the trace.
+static void FinishScanTrace(MapperContext* ctx, ScanTrace* trace, int deviceCount) {
+    if (trace == NULL) {
+        return;
+    }
+    
+    LONGLONG end = QpcNow();
+    ScanStats* summary = &trace->summary;
+    if (trace->probeEnd == 0) {
+        trace->probeEnd = end;
+    }
+    summary->publishUs = QpcMicros(trace->probeEnd, end);
+    summary->totalUs = QpcMicros(trace->start, end);
+    summary->hubCount = trace->hubCount;
+    summary->deviceCount = (deviceCount > 0) ? deviceCount : 0;
+    
+    ScanStatsReport* report = (ScanStatsReport*)calloc(1, sizeof(ScanStatsReport));
+    int portTotal = 0;
+    for (int h = 0; h < trace->hubCount; h++) {
+        portTotal += trace->hubs[h].portCount;
+    }
+    
+    if (report != NULL && portTotal > 0) {
+        report->ports = (PortScanStats*)malloc(portTotal * sizeof(PortScanStats));
+    }
+    
+    for (int h = 0; h < trace->hubCount; h++) {
+        HubScanStats* hubStats = &trace->hubs[h];
+        double hubUs = hubStats->openUs + hubStats->nodeInfoUs + hubStats->portsUs;
+        
+        summary->failedOpens += hubStats->openFailed;
+        summary->ioctlErrors += hubStats->ioctlErrors;
+        if (hubStats->openFailed || hubStats->ioctlErrors > 0) {
+            summary->lastError = hubStats->lastError;
+        }
+        if (hubStats->portCount > 0 &&
+            (summary->slowestHub < 0 || hubUs > summary->slowestHubUs)) {
+            summary->slowestHub = h;
+            summary->slowestHubUs = hubUs;
+        }
+        
+        // Flatten the ports that were actually queried
+        hubStats->firstPortStat = (report != NULL) ? report->portCount : 0;
+        int queried = 0;
+        for (int p = 0; p < hubStats->portCount; p++) {
+            const PortScanStats* portStats = &trace->hubPorts[h][p];
+            if (portStats->port == 0) {
+                continue;
+            }
+            if (report != NULL && report->ports != NULL) {
+                report->ports[report->portCount++] = *portStats;
+            }
+            queried++;
+        }
+        hubStats->portCount = queried;
+        summary->portQueries += queried;
+        free(trace->hubPorts[h]);
+    }
+    
+    if (report != NULL) {
+        report->summary = *summary;
+        report->hubs = trace->hubs;
+        trace->hubs = NULL;
+        
+        AcquireSRWLockExclusive(&ctx->statsLock);
+        ScanStatsReport* previous = ctx->stats;
+        ctx->stats = report;
+        ReleaseSRWLockExclusive(&ctx->statsLock);
+        
+        FreeScanStatsReport(previous);
+    }
+    
+    free(trace->hubs);
+    free(trace->hubPorts);
+    free(trace);
+}
+
+// True if an IOCTL failed because the device behind the handle is gone
+static BOOL IsDeviceGoneError(DWORD error) {
+    return error == ERROR_DEVICE_NOT_CONNECTED ||
+           error == ERROR_NO_SUCH_DEVICE ||
+           error == ERROR_DEVICE_REMOVED ||
+           error == ERROR_FILE_NOT_FOUND;
+}
+
+// Send a synchronous IOCTL, also on handles opened with
+// FILE_FLAG_OVERLAPPED. Setting the event's low bit keeps the completion
+// off any I/O completion port the handle is bound to. On overlapped handles
+// the IOCTL is cancelled after timeoutMs and fails with
+// ERROR_OPERATION_ABORTED.
+static BOOL DeviceIoControlSync(HANDLE hDevice, BOOL overlappedHandle, DWORD ioctl,
+                                LPVOID buffer, DWORD bufferSize, DWORD timeoutMs) {
+    DWORD bytesReturned;
+    
+    if (!overlappedHandle) {
+        return g_backend->IoControl(hDevice, ioctl, buffer, bufferSize, &bytesReturned, NULL);
+    }
+    
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    HANDLE event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (event == NULL) {
+        return FALSE;
+    }
+    overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+    
+    BOOL ok = g_backend->IoControl(hDevice, ioctl, buffer, bufferSize, NULL, &overlapped);
+    if (!ok && GetLastError() == ERROR_IO_PENDING) {
+        // The buffer belongs to the caller, so wait for the cancel to land
+        if (timeoutMs != INFINITE && WaitForSingleObject(event, timeoutMs) == WAIT_TIMEOUT) {
+            g_backend->CancelIo(hDevice);
+        }
+        ok = g_backend->GetOverlappedResult(hDevice, &overlapped, &bytesReturned, TRUE);
+    }
+    
+    CloseHandle(event);
+    return ok;
+}
+
+// Find which hub is attached to a port. The port's driver key name equals
+// the SPDRP_DRIVER of the downstream hub. Returns its hubIndex or -1. If the
+// IOCTL fails and outError is given, the error is stored there. timeoutMs
+// is as for DeviceIoControlSync().
+static int ResolveChildHub(HANDLE hHub, BOOL overlappedHandle, DWORD timeoutMs, int port,
+                           const HubEntry* hubs, int hubCount, DWORD* outError) {
+    struct {
+        USB_NODE_CONNECTION_DRIVERKEY_NAME header;
+        WCHAR name[MAX_DESC_LEN];
+    } driverKeyName;
+    char driverKey[MAX_DESC_LEN];
+    
+    ZeroMemory(&driverKeyName, sizeof(driverKeyName));
+    driverKeyName.header.ConnectionIndex = port;
+    
+    if (!DeviceIoControlSync(hHub, overlappedHandle,
+                             IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME,
+                             &driverKeyName, sizeof(driverKeyName), timeoutMs)) {
+        if (outError != NULL) {
+            *outError = GetLastError();
+        }
+        return -1;
+    }
+    
+    if (WideToUtf8(driverKeyName.header.DriverKeyName, -1, driverKey,
+                   sizeof(driverKey)) == 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < hubCount; i++) {
+        if (hubs[i].driverKey[0] != '\0' && _stricmp(hubs[i].driverKey, driverKey) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Query a port's protocols and SuperSpeed flags. Hub drivers older than
+// Windows 8 fail the IOCTL. timeoutMs is as for DeviceIoControlSync().
+static BOOL QueryConnectionV2(HANDLE hHub, BOOL overlappedHandle, DWORD timeoutMs, int port,
+                              USB_NODE_CONNECTION_INFORMATION_EX_V2* v2) {
+    ZeroMemory(v2, sizeof(*v2));
+    v2->ConnectionIndex = port;
+    v2->Length = sizeof(*v2);
+    v2->SupportedUsbProtocols.ul = USB_EXT_PROTOCOL_USB110 | USB_EXT_PROTOCOL_USB200 |
+                                   USB_EXT_PROTOCOL_USB300;
+    
+    return DeviceIoControlSync(hHub, overlappedHandle,
+                               IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX_V2,
+                               v2, sizeof(*v2), timeoutMs);
+}
+
+// Upgrade a SuperSpeed record to SuperSpeedPlus (speed 4) if the port
+// negotiated it. The connection information reports both as UsbSuperSpeed;
+// only CONNECTION_INFORMATION_EX_V2 tells them apart. If the IOCTL fails
+// the record stays at SuperSpeed.
+static void DetectSuperSpeedPlus(HANDLE hHub, BOOL overlappedHandle, DWORD timeoutMs, int port,
+                                 USBDeviceRecord* dev) {
+    if (dev->speed != 3) {
+        return;
+    }
+    
+    USB_NODE_CONNECTION_INFORMATION_EX_V2 v2;
+    if (QueryConnectionV2(hHub, overlappedHandle, timeoutMs, port, &v2) &&
+        v2.Flags.DeviceIsOperatingAtSuperSpeedPlusOrHigher) {
+        dev->speed = 4;
+    }
+}
+
+// Query ports 1..numPorts of an open hub and append its connected devices
+// to a slab. Cascaded hubs are linked against hubs[]. If hubGone is given
+// it is set when the hub has disappeared; if failedPorts is given it counts
+// the ports whose queries failed. Returns the number of devices appended.
+static int ProbePorts(HANDLE hHub, int hubIndex, int numPorts,
+                      const HubEntry* hubs, int hubCount, DeviceSlab* slab,
+                      BOOL* hubGone, int* failedPorts, ScanTrace* trace) {
+    HubScanStats* hubStats = TraceHub(trace, hubIndex);
+    LONGLONG portsStart = hubStats ? QpcNow() : 0;
+    int added = 0;
+    
+    TracePortsBegin(trace, hubIndex, numPorts);
+    
+    // Check each port
+    for (int port = 1; port <= numPorts; port++) {
+        USB_NODE_CONNECTION_INFORMATION_EX connInfo;
+        ZeroMemory(&connInfo, sizeof(connInfo));
+        LONGLONG portStart = hubStats ? QpcNow() : 0;
+        
+        ETW_IOCTL_START(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                        hubs[hubIndex].devicePath, port);
+        BOOL queried = GetPortConnectorProperties(hHub, port, &connInfo);
+        DWORD queryError = queried ? ERROR_SUCCESS : GetLastError();
+        ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                       hubs[hubIndex].devicePath, port, queryError);
+        
+        if (!queried) {
+            TracePort(trace, hubIndex, port, portStart, queryError);
+            if (failedPorts != NULL) {
+                (*failedPorts)++;
+            }
+            
+            if (hubGone != NULL && IsDeviceGoneError(queryError)) {
+                *hubGone = TRUE;
+                break;
+            }
+            continue;
+        }
+        
+        DWORD error = ERROR_SUCCESS;
+        if (connInfo.ConnectionStatus == DeviceConnected) {
+            USBDeviceRecord* dev = SlabAppend(slab);
+            if (dev != NULL) {
+                FillDeviceRecord(dev, hubIndex, port, &connInfo);
+                DetectSuperSpeedPlus(hHub, FALSE, INFINITE, port, dev);
+                if (connInfo.DeviceIsHub) {
+                    ETW_IOCTL_START(IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME,
+                                    hubs[hubIndex].devicePath, port);
+                    dev->childHubIndex = ResolveChildHub(hHub, FALSE, INFINITE, port, hubs,
+                                                         hubCount, &error);
+                    ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME,
+                                   hubs[hubIndex].devicePath, port, error);
+                }
+                added++;
+                
+                if (slab->callback != NULL &&
+                    !slab->callback(dev, hubs[hubIndex].devicePath, hubs[hubIndex].hubDesc,
+                                    slab->userData)) {
+                    slab->stopped = TRUE;
+                }
+            }
+        }
+        if (error != ERROR_SUCCESS && failedPorts != NULL) {
+            (*failedPorts)++;
+        }
+        TracePort(trace, hubIndex, port, portStart, error);
+        
+        if (slab->stopped) {
+            break;
+        }
+    }
+    
+    if (hubStats != NULL) {
+        hubStats->portsUs += QpcMicros(portsStart, QpcNow());
+    }
+    return added;
+}
+
+// Open hubs[hubIndex], query every port and append its connected devices
+// to a slab. Returns the number of devices appended.
+static int ProbeHub(const HubEntry* hubs, int hubCount, int hubIndex, DeviceSlab* slab,
+                    ScanTrace* trace) {
+    const HubEntry* hub = &hubs[hubIndex];
+    HubScanStats* hubStats = TraceHub(trace, hubIndex);
+    int added = 0;
+    
+    if (hub->devicePath[0] == '\0') {
+        return 0;
+    }
+    
+    // Open the hub to query its ports
+    LONGLONG start = hubStats ? QpcNow() : 0;
+    ETW_HUB_OPEN_START(hub->devicePath);
+    HANDLE hHub = OpenDeviceHandle(hub->devicePath);
+    DWORD error = (hHub == INVALID_HANDLE_VALUE) ? GetLastError() : ERROR_SUCCESS;
+    ETW_HUB_OPEN_STOP(hub->devicePath, error);
+    TraceHubOpen(hubStats, start, hHub != INVALID_HANDLE_VALUE, error);
+    if (hHub == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    
+    USB_NODE_INFORMATION nodeInfo;
+    ZeroMemory(&nodeInfo, sizeof(nodeInfo));
+    
+    start = hubStats ? QpcNow() : 0;
+    ETW_IOCTL_START(IOCTL_USB_GET_NODE_INFORMATION, hub->devicePath, 0);
+    BOOL haveNodeInfo = GetHubNodeInfo(hHub, &nodeInfo);
+    error = haveNodeInfo ? ERROR_SUCCESS : GetLastError();
+    ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_INFORMATION, hub->devicePath, 0, error);
+    if (hubStats != NULL) {
+        hubStats->nodeInfoUs = QpcMicros(start, QpcNow());
+        if (!haveNodeInfo) {
+            TraceHubError(hubStats, error);
+        }
+    }
+    
+    if (haveNodeInfo) {
+        int numPorts = nodeInfo.u.HubInformation.HubDescriptor.bNumberOfPorts;
+        added = ProbePorts(hHub, hubIndex, numPorts, hubs, hubCount, slab, NULL, NULL, trace);
+    }
+    
+    g_backend->CloseDevice(hHub);
+    return added;
+}
+
+// Start an overlapped IOCTL on a handle bound to a completion port.
+// Returns TRUE if a completion packet will be queued for it.
+static BOOL IssueIoctlAsync(HANDLE hDevice, DWORD ioctl, LPVOID buffer,
+                            DWORD bufferSize, LPOVERLAPPED overlapped) {
+    if (g_backend->IoControl(hDevice, ioctl, buffer, bufferSize, NULL, overlapped)) {
+        return TRUE;
+    }
+    return GetLastError() == ERROR_IO_PENDING;
+}
+
+// Case-insensitive FNV-1a, since hub paths are compared with _stricmp()
+static unsigned int HashStringFold(const char* str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        unsigned char c = (unsigned char)*str++;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int RecordVidPid(const USBDeviceRecord* rec) {
+    return ((unsigned int)rec->vendorId << 16) | rec->productId;
+}
+
+static unsigned int HashVidPid(unsigned int key) {
+    key = (key ^ (key >> 16)) * 0x45d9f3bu;
+    key = (key ^ (key >> 16)) * 0x45d9f3bu;
+    return key ^ (key >> 16);
+}
+
+// Slots for an index of count keys, keeping the load factor under 1/2
+static int IndexSlotCount(int count) {
+    int slotCount = 16;
+    while (slotCount < count * 2) {
+        slotCount *= 2;
+    }
+    return slotCount;
+}
+
+// Key of a hub in the device path (table 0) or location path (table 1) index
+static const char* HubIndexKey(const HubEntry* hub, int table) {
+    return table ? hub->locationPath : hub->devicePath;
+}
+
+// Index every hub by device path and location path. Hubs without a
+// location path are left out of that index, and a duplicate path keeps
+// the first hub. If memory runs out the indexes stay unbuilt and
+// FindHubIndex() falls back to a linear search.
+static void BuildHubIndexes(TopologySnapshot* snap) {
+    int slotCount = IndexSlotCount(snap->hubCount);
+    if (!ReserveInts(&snap->hubSlots, &snap->hubSlotCapacity, slotCount * 2)) {
+        return;
+    }
+    for (int i = 0; i < slotCount * 2; i++) {
+        snap->hubSlots[i] = -1;
+    }
+    
+    for (int table = 0; table < 2; table++) {
+        int* slots = snap->hubSlots + table * slotCount;
+        
+        for (int h = 0; h < snap->hubCount; h++) {
+            const char* key = HubIndexKey(&snap->hubs[h], table);
+            if (key[0] == '\0') {
+                continue;
+            }
+            
+            unsigned int slot = HashStringFold(key) & (slotCount - 1);
+            while (slots[slot] >= 0 &&
+                   _stricmp(HubIndexKey(&snap->hubs[slots[slot]], table), key) != 0) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            if (slots[slot] < 0) {
+                slots[slot] = h;
+            }
+        }
+    }
+    snap->hubSlotCount = slotCount;
+}
+
+// Hub whose device path (table 0) or location path (table 1) is key, or -1
+static int FindHubIndex(const TopologySnapshot* snap, int table, const char* key) {
+    if (snap == NULL || key == NULL || key[0] == '\0') {
+        return -1;
+    }
+    
+    if (snap->hubSlotCount == 0) {
+        for (int h = 0; h < snap->hubCount; h++) {
+            if (_stricmp(HubIndexKey(&snap->hubs[h], table), key) == 0) {
+                return h;
+            }
+        }
+        return -1;
+    }
+    
+    int slotCount = snap->hubSlotCount;
+    const int* slots = snap->hubSlots + table * slotCount;
+    unsigned int slot = HashStringFold(key) & (slotCount - 1);
+    while (slots[slot] >= 0) {
+        if (_stricmp(HubIndexKey(&snap->hubs[slots[slot]], table), key) == 0) {
+            return slots[slot];
+        }
+        slot = (slot + 1) & (slotCount - 1);
+    }
+    return -1;
+}
+
+// Index every record by VID/PID. Records are inserted last to first so
+// each chain comes out in record order. If memory runs out the index stays
+// unbuilt and FindVidPid() falls back to a linear search.
+static void BuildVidPidIndex(TopologySnapshot* snap) {
+    int slotCount = IndexSlotCount(snap->deviceCount);
+    snap->vidPidSlotCount = 0;
+    if (!ReserveInts(&snap->vidPidSlots, &snap->vidPidSlotCapacity, slotCount) ||
+        !ReserveInts(&snap->vidPidNext, &snap->vidPidNextCapacity, snap->deviceCount)) {
+        return;
+    }
+    
+    int* slots = snap->vidPidSlots;
+    for (int i = 0; i < slotCount; i++) {
+        slots[i] = -1;
+    }
+    
+    for (int i = snap->deviceCount - 1; i >= 0; i--) {
+        unsigned int key = RecordVidPid(&snap->records[i]);
+        unsigned int slot = HashVidPid(key) & (slotCount - 1);
+        while (slots[slot] >= 0 && RecordVidPid(&snap->records[slots[slot]]) != key) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        snap->vidPidNext[i] = slots[slot];
+        slots[slot] = i;
+    }
+    snap->vidPidSlotCount = slotCount;
+}
+
+// Records with VID/PID key, in record order. Writes at most capacity
+// indices to out and returns the total number of matches.
+static int FindVidPid(const TopologySnapshot* snap, unsigned int key, int* out, int capacity) {
+    int matches = 0;
+    
+    if (snap->vidPidSlotCount == 0) {
+        for (int i = 0; i < snap->deviceCount; i++) {
+            if (RecordVidPid(&snap->records[i]) == key) {
+                if (out != NULL && matches < capacity) {
+                    out[matches] = i;
+                }
+                matches++;
+            }
+        }
+        return matches;
+    }
+    
+    int slotCount = snap->vidPidSlotCount;
+    unsigned int slot = HashVidPid(key) & (slotCount - 1);
+    while (snap->vidPidSlots[slot] >= 0 &&
+           RecordVidPid(&snap->records[snap->vidPidSlots[slot]]) != key) {
+        slot = (slot + 1) & (slotCount - 1);
+    }
+    
+    for (int i = snap->vidPidSlots[slot]; i >= 0; i = snap->vidPidNext[i]) {
+        if (out != NULL && matches < capacity) {
+            out[matches] = i;
+        }
+        matches++;
+    }
+    return matches;
+}
+
+// Whether a hub's SPDRP_LOCATION_PATHS entry makes it a root hub: 1 if it
+// ends in USBROOT(n), 0 if it lies below one, -1 if the path doesn't say
+static int LocationPathIsRoot(const char* locationPath) {
+    const char* last = strrchr(locationPath, '#');
+    if (_strnicmp(last ? last + 1 : locationPath, "USBROOT(", 8) == 0) {
+        return 1;
+    }
+    
+    for (const char* step = locationPath; (step = strchr(step, '#')) != NULL; step++) {
+        if (_strnicmp(step + 1, "USBROOT(", 8) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Rebuild parent/child/sibling links, hub depths, the port lookup tables
+// and the hash indexes of an unpublished snapshot. Records must be in
+// hubIndex/port order.
+static void RebuildTree(TopologySnapshot* snap) {
+    USBDeviceRecord* records = snap->records;
+    HubEntry* hubs = snap->hubs;
+    int hubCount = snap->hubCount;
+    int deviceCount = snap->deviceCount;
+    
+    for (int h = 0; h < hubCount; h++) {
+        HubEntry* hub = &hubs[h];
+        hub->parentRecord = -1;
+        hub->rootOrdinal = -1;
+        hub->depth = 0;
+        hub->firstRecord = -1;
+        hub->recordCount = 0;
+        hub->maxPort = 0;
+        hub->scanFlags &= ~USB_HUB_SCAN_UNRESOLVED;
+    }
+    
+    // Hub ranges, and which port each cascaded hub hangs off
+    for (int i = 0; i < deviceCount; i++) {
+        USBDeviceRecord* rec = &records[i];
+        HubEntry* hub = &hubs[rec->hubIndex];
+        
+        if (hub->firstRecord < 0) {
+            hub->firstRecord = i;
+        }
+        hub->recordCount++;
+        if (rec->portNumber > hub->maxPort) {
+            hub->maxPort = rec->portNumber;
+        }
+        
+        if (rec->childHubIndex >= 0 && rec->childHubIndex < hubCount) {
+            hubs[rec->childHubIndex].parentRecord = i;
+        } else {
+            rec->childHubIndex = -1;
+        }
+    }
+    
+    // Depths by walking up; a broken chain longer than the hub count is a
+    // cycle, so treat that hub as a root
+    snap->rootHubCount = 0;
+    for (int h = 0; h < hubCount; h++) {
+        int depth = 0;
+        int parent = hubs[h].parentRecord;
+        
+        while (parent >= 0 && depth <= hubCount) {
+            depth++;
+            parent = hubs[records[parent].hubIndex].parentRecord;
+        }
+        if (depth > hubCount) {
+            hubs[h].parentRecord = -1;
+            depth = 0;
+        }
+        hubs[h].depth = depth;
+        
+        // A hub SetupAPI places below a root hub but whose upstream port
+        // wasn't resolved isn't a root; numbering it would shift every
+        // later root's port paths and give it a controller group
+        if (depth == 0 && LocationPathIsRoot(hubs[h].locationPath) == 0) {
+            hubs[h].scanFlags |= USB_HUB_SCAN_UNRESOLVED;
+            continue;
+        }
+        
+        if (depth == 0 && ReserveInts(&snap->rootHubs, &snap->rootHubCapacity,
+                                      snap->rootHubCount + 1)) {
+            hubs[h].rootOrdinal = snap->rootHubCount;
+            snap->rootHubs[snap->rootHubCount++] = h;
+        }
+    }
+    
+    // Port tables give constant-time (hub, port) -> record lookups
+    int tableSize = 0;
+    for (int h = 0; h < hubCount; h++) {
+        hubs[h].portTableOffset = tableSize;
+        tableSize += hubs[h].maxPort + 1;
+    }
+    if (!ReserveInts(&snap->portTable, &snap->portTableCapacity, tableSize)) {
+        for (int h = 0; h < hubCount; h++) {
+            hubs[h].maxPort = -1;
+        }
+    } else {
+        for (int i = 0; i < tableSize; i++) {
+            snap->portTable[i] = -1;
+        }
+    }
+    
+    for (int i = 0; i < deviceCount; i++) {
+        USBDeviceRecord* rec = &records[i];
+        const HubEntry* hub = &hubs[rec->hubIndex];
+        
+        rec->parentIndex = hub->parentRecord;
+        rec->depth = (unsigned short)hub->depth;
+        rec->firstChild = (rec->childHubIndex >= 0) ? hubs[rec->childHubIndex].firstRecord : -1;
+        rec->nextSibling = (i + 1 < deviceCount &&
+                            records[i + 1].hubIndex == rec->hubIndex) ? i + 1 : -1;
+        
+        if (hub->maxPort >= 0) {
+            snap->portTable[hub->portTableOffset + rec->portNumber] = i;
+        }
+    }
+    
+    if (snap->hubSlotCount == 0) {
+        BuildHubIndexes(snap);
+    }
+    BuildVidPidIndex(snap);
+}
+
+// Publish a finished scan as ctx's next snapshot. Hub strings are
+// interned once here and shared by every record on the hub. dropped is the
+// number of devices the scan saw but couldn't keep. Takes ownership of
+// hubs. Returns the published device count, or -1 if out of memory.
+static int PublishScan(MapperContext* ctx, ScanTrace* trace, HubEntry* hubs, int hubCount,
+                       const USBDeviceRecord* devices, int count, int dropped) {
+    TraceProbeDone(trace);
+    
+    TopologySnapshot* snap = BeginSnapshot(ctx);
+    if (snap == NULL) {
+        free(hubs);
+        return -1;
+    }
+    
+    // Leave headroom so watch-mode patches rarely need to regrow
+    if (count > 0 && !ReserveRecords(snap, count + count / 4 + 16) &&
+        !ReserveRecords(snap, count)) {
+        dropped += count;
+        count = 0;
+    }
+    
+    for (int i = 0; i < hubCount; i++) {
+        hubs[i].pathOffset = StringTableIntern(&snap->strings, hubs[i].devicePath);
+        hubs[i].descOffset = StringTableIntern(&snap->strings, hubs[i].hubDesc);
+        hubs[i].driverKeyOffset = StringTableIntern(&snap->strings, hubs[i].driverKey);
+        hubs[i].locationInfoOffset = StringTableIntern(&snap->strings, hubs[i].locationInfo);
+        hubs[i].locationPathOffset = StringTableIntern(&snap->strings, hubs[i].locationPath);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        snap->records[i] = devices[i];
+        snap->records[i].hubPathOffset = hubs[devices[i].hubIndex].pathOffset;
+        snap->records[i].hubDescOffset = hubs[devices[i].hubIndex].descOffset;
+    }
+    snap->deviceCount = count;
+    snap->droppedCount = dropped;
+    snap->hubs = hubs;
+    snap->hubCount = hubCount;
+    
+    RebuildTree(snap);
+    CommitSnapshot(ctx, snap);
+    
+    return count;
+}
+
+// Serial scan into ctx. A non-NULL callback sees every device as it is
+// found; if it stops the scan, nothing is published and the number of
+// devices it saw is returned.
+static int EnumerateSerial(MapperContext* ctx, ScanTrace* trace,
+                           USBDeviceCallback callback, void* userData) {
+    HubEntry* hubs;
+    
+    int hubCount = CollectHubs(&hubs);
+    TraceHubsCollected(trace, hubCount);
+    if (hubCount < 0) {
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    
+    DeviceSlab slab = { NULL, 0, 0, TRUE, 0, callback, userData, FALSE };
+    for (int hubIndex = 0; hubIndex < hubCount && !slab.stopped; hubIndex++) {
+        ProbeHub(hubs, hubCount, hubIndex, &slab, trace);
+    }
+    
+    if (slab.stopped) {
+        TraceProbeDone(trace);
+        free(slab.devices);
+        free(hubs);
+        return slab.count;
+    }
+    
+    int count = PublishScan(ctx, trace, hubs, hubCount, slab.devices, slab.count, slab.dropped);
+    free(slab.devices);
+    
+    return count;
+}
+
+// Where one hub's devices landed in the parallel scan
+typedef struct {
+    int worker;
+    int offset;
+    int count;
+} HubSpan;
+
+// State for one parallel worker. Each worker owns its slab; hubs are
+// handed out through a shared counter.
+typedef struct {
+    int workerIndex;
+    const HubEntry* hubs;
+    int hubCount;
+    volatile LONG* nextHub;
+    HubSpan* spans;
+    DeviceSlab slab;
+    ScanTrace* trace;
+} ParallelWorker;
+
+static DWORD WINAPI ParallelWorkerProc(LPVOID param) {
+    ParallelWorker* worker = (ParallelWorker*)param;
+    
+    for (;;) {
+        int hubIndex = (int)InterlockedIncrement(worker->nextHub) - 1;
+        if (hubIndex >= worker->hubCount) {
+            break;
+        }
+        
+        // Each hub is claimed by exactly one worker, so its span needs no lock
+        HubSpan* span = &worker->spans[hubIndex];
+        span->worker = worker->workerIndex;
+        span->offset = worker->slab.count;
+        span->count = ProbeHub(worker->hubs, worker->hubCount, hubIndex, &worker->slab,
+                               worker->trace);
+    }
+    
+    return 0;
+}
+
+// Parallel scan into ctx. Hubs are probed on workerCount threads (<= 0
+// picks the CPU count), then merged in hubIndex order so results match the
+// serial scan.
+static int EnumerateParallel(MapperContext* ctx, ScanTrace* trace, int workerCount) {
+    HubEntry* hubs;
+    
+    int hubCount = CollectHubs(&hubs);
+    TraceHubsCollected(trace, hubCount);
+    if (hubCount < 0) {
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    if (hubCount == 0) {
+        return PublishScan(ctx, trace, hubs, 0, NULL, 0, 0);
+    }
+    
+    if (workerCount <= 0) {
+        SYSTEM_INFO sysInfo;
+        GetSystemInfo(&sysInfo);
+        workerCount = (int)sysInfo.dwNumberOfProcessors;
+    }
+    if (workerCount > hubCount) {
+        workerCount = hubCount;
+    }
+    if (workerCount > MAX_WORKERS) {
+        workerCount = MAX_WORKERS;
+    }
+    
+    HubSpan* spans = (HubSpan*)calloc(hubCount, sizeof(HubSpan));
+    ParallelWorker* workers = (ParallelWorker*)calloc(workerCount, sizeof(ParallelWorker));
+    HANDLE threads[MAX_WORKERS];
+    volatile LONG nextHub = 0;
+    int threadCount = 0;
+    
+    if (spans == NULL || workers == NULL) {
+        free(spans);
+        free(workers);
+        free(hubs);
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].workerIndex = i;
+        workers[i].hubs = hubs;
+        workers[i].hubCount = hubCount;
+        workers[i].nextHub = &nextHub;
+        workers[i].spans = spans;
+        workers[i].slab.growable = TRUE;
+        workers[i].trace = trace;
+        
+        threads[threadCount] = CreateThread(NULL, 0, ParallelWorkerProc,
+                                            &workers[i], 0, NULL);
+        if (threads[threadCount] != NULL) {
+            threadCount++;
+        }
+    }
+    
+    // If no thread could be started, fall back to probing on this one
+    if (threadCount == 0) {
+        ParallelWorkerProc(&workers[0]);
+    } else {
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+        for (int i = 0; i < threadCount; i++) {
+            CloseHandle(threads[i]);
+        }
+    }
+    
+    // Merge slabs back into serial hubIndex/port order
+    int total = 0;
+    int dropped = 0;
+    for (int i = 0; i < workerCount; i++) {
+        total += workers[i].slab.count;
+        dropped += workers[i].slab.dropped;
+    }
+    
+    USBDeviceRecord* merged = (USBDeviceRecord*)malloc((total ? total : 1) * sizeof(USBDeviceRecord));
+    int count = 0;
+    if (merged == NULL) {
+        dropped += total;
+    }
+    
+    for (int hubIndex = 0; merged != NULL && hubIndex < hubCount; hubIndex++) {
+        const HubSpan* span = &spans[hubIndex];
+        
+        if (span->count > 0) {
+            memcpy(&merged[count],
+                   &workers[span->worker].slab.devices[span->offset],
+                   span->count * sizeof(USBDeviceRecord));
+            count += span->count;
+        }
+    }
+    
+    for (int i = 0; i < workerCount; i++) {
+        free(workers[i].slab.devices);
+    }
+    free(workers);
+    free(spans);
+    
+    count = PublishScan(ctx, trace, hubs, hubCount, merged, count, dropped);
+    free(merged);
+    
+    return count;
+}
+
+// Take a reference to a context's current snapshot - exported to Python.
+// NULL ctx reads the legacy results. The snapshot never changes, so every
+// Snapshot* call on it sees the same scan; later scans publish a new one.
+// Returns NULL before the first scan. Pair with ReleaseTopologySnapshot().
+__declspec(dllexport) TopologySnapshot* AcquireTopologySnapshot(MapperContext* ctx) {
+    return AcquireSnapshot(ResolveContext(ctx));
+}
+
+// Drop a reference from AcquireTopologySnapshot() - exported to Python
+__declspec(dllexport) void ReleaseTopologySnapshot(TopologySnapshot* snap) {
+    ReleaseSnapshot(snap);
+}
+
+// Counts describing one snapshot
+typedef struct {
+    int generation;
+    int deviceCount;
+    int seenDeviceCount;          // including devices that could not be stored
+    int hubCount;
+    int stringTableSize;          // bytes
+} TopologySummary;
+
+// Describe a snapshot - exported to Python. A NULL snapshot is empty.
+__declspec(dllexport) void SnapshotGetSummary(const TopologySnapshot* snap,
+                                              TopologySummary* out) {
+    if (out == NULL) {
+        return;
+    }
+    
+    ZeroMemory(out, sizeof(TopologySummary));
+    if (snap != NULL) {
+        out->generation = (int)snap->generation;
+        out->deviceCount = snap->deviceCount;
+        out->seenDeviceCount = snap->deviceCount + snap->droppedCount;
+        out->hubCount = snap->hubCount;
+        out->stringTableSize = (int)snap->strings.size;
+    }
+}
+
+// Get one snapshot record in the v1 layout - exported to Python.
+// Returns 1 if index is valid.
+__declspec(dllexport) int SnapshotGetDeviceInfo(const TopologySnapshot* snap, int index,
+                                                USBDeviceInfo* outInfo) {
+    if (snap == NULL || index < 0 || index >= snap->deviceCount || outInfo == NULL) {
+        return 0;
+    }
+    
+    ExpandRecord(snap, &snap->records[index], outInfo);
+    return 1;
+}
+
+// Copy every snapshot record in the v1 layout - exported to Python.
+// Writes at most capacity records and returns the total device count, so a
+// return value above capacity means the buffer was too small.
+__declspec(dllexport) int SnapshotGetAllDeviceInfo(const TopologySnapshot* snap,
+                                                   USBDeviceInfo* outInfo, int capacity) {
+    int count = (snap != NULL) ? snap->deviceCount : 0;
+    
+    for (int i = 0; outInfo != NULL && i < count && i < capacity; i++) {
+        ExpandRecord(snap, &snap->records[i], &outInfo[i]);
+    }
+    return count;
+}
+
+// Copy every compact snapshot record - exported to Python.
+// Same contract as SnapshotGetAllDeviceInfo(); resolve string offsets with
+// SnapshotGetStringTable().
+__declspec(dllexport) int SnapshotGetDeviceRecords(const TopologySnapshot* snap,
+                                                   USBDeviceRecord* outRecords, int capacity) {
+    int count = (snap != NULL) ? snap->deviceCount : 0;
+    
+    int copied = (capacity < count) ? capacity : count;
+    if (outRecords != NULL && copied > 0) {
+        memcpy(outRecords, snap->records, copied * sizeof(USBDeviceRecord));
+    }
+    return count;
+}
+
+// Select the snapshot records matching filter - exported to Python.
+// The hub path prefix is checked once per hub and the numeric fields in
+// one pass over the record array, so rejected records are never copied.
+// Writes up to capacity matches to outIndices and/or outRecords (either
+// may be NULL) and returns the total match count, or -1 if out of memory.
+// A NULL filter matches everything.
+__declspec(dllexport) int SnapshotFilterRecords(const TopologySnapshot* snap,
+                                                const USBDeviceFilter* filter,
+                                                int* outIndices, USBDeviceRecord* outRecords,
+                                                int capacity) {
+    if (snap == NULL) {
+        return 0;
+    }
+    
+    static const USBDeviceFilter matchAll;
+    if (filter == NULL) {
+        filter = &matchAll;
+    }
+    
+    int vendorCount = filter->vendorCount;
+    int productCount = filter->productCount;
+    vendorCount = (vendorCount < 0) ? 0 :
+                  (vendorCount > USB_FILTER_MAX_IDS) ? USB_FILTER_MAX_IDS : vendorCount;
+    productCount = (productCount < 0) ? 0 :
+                   (productCount > USB_FILTER_MAX_IDS) ? USB_FILTER_MAX_IDS : productCount;
+    
+    unsigned char requireFlags = (filter->flags & USB_FILTER_HUBS_ONLY) ?
+                                 USB_RECORD_FLAG_HUB : 0;
+    unsigned char rejectFlags = (filter->flags & USB_FILTER_DEVICES_ONLY) ?
+                                USB_RECORD_FLAG_HUB : 0;
+    
+    // Hubs whose path fails the prefix
+    unsigned char* hubRejected = NULL;
+    size_t prefixLength = strnlen(filter->hubPathPrefix, sizeof(filter->hubPathPrefix));
+    if (prefixLength > 0) {
+        hubRejected = (unsigned char*)calloc(snap->hubCount ? snap->hubCount : 1, 1);
+        if (hubRejected == NULL) {
+            return -1;
+        }
+        for (int h = 0; h < snap->hubCount; h++) {
+            hubRejected[h] = _strnicmp(snap->hubs[h].devicePath, filter->hubPathPrefix,
+                                       prefixLength) != 0;
+        }
+    }
+    
+    int matches = 0;
+    for (int i = 0; i < snap->deviceCount; i++) {
+        const USBDeviceRecord* rec = &snap->records[i];
+        
+        if ((rec->flags & requireFlags) != requireFlags || (rec->flags & rejectFlags) != 0) {
+            continue;
+        }
+        if (filter->speedMask != 0) {
+            unsigned int speedBit = (rec->speed >= 0 && rec->speed <= 3) ?
+                                    (1u << rec->speed) : USB_FILTER_SPEED_UNKNOWN;
+            if (rec->speed == 4) {
+                speedBit = USB_FILTER_SPEED_SUPERPLUS | USB_FILTER_SPEED_SUPER;
+            }
+            if ((filter->speedMask & speedBit) == 0) {
+                continue;
+            }
+        }
+        if (vendorCount + productCount > 0) {
+            BOOL listed = FALSE;
+            unsigned int id = ((unsigned int)rec->vendorId << 16) | rec->productId;
+            for (int v = 0; v < vendorCount && !listed; v++) {
+                listed = (filter->vendorIds[v] == rec->vendorId);
+            }
+            for (int p = 0; p < productCount && !listed; p++) {
+                listed = (filter->products[p] == id);
+            }
+            if (!listed) {
+                continue;
+            }
+        }
+        if (hubRejected != NULL && hubRejected[rec->hubIndex]) {
+            continue;
+        }
+        
+        if (matches < capacity) {
+            if (outIndices != NULL) {
+                outIndices[matches] = i;
+            }
+            if (outRecords != NULL) {
+                outRecords[matches] = *rec;
+            }
+        }
+        matches++;
+    }
+    
+    free(hubRejected);
+    return matches;
+}
+
+// Build one snapshot device's description - exported to Python.
+// Returns the full length (excluding NUL) like snprintf, or -1 for a bad
+// index. out may be NULL to query the length.
+__declspec(dllexport) int SnapshotGetDeviceDescription(const TopologySnapshot* snap, int index,
+                                                       char* out, int capacity) {
+    if (snap == NULL || index < 0 || index >= snap->deviceCount) {
+        return -1;
+    }
+    return FormatDeviceDesc(snap, &snap->records[index], out, out ? capacity : 0);
+}
+
+// Copy every snapshot hub's shared properties - exported to Python.
+// Same contract as SnapshotGetDeviceRecords().
+__declspec(dllexport) int SnapshotGetHubRecords(const TopologySnapshot* snap,
+                                                USBHubRecord* outHubs, int capacity) {
+    int count = (snap != NULL) ? snap->hubCount : 0;
+    
+    for (int i = 0; outHubs != NULL && i < count && i < capacity; i++) {
+        const HubEntry* hub = &snap->hubs[i];
+        outHubs[i].hubIndex = i;
+        outHubs[i].pathOffset = hub->pathOffset;
+        outHubs[i].descOffset = hub->descOffset;
+        outHubs[i].driverKeyOffset = hub->driverKeyOffset;
+        outHubs[i].locationInfoOffset = hub->locationInfoOffset;
+        outHubs[i].locationPathOffset = hub->locationPathOffset;
+        outHubs[i].parentRecord = hub->parentRecord;
+        outHubs[i].rootOrdinal = hub->rootOrdinal;
+        outHubs[i].depth = hub->depth;
+        outHubs[i].firstRecord = hub->firstRecord;
+        outHubs[i].recordCount = hub->recordCount;
+        outHubs[i].scanFlags = hub->scanFlags;
+    }
+    return count;
+}
+
+// Copy a snapshot's string table - exported to Python.
+// Writes nothing unless all of it fits in capacity bytes; returns the table
+// size in bytes.
+__declspec(dllexport) int SnapshotGetStringTable(const TopologySnapshot* snap,
+                                                 char* out, int capacity) {
+    int size = (snap != NULL) ? (int)snap->strings.size : 0;
+    
+    if (out != NULL && size > 0 && size <= capacity) {
+        memcpy(out, snap->strings.data, size);
+    }
+    return size;
+}
+
+// Point at one string of a snapshot's table - exported to Python.
+// Strings are UTF-8 and stay valid until the snapshot is released. Returns
+// NULL for an offset outside the table; *outLength, if given, gets the
+// length in bytes.
+__declspec(dllexport) const char* SnapshotGetString(const TopologySnapshot* snap,
+                                                    unsigned int offset, int* outLength) {
+    if (snap == NULL || offset >= snap->strings.size) {
+        return NULL;
+    }
+    
+    const char* str = snap->strings.data + offset;
+    if (outLength != NULL) {
+        *outLength = (int)strlen(str);
+    }
+    return str;
+}
+
+// Copy one string of a snapshot's table as UTF-16 - exported to Python.
+// Writes nothing unless the string and its terminator fit in capacity
+// WCHARs. Returns the length in WCHARs, or -1 for a bad offset.
+__declspec(dllexport) int SnapshotGetStringW(const TopologySnapshot* snap, unsigned int offset,
+                                             WCHAR* out, int capacity) {
+    const char* str = SnapshotGetString(snap, offset, NULL);
+    if (str == NULL) {
+        return -1;
+    }
+    
+    // The table only ever holds valid UTF-8, so this can't fail on content
+    int length = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0) - 1;
+    if (out != NULL && length >= 0 && length < capacity) {
+        MultiByteToWideChar(CP_UTF8, 0, str, -1, out, capacity);
+    }
+    return length;
+}
+
+// Walk a port path like "root3.2.4". Returns the record at the last port
+// (-1 for a bare "rootN" or a bad path) and sets *outHubIndex to the hub the
+// path leads to: root hub N for "rootN", else the hub attached to the last
+// port, or -1.
+static int LookupPortPath(const TopologySnapshot* snap, const char* portPath,
+                          int* outHubIndex) {
+    *outHubIndex = -1;
+    
+    if (snap == NULL || portPath == NULL || _strnicmp(portPath, "root", 4) != 0) {
+        return -1;
+    }
+    
+    char* cursor;
+    long root = strtol(portPath + 4, &cursor, 10);
+    if (cursor == portPath + 4 || (*cursor != '.' && *cursor != '\0')) {
+        return -1;
+    }
+    
+    int index = -1;
+    int hubIndex = (root >= 0 && root < snap->rootHubCount) ? snap->rootHubs[root] : -1;
+    
+    while (hubIndex >= 0 && *cursor == '.') {
+        const char* start = cursor + 1;
+        long port = strtol(start, &cursor, 10);
+        if (cursor == start) {
+            return -1;
+        }
+        
+        index = RecordAtPort(snap, hubIndex, (int)port);
+        hubIndex = (index >= 0) ? snap->records[index].childHubIndex : -1;
+    }
+    if (*cursor != '\0') {
+        return -1;
+    }
+    
+    *outHubIndex = hubIndex;
+    return index;
+}
+
+// Find a snapshot record by port path - exported to Python.
+// "root3.2.4" is port 4 of the hub on port 2 of root hub 3 (root hubs are
+// numbered from 0 in hubIndex order, ports from 1). Each step is a table
+// lookup. Returns the record index or -1.
+__declspec(dllexport) int SnapshotFindRecordByPortPath(const TopologySnapshot* snap,
+                                                       const char* portPath) {
+    int hubIndex;
+    return LookupPortPath(snap, portPath, &hubIndex);
+}
+
+// Format a snapshot record's port path, the inverse of
+// SnapshotFindRecordByPortPath() - exported to Python. Returns the length
+// like snprintf, or -1.
+__declspec(dllexport) int SnapshotGetPortPath(const TopologySnapshot* snap, int index,
+                                              char* out, int capacity) {
+    if (snap == NULL || index < 0 || index >= snap->deviceCount) {
+        return -1;
+    }
+    
+    int chain[32];
+    int depth = 0;
+    
+    // Walk up to the root hub, collecting ports leaf first
+    int current = index;
+    while (current >= 0 && depth < 32) {
+        chain[depth++] = current;
+        current = snap->records[current].parentIndex;
+    }
+    
+    const HubEntry* root = &snap->hubs[snap->records[chain[depth - 1]].hubIndex];
+    if (current >= 0 || root->rootOrdinal < 0) {
+        return -1;
+    }
+    
+    char buffer[256];
+    int used = snprintf(buffer, sizeof(buffer), "root%d", root->rootOrdinal);
+    
+    for (int i = depth - 1; i >= 0 && used < (int)sizeof(buffer); i--) {
+        used += snprintf(buffer + used, sizeof(buffer) - used, ".%d",
+                         snap->records[chain[i]].portNumber);
+    }
+    return snprintf(out, out ? capacity : 0, "%s", buffer);
+}
+
+// Find snapshot records by VID/PID - exported to Python. One hash probe,
+// then a walk over just the matching records. Writes at most capacity
+// record indices to outIndices, in record order, and returns the total
+// number of matches.
+__declspec(dllexport) int SnapshotFindRecordsByVidPid(const TopologySnapshot* snap,
+                                                      unsigned short vendorId,
+                                                      unsigned short productId,
+                                                      int* outIndices, int capacity) {
+    if (snap == NULL) {
+        return 0;
+    }
+    return FindVidPid(snap, ((unsigned int)vendorId << 16) | productId, outIndices, capacity);
+}
+
+// Find a snapshot hub by device path or location path through the hub
+// indexes - exported to Python. Case-insensitive. Returns the hubIndex or -1.
+__declspec(dllexport) int SnapshotFindHub(const TopologySnapshot* snap, const char* path) {
+    int hubIndex = FindHubIndex(snap, 0, path);
+    return (hubIndex >= 0) ? hubIndex : FindHubIndex(snap, 1, path);
+}
+
+// Find a snapshot record by the location path of the device on it -
+// exported to Python. A device's location path is its hub's with
+// "#USB(port)" appended, e.g. "PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)" is
+// port 2 of that root hub, so this is a hub index probe and a port table
+// lookup. Returns the record index or -1.
+__declspec(dllexport) int SnapshotFindRecordByLocation(const TopologySnapshot* snap,
+                                                       const char* locationPath) {
+    if (snap == NULL || locationPath == NULL) {
+        return -1;
+    }
+    
+    const char* last = strrchr(locationPath, '#');
+    size_t hubLength = (last != NULL) ? (size_t)(last - locationPath) : 0;
+    if (hubLength == 0 || hubLength >= MAX_PATH_LEN || _strnicmp(last, "#USB(", 5) != 0) {
+        return -1;
+    }
+    
+    char* cursor;
+    long port = strtol(last + 5, &cursor, 10);
+    if (cursor == last + 5 || strcmp(cursor, ")") != 0) {
+        return -1;
+    }
+    
+    char hubPath[MAX_PATH_LEN];
+    memcpy(hubPath, locationPath, hubLength);
+    hubPath[hubLength] = '\0';
+    return RecordAtPort(snap, FindHubIndex(snap, 1, hubPath), (int)port);
+}
+
+// Copy what changed since the previously published snapshot - exported to
+// Python. Changes are computed once when a snapshot is published, so this
+// is a plain copy. Writes at most capacity entries and returns the total
+// count, or -1 if the change set is unavailable (compare full snapshots
+// instead). *outBaseGeneration, if given, receives the generation the
+// changes are relative to; 0 means everything was added.
+__declspec(dllexport) int SnapshotGetChanges(const TopologySnapshot* snap,
+                                             USBRecordChange* out, int capacity,
+                                             int* outBaseGeneration) {
+    if (outBaseGeneration != NULL) {
+        *outBaseGeneration = (snap != NULL) ? snap->baseGeneration : 0;
+    }
+    if (snap == NULL) {
+        return 0;
+    }
+    if (snap->changeCount < 0) {
+        return -1;
+    }
+    
+    int copied = (capacity < snap->changeCount) ? capacity : snap->changeCount;
+    if (out != NULL && copied > 0) {
+        memcpy(out, snap->changes, copied * sizeof(USBRecordChange));
+    }
+    return snap->changeCount;
+}
+
+// Hash of every record's hub path, port and contents - exported to Python.
+// Equal hashes mean nothing changed. 0 for a NULL snapshot.
+__declspec(dllexport) unsigned long long SnapshotGetTopologyHash(const TopologySnapshot* snap) {
+    return (snap != NULL) ? snap->topologyHash : 0;
+}
+
+// Topology hash of a context's current snapshot - exported to Python.
+// NULL ctx reads the legacy results. 0 before the first scan.
+__declspec(dllexport) unsigned long long GetTopologyHash(MapperContext* ctx) {
+    TopologySnapshot* snap = AcquireSnapshot(ResolveContext(ctx));
+    unsigned long long hash = SnapshotGetTopologyHash(snap);
+    ReleaseSnapshot(snap);
+    return hash;
+}
+
+// Saved snapshot files: a fixed header, then the record array, the hub
+// records and the string table, each 8-byte aligned and stored exactly as
+// they are in memory. A reader can map the file and use every section in
+// place; offsets in the records point into the file's own string table.
+#define USB_SNAPSHOT_MAGIC   0x54425355    // "USBT"
+#define USB_SNAPSHOT_VERSION 2
+
+// Ports a hub can have; bNumberOfPorts in the hub descriptor is a UCHAR
+#define USB_MAX_HUB_PORTS 255
+
+typedef struct {
+    unsigned int magic;           // USB_SNAPSHOT_MAGIC
+    unsigned short version;       // USB_SNAPSHOT_VERSION
+    unsigned short headerSize;    // sizeof(USBSnapshotFileHeader)
+    unsigned short recordSize;    // sizeof(USBDeviceRecord)
+    unsigned short hubRecordSize; // sizeof(USBHubRecord)
+    int deviceCount;
+    int hubCount;
+    int droppedCount;
+    unsigned int stringTableSize; // bytes
+    unsigned int recordsOffset;   // from the start of the file
+    unsigned int hubsOffset;
+    unsigned int stringsOffset;
+    unsigned int generation;      // of the snapshot when it was saved
+    unsigned int reserved;
+    unsigned long long topologyHash;
+    unsigned long long savedTime; // FILETIME, UTC
+} USBSnapshotFileHeader;
+
+#define SNAPSHOT_ALIGN(n) (((n) + 7u) & ~7u)
+
+// Lay out a file header for snap
+static void FillSnapshotHeader(const TopologySnapshot* snap, USBSnapshotFileHeader* header) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    
+    ZeroMemory(header, sizeof(*header));
+    header->magic = USB_SNAPSHOT_MAGIC;
+    header->version = USB_SNAPSHOT_VERSION;
+    header->headerSize = sizeof(USBSnapshotFileHeader);
+    header->recordSize = sizeof(USBDeviceRecord);
+    header->hubRecordSize = sizeof(USBHubRecord);
+    header->deviceCount = snap->deviceCount;
+    header->hubCount = snap->hubCount;
+    header->droppedCount = snap->droppedCount;
+    header->stringTableSize = snap->strings.size;
+    header->recordsOffset = SNAPSHOT_ALIGN(sizeof(USBSnapshotFileHeader));
+    header->hubsOffset = SNAPSHOT_ALIGN(header->recordsOffset +
+                                        snap->deviceCount * sizeof(USBDeviceRecord));
+    header->stringsOffset = SNAPSHOT_ALIGN(header->hubsOffset +
+                                           snap->hubCount * sizeof(USBHubRecord));
+    header->generation = (unsigned int)snap->generation;
+    header->topologyHash = snap->topologyHash;
+    header->savedTime = ((unsigned long long)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// Bytes in the file laid out by FillSnapshotHeader()
+static unsigned int SnapshotImageSize(const USBSnapshotFileHeader* header) {
+    return header->stringsOffset + header->stringTableSize;
+}
+
+// Write snap's file image, SnapshotImageSize(header) bytes, to out
+static void WriteSnapshotImage(const TopologySnapshot* snap,
+                               const USBSnapshotFileHeader* header, char* out) {
+    ZeroMemory(out, SnapshotImageSize(header));
+    memcpy(out, header, sizeof(*header));
+    if (snap->deviceCount > 0) {
+        memcpy(out + header->recordsOffset, snap->records,
+               snap->deviceCount * sizeof(USBDeviceRecord));
+    }
+    SnapshotGetHubRecords(snap, (USBHubRecord*)(out + header->hubsOffset), snap->hubCount);
+    if (header->stringTableSize > 0) {
+        memcpy(out + header->stringsOffset, snap->strings.data, header->stringTableSize);
+    }
+}
+
+// Build a whole snapshot file in memory. Returns its size (buffer in
+// *outFile, caller frees) or -1 if out of memory.
+static int BuildSnapshotFile(const TopologySnapshot* snap, char** outFile) {
+    USBSnapshotFileHeader header;
+    FillSnapshotHeader(snap, &header);
+    
+    int size = (int)SnapshotImageSize(&header);
+    char* file = (char*)malloc(size);
+    if (file == NULL) {
+        return -1;
+    }
+    
+    WriteSnapshotImage(snap, &header, file);
+    *outFile = file;
+    return size;
+}
+
+// Open a file by UTF-8 path
+static HANDLE OpenSnapshotFile(const char* path, BOOL write) {
+    WCHAR widePath[MAX_PATH_LEN];
+    
+    if (path == NULL || MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1,
+                                            widePath, MAX_PATH_LEN) == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    return CreateFileW(widePath,
+                       write ? GENERIC_WRITE : GENERIC_READ,
+                       write ? 0 : FILE_SHARE_READ,
+                       NULL,
+                       write ? CREATE_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+}
+
+// Save a snapshot to a file - exported to Python.
+// path is UTF-8 and is overwritten. Returns the file size in bytes, or -1
+// on failure (GetLastError() has the reason).
+__declspec(dllexport) int SnapshotSave(const TopologySnapshot* snap, const char* path) {
+    char* file;
+    
+    if (snap == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return -1;
+    }
+    
+    int size = BuildSnapshotFile(snap, &file);
+    if (size < 0) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return -1;
+    }
+    
+    HANDLE hFile = OpenSnapshotFile(path, TRUE);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        free(file);
+        return -1;
+    }
+    
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, file, (DWORD)size, &written, NULL) && written == (DWORD)size;
+    DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+    CloseHandle(hFile);
+    free(file);
+    
+    if (!ok) {
+        SetLastError(error ? error : ERROR_WRITE_FAULT);
+        return -1;
+    }
+    return size;
+}
+
+// Save a context's current snapshot to a file - exported to Python.
+// NULL ctx saves the legacy results. Same contract as SnapshotSave().
+__declspec(dllexport) int SaveSnapshot(MapperContext* ctx, const char* path) {
+    TopologySnapshot* snap = AcquireSnapshot(ResolveContext(ctx));
+    int size = SnapshotSave(snap, path);
+    ReleaseSnapshot(snap);
+    return size;
+}
+
+// True if [offset, offset + size) lies inside a file of fileSize bytes
+static BOOL SnapshotSectionFits(unsigned long long offset, unsigned long long size,
+                                unsigned long long fileSize) {
+    return (offset & 7) == 0 && offset <= fileSize && size <= fileSize - offset;
+}
+
+// Check a mapped snapshot file before anything in it is trusted
+static BOOL ValidateSnapshotFile(const char* file, unsigned long long fileSize) {
+    const USBSnapshotFileHeader* header = (const USBSnapshotFileHeader*)file;
+    
+    if (fileSize < sizeof(USBSnapshotFileHeader) ||
+        header->magic != USB_SNAPSHOT_MAGIC ||
+        header->version != USB_SNAPSHOT_VERSION ||
+        header->headerSize != sizeof(USBSnapshotFileHeader) ||
+        header->recordSize != sizeof(USBDeviceRecord) ||
+        header->hubRecordSize != sizeof(USBHubRecord) ||
+        header->deviceCount < 0 || header->hubCount < 0 ||
+        !SnapshotSectionFits(header->recordsOffset,
+                             (unsigned long long)header->deviceCount * sizeof(USBDeviceRecord),
+                             fileSize) ||
+        !SnapshotSectionFits(header->hubsOffset,
+                             (unsigned long long)header->hubCount * sizeof(USBHubRecord),
+                             fileSize) ||
+        !SnapshotSectionFits(header->stringsOffset, header->stringTableSize, fileSize)) {
+        return FALSE;
+    }
+    
+    // Every string offset must land inside a NUL-terminated table, and each
+    // hub's records must be contiguous with rising port numbers like a scan
+    // leaves them, since the port tables are sized and indexed by port
+    const char* strings = file + header->stringsOffset;
+    unsigned int tableSize = header->stringTableSize;
+    if (tableSize == 0 || strings[tableSize - 1] != '\0') {
+        return FALSE;
+    }
+    
+    const USBHubRecord* hubs = (const USBHubRecord*)(file + header->hubsOffset);
+    for (int i = 0; i < header->hubCount; i++) {
+        if (hubs[i].pathOffset >= tableSize || hubs[i].descOffset >= tableSize ||
+            hubs[i].driverKeyOffset >= tableSize || hubs[i].locationInfoOffset >= tableSize ||
+            hubs[i].locationPathOffset >= tableSize) {
+            return FALSE;
+        }
+    }
+    
+    const USBDeviceRecord* records = (const USBDeviceRecord*)(file + header->recordsOffset);
+    for (int i = 0; i < header->deviceCount; i++) {
+        if (records[i].hubIndex < 0 || records[i].hubIndex >= header->hubCount ||
+            (i > 0 && records[i].hubIndex < records[i - 1].hubIndex) ||
+            records[i].childHubIndex < -1 || records[i].childHubIndex >= header->hubCount ||
+            records[i].portNumber < 1 || records[i].portNumber > USB_MAX_HUB_PORTS ||
+            (i > 0 && records[i].hubIndex == records[i - 1].hubIndex &&
+             records[i].portNumber <= records[i - 1].portNumber)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Copy a string out of a validated file into a fixed buffer
+static void CopySnapshotString(const char* strings, unsigned int offset,
+                               char* out, int capacity) {
+    snprintf(out, capacity, "%s", strings + offset);
+}
+
+// Publish a validated snapshot file into ctx. Returns the device count or
+// -1 if out of memory.
+static int PublishSnapshotFile(MapperContext* ctx, const char* file) {
+    const USBSnapshotFileHeader* header = (const USBSnapshotFileHeader*)file;
+    const USBHubRecord* hubRecords = (const USBHubRecord*)(file + header->hubsOffset);
+    const char* strings = file + header->stringsOffset;
+    
+    HubEntry* hubs = (HubEntry*)calloc(header->hubCount ? header->hubCount : 1,
+                                       sizeof(HubEntry));
+    if (hubs == NULL) {
+        return -1;
+    }
+    
+    // Loaded hubs have no devnode, so watch mode can't patch them
+    for (int i = 0; i < header->hubCount; i++) {
+        const USBHubRecord* src = &hubRecords[i];
+        CopySnapshotString(strings, src->pathOffset, hubs[i].devicePath, MAX_PATH_LEN);
+        CopySnapshotString(strings, src->descOffset, hubs[i].hubDesc,
+                           sizeof(hubs[i].hubDesc));
+        CopySnapshotString(strings, src->driverKeyOffset, hubs[i].driverKey, MAX_DESC_LEN);
+        CopySnapshotString(strings, src->locationInfoOffset, hubs[i].locationInfo,
+                           sizeof(hubs[i].locationInfo));
+        CopySnapshotString(strings, src->locationPathOffset, hubs[i].locationPath,
+                           MAX_PATH_LEN);
+        hubs[i].scanFlags = src->scanFlags;
+    }
+    
+    // PublishScan() re-interns the strings and rebuilds the tree links
+    return PublishScan(ctx, NULL, hubs, header->hubCount,
+                       (const USBDeviceRecord*)(file + header->recordsOffset),
+                       header->deviceCount, header->droppedCount);
+}
+
+// Load a saved snapshot as ctx's current results - exported to Python.
+// path is UTF-8. The loaded topology replaces ctx's snapshot like a scan
+// would, so every query, the change set and the topology hash work on it.
+// NULL ctx loads into the legacy results. Returns the device count or -1
+// if the file can't be read or isn't a valid snapshot.
+__declspec(dllexport) int LoadSnapshot(MapperContext* ctx, const char* path) {
+    HANDLE hFile = OpenSnapshotFile(path, FALSE);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    const char* file = NULL;
+    
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0) {
+        mapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        file = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    
+    int count = -1;
+    if (file != NULL && ValidateSnapshotFile(file, (unsigned long long)fileSize.QuadPart)) {
+        count = PublishSnapshotFile(ResolveContext(ctx), file);
+    } else if (file != NULL) {
+        SetLastError(ERROR_INVALID_DATA);
+    }
+    
+    if (file != NULL) {
+        UnmapViewOfFile(file);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(hFile);
+    return count;
+}
+
+// Shared-memory publishing. One process scans and writes each new snapshot
+// into a named section as a snapshot file image (see SaveSnapshot()); any
+// number of processes map it read-only and load it without touching a hub.
+// The image is guarded by a seqlock: sequence is odd while the publisher
+// writes, so a reader that sees the same even value before and after its
+// copy knows the copy is whole.
+#define USB_SHARED_MAGIC 0x4D485355       // "USHM"
+#define USB_SHARED_DEFAULT_CAPACITY (1 << 20)
+
+// USBSharedHeader.status
+#define USB_SHARED_OVERFLOW 0x01          // the last snapshot didn't fit
+
+typedef struct {
+    unsigned int magic;           // USB_SHARED_MAGIC
+    unsigned int sectionSize;     // bytes, including this header
+    volatile LONG sequence;       // odd while an image is being written
+    unsigned int imageSize;       // bytes of the image after this header, 0 if none
+    unsigned int status;          // USB_SHARED_*
+    unsigned int publisherPid;
+    unsigned int reserved[2];
+} USBSharedHeader;
+
+static SRWLOCK g_publisherLock = SRWLOCK_INIT;    // guards the g_publisher* fields
+static HANDLE g_publisherMapping = NULL;
+static USBSharedHeader* g_publisherView = NULL;
+static MapperContext* g_publisherContext = NULL;
+
+// Commit hook: copy the new snapshot into the section
+static void PublishSharedSnapshot(MapperContext* ctx, const TopologySnapshot* snap) {
+    USBSharedHeader* shared = g_publisherView;
+    USBSnapshotFileHeader header;
+    
+    FillSnapshotHeader(snap, &header);
+    unsigned int size = SnapshotImageSize(&header);
+    BOOL fits = size <= shared->sectionSize - sizeof(USBSharedHeader);
+    
+    InterlockedIncrement(&shared->sequence);
+    if (fits) {
+        WriteSnapshotImage(snap, &header, (char*)(shared + 1));
+    }
+    shared->imageSize = fits ? size : 0;
+    shared->status = fits ? 0 : USB_SHARED_OVERFLOW;
+    InterlockedIncrement(&shared->sequence);
+}
+
+// Publish ctx's snapshots to a named shared-memory section - exported to
+// Python. name is UTF-8, e.g. "Local\\UsbMapperTopology"; "Global\\" names
+// need SeCreateGlobalPrivilege. capacity is the section size in bytes
+// (<= 0 picks 1 MB). Every snapshot ctx publishes from then on, whatever
+// scan or patch made it, is copied into the section. Only one publisher
+// per process, and only one process per name. NULL ctx publishes the
+// legacy results. The publisher must be stopped before ctx is destroyed.
+// Returns 1 on success, 0 on failure.
+__declspec(dllexport) int StartTopologyPublisher(MapperContext* ctx, const char* name,
+                                                 int capacity) {
+    WCHAR wideName[MAX_PATH_LEN];
+    
+    if (name == NULL || MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, name, -1,
+                                            wideName, MAX_PATH_LEN) == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    if (capacity <= 0) {
+        capacity = USB_SHARED_DEFAULT_CAPACITY;
+    }
+    if ((unsigned int)capacity < sizeof(USBSharedHeader) + sizeof(USBSnapshotFileHeader)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    ctx = ResolveContext(ctx);
+    
+    AcquireSRWLockExclusive(&g_publisherLock);
+    if (g_publisherView != NULL) {
+        ReleaseSRWLockExclusive(&g_publisherLock);
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return 0;
+    }
+    
+    // Joining an existing section would mean two writers on one seqlock
+    HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                        0, (DWORD)capacity, wideName);
+    if (mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        SetLastError(ERROR_ALREADY_EXISTS);
+    }
+    
+    USBSharedHeader* view = (mapping != NULL) ?
+        (USBSharedHeader*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    if (view == NULL) {
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        ReleaseSRWLockExclusive(&g_publisherLock);
+        return 0;
+    }
+    
+    view->sectionSize = (unsigned int)capacity;
+    view->publisherPid = GetCurrentProcessId();
+    g_publisherMapping = mapping;
+    g_publisherView = view;
+    g_publisherContext = ctx;
+    
+    // Attach under writeLock so no commit slips in between, then publish
+    // what ctx already has
+    AcquireSRWLockExclusive(&ctx->writeLock);
+    ctx->onCommit = PublishSharedSnapshot;
+    TopologySnapshot* current = AcquireSnapshot(ctx);
+    if (current != NULL) {
+        PublishSharedSnapshot(ctx, current);
+    }
+    ReleaseSnapshot(current);
+    ReleaseSRWLockExclusive(&ctx->writeLock);
+    
+    // Readers check the magic last, once the header is complete
+    InterlockedExchange((volatile LONG*)&view->magic, USB_SHARED_MAGIC);
+    
+    ReleaseSRWLockExclusive(&g_publisherLock);
+    return 1;
+}
+
+// Stop publishing and close the section - exported to Python.
+// Mapped readers keep the section alive but see no new snapshots.
+__declspec(dllexport) void StopTopologyPublisher() {
+    AcquireSRWLockExclusive(&g_publisherLock);
+    if (g_publisherView != NULL) {
+        MapperContext* ctx = g_publisherContext;
+        
+        AcquireSRWLockExclusive(&ctx->writeLock);
+        ctx->onCommit = NULL;
+        ReleaseSRWLockExclusive(&ctx->writeLock);
+        
+        UnmapViewOfFile(g_publisherView);
+        CloseHandle(g_publisherMapping);
+        g_publisherView = NULL;
+        g_publisherMapping = NULL;
+        g_publisherContext = NULL;
+    }
+    ReleaseSRWLockExclusive(&g_publisherLock);
+}
+
+// A read-only mapping of a publisher's section
+typedef struct {
+    HANDLE mapping;
+    const USBSharedHeader* view;
+    SIZE_T viewSize;
+    LONG loadedSequence;          // of the image last loaded, -1 if none
+    int loadedCount;
+    char* image;                  // copy buffer, reused across loads
+    unsigned int imageCapacity;
+} TopologyReader;
+
+// Read the seqlock counter without writing to the read-only page
+static LONG ReadSharedSequence(const USBSharedHeader* shared) {
+    LONG sequence = *(const volatile LONG*)&shared->sequence;
+    MemoryBarrier();
+    return sequence;
+}
+
+// Close a reader - exported to Python
+__declspec(dllexport) void CloseTopologyReader(TopologyReader* reader) {
+    if (reader == NULL) {
+        return;
+    }
+    
+    if (reader->view != NULL) {
+        UnmapViewOfFile(reader->view);
+    }
+    if (reader->mapping != NULL) {
+        CloseHandle(reader->mapping);
+    }
+    free(reader->image);
+    free(reader);
+}
+
+// Map a publisher's section read-only - exported to Python.
+// name is the one given to StartTopologyPublisher(). The reader never
+// opens a hub. Returns NULL if there is no such publisher.
+__declspec(dllexport) TopologyReader* OpenTopologyReader(const char* name) {
+    WCHAR wideName[MAX_PATH_LEN];
+    
+    if (name == NULL || MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, name, -1,
+                                            wideName, MAX_PATH_LEN) == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    
+    TopologyReader* reader = (TopologyReader*)calloc(1, sizeof(TopologyReader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->loadedSequence = -1;
+    
+    reader->mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, wideName);
+    if (reader->mapping != NULL) {
+        reader->view = (const USBSharedHeader*)MapViewOfFile(reader->mapping, FILE_MAP_READ,
+                                                             0, 0, 0);
+    }
+    
+    MEMORY_BASIC_INFORMATION region;
+    if (reader->view == NULL ||
+        VirtualQuery(reader->view, &region, sizeof(region)) == 0 ||
+        region.RegionSize < sizeof(USBSharedHeader)) {
+        CloseTopologyReader(reader);
+        return NULL;
+    }
+    reader->viewSize = region.RegionSize;
+    
+    // The section may have been created but not yet filled in
+    if (*(const volatile unsigned int*)&reader->view->magic != USB_SHARED_MAGIC) {
+        CloseTopologyReader(reader);
+        SetLastError(ERROR_INVALID_DATA);
+        return NULL;
+    }
+    
+    return reader;
+}
+
+// Current publish count of a reader's section - exported to Python.
+// Changes on every snapshot the publisher writes, so polling it is enough
+// to know when to call RefreshFromTopologyReader().
+__declspec(dllexport) unsigned int GetTopologyReaderSequence(const TopologyReader* reader) {
+    return (reader != NULL) ? (unsigned int)ReadSharedSequence(reader->view) / 2 : 0;
+}
+
+// Copy a consistent image out of the section. Returns its sequence, or -1
+// if there is no image or the publisher kept writing.
+static LONG CopySharedImage(TopologyReader* reader, unsigned int* outSize) {
+    const USBSharedHeader* shared = reader->view;
+    SIZE_T room = reader->viewSize - sizeof(USBSharedHeader);
+    
+    for (int attempt = 0; attempt < 100; attempt++) {
+        LONG before = ReadSharedSequence(shared);
+        if (before & 1) {
+            YieldProcessor();
+            Sleep(0);
+            continue;
+        }
+        
+        unsigned int size = *(const volatile unsigned int*)&shared->imageSize;
+        if (size == 0 || size > room) {
+            SetLastError((shared->status & USB_SHARED_OVERFLOW) ? ERROR_INSUFFICIENT_BUFFER :
+                                                                  ERROR_NO_DATA);
+            return -1;
+        }
+        
+        if (size > reader->imageCapacity) {
+            char* grown = (char*)realloc(reader->image, size);
+            if (grown == NULL) {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return -1;
+            }
+            reader->image = grown;
+            reader->imageCapacity = size;
+        }
+        
+        memcpy(reader->image, shared + 1, size);
+        MemoryBarrier();
+        if (ReadSharedSequence(shared) == before) {
+            *outSize = size;
+            return before;
+        }
+    }
+    
+    SetLastError(ERROR_BUSY);
+    return -1;
+}
+
+// Load the publisher's latest snapshot into ctx - exported to Python.
+// ctx then answers every query as if it had scanned, with no IOCTLs in
+// this process. Does nothing if the publisher hasn't written anything new
+// since the last load. NULL ctx loads into the legacy results. Returns the
+// device count, or -1 if there is no valid image to load.
+__declspec(dllexport) int RefreshFromTopologyReader(TopologyReader* reader, MapperContext* ctx) {
+    if (reader == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return -1;
+    }
+    
+    LONG sequence = ReadSharedSequence(reader->view);
+    if (sequence == reader->loadedSequence) {
+        return reader->loadedCount;
+    }
+    
+    unsigned int size;
+    sequence = CopySharedImage(reader, &size);
+    if (sequence < 0) {
+        return -1;
+    }
+    if (!ValidateSnapshotFile(reader->image, size)) {
+        SetLastError(ERROR_INVALID_DATA);
+        return -1;
+    }
+    
+    int count = PublishSnapshotFile(ResolveContext(ctx), reader->image);
+    if (count >= 0) {
+        reader->loadedSequence = sequence;
+        reader->loadedCount = count;
+    }
+    return count;
+}
+
+// Summary of the legacy results
+static void GetDefaultSummary(TopologySummary* out) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    SnapshotGetSummary(snap, out);
+    ReleaseSnapshot(snap);
+}
+
+// Get device info by index - exported to Python
+__declspec(dllexport) int GetDeviceInfo(int index, USBDeviceInfo* outInfo) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int found = SnapshotGetDeviceInfo(snap, index, outInfo);
+    ReleaseSnapshot(snap);
+    return found;
+}
+
+// Copy every device into out in one call - exported to Python.
+// Writes at most capacity records and returns the total device count, so a
+// return value above capacity means the buffer was too small.
+__declspec(dllexport) int GetAllDeviceInfo(USBDeviceInfo* outInfo, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int count = SnapshotGetAllDeviceInfo(snap, outInfo, capacity);
+    ReleaseSnapshot(snap);
+    return count;
+}
+
+// Copy every compact record into out in one call - exported to Python.
+// Same contract as GetAllDeviceInfo(); resolve string offsets with
+// GetStringTable().
+__declspec(dllexport) int GetDeviceRecords(USBDeviceRecord* outRecords, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int count = SnapshotGetDeviceRecords(snap, outRecords, capacity);
+    ReleaseSnapshot(snap);
+    return count;
+}
+
+// Build one device's description on demand - exported to Python.
+// Returns the full length (excluding NUL) like snprintf, or -1 for a bad
+// index. out may be NULL to query the length.
+__declspec(dllexport) int GetDeviceDescription(int index, char* out, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int length = SnapshotGetDeviceDescription(snap, index, out, capacity);
+    ReleaseSnapshot(snap);
+    return length;
+}
+
+// Get hub count from the last full scan - exported to Python
+__declspec(dllexport) int GetHubCount() {
+    TopologySummary summary;
+    GetDefaultSummary(&summary);
+    return summary.hubCount;
+}
+
+// Copy every hub's shared properties into out - exported to Python.
+// Same contract as GetDeviceRecords().
+__declspec(dllexport) int GetHubRecords(USBHubRecord* outHubs, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int count = SnapshotGetHubRecords(snap, outHubs, capacity);
+    ReleaseSnapshot(snap);
+    return count;
+}
+
+// Find a record by port path - exported to Python.
+// See SnapshotFindRecordByPortPath(). Returns the record index or -1.
+__declspec(dllexport) int FindRecordByPortPath(const char* portPath) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int index = SnapshotFindRecordByPortPath(snap, portPath);
+    ReleaseSnapshot(snap);
+    return index;
+}
+
+// Format a record's port path, the inverse of FindRecordByPortPath() -
+// exported to Python. Returns the length like snprintf, or -1.
+__declspec(dllexport) int GetPortPath(int index, char* out, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int length = SnapshotGetPortPath(snap, index, out, capacity);
+    ReleaseSnapshot(snap);
+    return length;
+}
+
+// Find records by VID/PID - exported to Python.
+// See SnapshotFindRecordsByVidPid(). Returns the total number of matches.
+__declspec(dllexport) int FindRecordsByVidPid(unsigned short vendorId, unsigned short productId,
+                                              int* outIndices, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int count = SnapshotFindRecordsByVidPid(snap, vendorId, productId, outIndices, capacity);
+    ReleaseSnapshot(snap);
+    return count;
+}
+
+// Find a hub by device path or location path - exported to Python.
+// See SnapshotFindHub(). Returns the hubIndex or -1.
+__declspec(dllexport) int FindHub(const char* path) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int hubIndex = SnapshotFindHub(snap, path);
+    ReleaseSnapshot(snap);
+    return hubIndex;
+}
+
+// Find a record by device location path - exported to Python.
+// See SnapshotFindRecordByLocation(). Returns the record index or -1.
+__declspec(dllexport) int FindRecordByLocation(const char* locationPath) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int index = SnapshotFindRecordByLocation(snap, locationPath);
+    ReleaseSnapshot(snap);
+    return index;
+}
+
+// Devices seen by the last scan, including any that could not be
+// stored - exported to Python. Equal to GetDeviceCount() unless truncated.
+__declspec(dllexport) int GetSeenDeviceCount() {
+    TopologySummary summary;
+    GetDefaultSummary(&summary);
+    return summary.seenDeviceCount;
+}
+
+// 1 if the published results are missing devices - exported to Python
+__declspec(dllexport) int IsTopologyTruncated() {
+    TopologySummary summary;
+    GetDefaultSummary(&summary);
+    return (summary.seenDeviceCount > summary.deviceCount) ? 1 : 0;
+}
+
+// Generation of the published results - exported to Python.
+// Changes whenever a new snapshot is published, so readers that fetch
+// records and strings in separate calls can detect a scan in between.
+// Snapshot readers don't need this.
+__declspec(dllexport) int GetTopologyGeneration() {
+    return (int)InterlockedCompareExchange(&g_defaultContext.generation, 0, 0);
+}
+
+// Copy the string table into out - exported to Python.
+// Writes at most capacity bytes and returns the table size in bytes.
+__declspec(dllexport) int GetStringTable(char* out, int capacity) {
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    int size = SnapshotGetStringTable(snap, out, capacity);
+    ReleaseSnapshot(snap);
+    return size;
+}
+
+// Get total device count - exported to Python
+__declspec(dllexport) int GetDeviceCount() {
+    TopologySummary summary;
+    GetDefaultSummary(&summary);
+    return summary.deviceCount;
+}
+
+// One in-flight overlapped IOCTL. The OVERLAPPED must stay first so a
+// completion packet can be cast back to its request.
+typedef struct {
+    OVERLAPPED overlapped;
+    int port;       // 0 for the hub's node information request
+    BOOL done;      // completed, or failed without going pending
+    BOOL succeeded;
+    DWORD error;
+    LONGLONG issued;      // QPC times, only kept while tracing
+    LONGLONG completed;
+} AsyncRequest;
+
+typedef struct {
+    AsyncRequest request;
+    USB_NODE_CONNECTION_INFORMATION_EX connInfo;
+} AsyncPortRequest;
+
+// Per-hub state for the overlapped scan, used as the completion key
+typedef struct {
+    AsyncRequest request;
+    HANDLE hHub;
+    USB_NODE_INFORMATION nodeInfo;
+    int numPorts;
+    AsyncPortRequest* ports;
+    int pending;                  // requests the completion port still owes
+    ULONGLONG expires;            // when pending requests time out, 0 if untimed
+} AsyncHubState;
+
+// Limits of an ENUM_MODE_BOUNDED scan
+typedef struct {
+    DWORD deadlineMs;             // the whole probe, from the first hub open
+    DWORD ioctlTimeoutMs;         // each hub's outstanding IOCTLs
+} ScanLimits;
+
+#define USB_BOUNDED_DEFAULT_DEADLINE_MS 2000
+#define USB_BOUNDED_DEFAULT_IOCTL_MS    500
+
+// How long cancelled IOCTLs get to complete once the deadline has passed.
+// Buffers of any still outstanding after that are abandoned, not freed.
+#define USB_CANCEL_GRACE_MS 100
+
+// Index of hubPath's breaker, or -1. Call with breakerLock held.
+static int FindHubBreaker(const MapperContext* ctx, unsigned long long pathHash,
+                          const char* hubPath) {
+    for (int i = 0; i < ctx->breakerCount; i++) {
+        if (ctx->breakers[i].pathHash == pathHash &&
+            _stricmp(ctx->breakers[i].hubPath, hubPath) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// True if hubPath's breaker is open at now
+static BOOL IsHubBreakerOpen(MapperContext* ctx, const char* hubPath, ULONGLONG now) {
+    AcquireSRWLockShared(&ctx->breakerLock);
+    int index = FindHubBreaker(ctx, HashString64(hubPath), hubPath);
+    BOOL open = (index >= 0 && ctx->breakers[index].openUntil > now);
+    ReleaseSRWLockShared(&ctx->breakerLock);
+    return open;
+}
+
+// Count one bounded scan of a hub. A timeout brings it closer to tripping;
+// any other outcome forgets it. A hub at the threshold trips again on its
+// first timeout after the cool-down.
+static void RecordHubOutcome(MapperContext* ctx, const char* hubPath, BOOL timedOut,
+                             ULONGLONG now) {
+    unsigned long long pathHash = HashString64(hubPath);
+    
+    AcquireSRWLockExclusive(&ctx->breakerLock);
+    int index = FindHubBreaker(ctx, pathHash, hubPath);
+    
+    if (!timedOut || ctx->breakerThreshold <= 0) {
+        if (index >= 0) {
+            free(ctx->breakers[index].hubPath);
+            ctx->breakers[index] = ctx->breakers[--ctx->breakerCount];
+        }
+        ReleaseSRWLockExclusive(&ctx->breakerLock);
+        return;
+    }
+    
+    if (index < 0) {
+        if (ctx->breakerCount >= ctx->breakerCapacity) {
+            int newCapacity = ctx->breakerCapacity ? ctx->breakerCapacity * 2 : 8;
+            HubBreaker* grown = (HubBreaker*)realloc(ctx->breakers,
+                                                     newCapacity * sizeof(HubBreaker));
+            if (grown == NULL) {
+                ReleaseSRWLockExclusive(&ctx->breakerLock);
+                return;
+            }
+            ctx->breakers = grown;
+            ctx->breakerCapacity = newCapacity;
+        }
+        
+        char* path = _strdup(hubPath);
+        if (path == NULL) {
+            ReleaseSRWLockExclusive(&ctx->breakerLock);
+            return;
+        }
+        index = ctx->breakerCount++;
+        ctx->breakers[index].pathHash = pathHash;
+        ctx->breakers[index].hubPath = path;
+        ctx->breakers[index].timeouts = 0;
+        ctx->breakers[index].openUntil = 0;
+    }
+    
+    HubBreaker* breaker = &ctx->breakers[index];
+    breaker->timeouts++;
+    if (breaker->timeouts >= ctx->breakerThreshold) {
+        breaker->openUntil = now + ctx->breakerCooldownMs;
+    }
+    ReleaseSRWLockExclusive(&ctx->breakerLock);
+}
+
+// Cancel the IOCTLs of every hub past its timeout, or of every hub once
+// the deadline has passed. Returns when the next one expires.
+static ULONGLONG CancelExpiredHubs(AsyncHubState* states, HubEntry* hubs, int hubCount,
+                                   ULONGLONG now, ULONGLONG deadline) {
+    ULONGLONG next = deadline;
+    
+    for (int hubIndex = 0; hubIndex < hubCount; hubIndex++) {
+        AsyncHubState* state = &states[hubIndex];
+        if (state->pending == 0 || state->expires == 0) {
+            continue;
+        }
+        
+        if (now >= state->expires || now >= deadline) {
+            g_backend->CancelIo(state->hHub);
+            hubs[hubIndex].scanFlags |= USB_HUB_SCAN_TIMED_OUT | USB_HUB_SCAN_PARTIAL;
+            state->expires = 0;
+        } else if (state->expires < next) {
+            next = state->expires;
+        }
+    }
+    return next;
+}
+
+// Overlapped scan into ctx. Every hub is opened with FILE_FLAG_OVERLAPPED
+// and bound to one I/O completion port. A hub's port IOCTLs are all issued
+// as soon as its node information arrives, so a scan costs about the
+// slowest port rather than the sum of all ports. Results are emitted in
+// serial scan order.
+//
+// With limits, each hub's outstanding IOCTLs are cancelled once they pass
+// ioctlTimeoutMs and every hub's once the deadline passes, and the scan
+// publishes whatever completed. Hubs are flagged in scanFlags, and hubs
+// whose circuit breaker is open are skipped. Without limits the scan
+// waits for every IOCTL.
+static int EnumerateOverlapped(MapperContext* ctx, ScanTrace* trace, const ScanLimits* limits) {
+    HubEntry* hubs;
+    
+    int hubCount = CollectHubs(&hubs);
+    TraceHubsCollected(trace, hubCount);
+    if (hubCount < 0) {
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    if (hubCount == 0) {
+        return PublishScan(ctx, trace, hubs, 0, NULL, 0, 0);
+    }
+    
+    AsyncHubState* states = (AsyncHubState*)calloc(hubCount, sizeof(AsyncHubState));
+    HANDLE iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    int outstanding = 0;
+    
+    if (states == NULL || iocp == NULL) {
+        if (iocp != NULL) {
+            CloseHandle(iocp);
+        }
+        free(states);
+        free(hubs);
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    
+    ULONGLONG deadline = (limits != NULL) ? GetTickCount64() + limits->deadlineMs : 0;
+    ULONGLONG abandonAt = 0;      // set once the deadline has cancelled everything
+    
+    // Open every hub and ask for its node information
+    for (int hubIndex = 0; hubIndex < hubCount; hubIndex++) {
+        AsyncHubState* state = &states[hubIndex];
+        state->hHub = INVALID_HANDLE_VALUE;
+        
+        if (hubs[hubIndex].devicePath[0] == '\0') {
+            continue;
+        }
+        
+        const char* hubPath = hubs[hubIndex].devicePath;
+        if (limits != NULL) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                hubs[hubIndex].scanFlags |= USB_HUB_SCAN_TIMED_OUT | USB_HUB_SCAN_PARTIAL;
+                continue;
+            }
+            if (IsHubBreakerOpen(ctx, hubPath, now)) {
+                hubs[hubIndex].scanFlags |= USB_HUB_SCAN_SKIPPED;
+                continue;
+            }
+        }
+        
+        HubScanStats* hubStats = TraceHub(trace, hubIndex);
+        LONGLONG start = hubStats ? QpcNow() : 0;
+        ETW_HUB_OPEN_START(hubPath);
+        HANDLE hHub = OpenDeviceHandleEx(hubPath, FILE_FLAG_OVERLAPPED);
+        DWORD error = (hHub == INVALID_HANDLE_VALUE) ? GetLastError() : ERROR_SUCCESS;
+        ETW_HUB_OPEN_STOP(hubPath, error);
+        TraceHubOpen(hubStats, start, hHub != INVALID_HANDLE_VALUE, error);
+        if (hHub == INVALID_HANDLE_VALUE) {
+            hubs[hubIndex].scanFlags |= USB_HUB_SCAN_FAILED;
+            continue;
+        }
+        state->hHub = hHub;
+        
+        if (!g_backend->BindCompletionPort(hHub, iocp, (ULONG_PTR)state)) {
+            TraceHubError(hubStats, GetLastError());
+            hubs[hubIndex].scanFlags |= USB_HUB_SCAN_FAILED;
+            continue;
+        }
+        
+        state->request.issued = hubStats ? QpcNow() : 0;
+        ETW_IOCTL_START(IOCTL_USB_GET_NODE_INFORMATION, hubPath, 0);
+        if (IssueIoctlAsync(hHub, IOCTL_USB_GET_NODE_INFORMATION, &state->nodeInfo,
+                            sizeof(USB_NODE_INFORMATION), &state->request.overlapped)) {
+            outstanding++;
+            state->pending = 1;
+            if (limits != NULL) {
+                state->expires = GetTickCount64() + limits->ioctlTimeoutMs;
+            }
+        } else {
+            error = GetLastError();
+            ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_INFORMATION, hubPath, 0, error);
+            TraceHubError(hubStats, error);
+            hubs[hubIndex].scanFlags |= USB_HUB_SCAN_FAILED;
+        }
+    }
+    
+    // Drain completions, fanning out port queries as hubs report in
+    while (outstanding > 0) {
+        DWORD bytesReturned;
+        ULONG_PTR key;
+        LPOVERLAPPED overlapped = NULL;
+        DWORD wait = INFINITE;
+        
+        if (limits != NULL) {
+            ULONGLONG now = GetTickCount64();
+            ULONGLONG next = abandonAt;
+            
+            if (abandonAt == 0) {
+                next = CancelExpiredHubs(states, hubs, hubCount, now, deadline);
+                if (now >= deadline) {
+                    abandonAt = now + USB_CANCEL_GRACE_MS;
+                    next = abandonAt;
+                }
+            } else if (now >= abandonAt) {
+                break;
+            }
+            wait = (next > now) ? (DWORD)(next - now) : 0;
+        }
+        
+        BOOL ok = GetQueuedCompletionStatus(iocp, &bytesReturned, &key,
+                                            &overlapped, wait);
+        if (overlapped == NULL) {
+            if (limits != NULL && GetLastError() == WAIT_TIMEOUT) {
+                continue;
+            }
+            break;
+        }
+        outstanding--;
+        
+        AsyncHubState* state = (AsyncHubState*)key;
+        AsyncRequest* request = (AsyncRequest*)overlapped;
+        request->done = TRUE;
+        request->succeeded = ok;
+        request->error = ok ? ERROR_SUCCESS : GetLastError();
+        if (trace != NULL) {
+            request->completed = QpcNow();
+        }
+        if (--state->pending == 0) {
+            state->expires = 0;
+        }
+        
+        int hubIndex = (int)(state - states);
+        HubEntry* hub = &hubs[hubIndex];
+        ETW_IOCTL_STOP((request->port != 0) ? IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX :
+                                              IOCTL_USB_GET_NODE_INFORMATION,
+                       hub->devicePath, request->port, request->error);
+        if (!ok && request->error != ERROR_OPERATION_ABORTED) {
+            hub->scanFlags |= USB_HUB_SCAN_FAILED;
+        }
+        if (request->port != 0) {
+            if (!ok) {
+                hub->scanFlags |= USB_HUB_SCAN_PARTIAL;
+            }
+            continue;
+        }
+        
+        HubScanStats* hubStats = TraceHub(trace, hubIndex);
+        if (hubStats != NULL) {
+            hubStats->nodeInfoUs = QpcMicros(request->issued, request->completed);
+        }
+        if (!ok) {
+            TraceHubError(hubStats, request->error);
+            continue;
+        }
+        
+        // Past the deadline there is no time left to query the ports
+        if (abandonAt != 0) {
+            hub->scanFlags |= USB_HUB_SCAN_TIMED_OUT | USB_HUB_SCAN_PARTIAL;
+            continue;
+        }
+        
+        state->numPorts = state->nodeInfo.u.HubInformation.HubDescriptor.bNumberOfPorts;
+        state->ports = (AsyncPortRequest*)calloc(state->numPorts, sizeof(AsyncPortRequest));
+        if (state->ports == NULL) {
+            state->numPorts = 0;
+            hub->scanFlags |= USB_HUB_SCAN_PARTIAL;
+            continue;
+        }
+        TracePortsBegin(trace, hubIndex, state->numPorts);
+        
+        for (int port = 1; port <= state->numPorts; port++) {
+            AsyncPortRequest* portRequest = &state->ports[port - 1];
+            portRequest->request.port = port;
+            portRequest->connInfo.ConnectionIndex = port;
+            
+            portRequest->request.issued = hubStats ? QpcNow() : 0;
+            ETW_IOCTL_START(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                            hub->devicePath, port);
+            if (IssueIoctlAsync(state->hHub, IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                                &portRequest->connInfo,
+                                sizeof(USB_NODE_CONNECTION_INFORMATION_EX),
+                                &portRequest->request.overlapped)) {
+                outstanding++;
+                state->pending++;
+            } else {
+                portRequest->request.done = TRUE;
+                portRequest->request.error = GetLastError();
+                portRequest->request.completed = portRequest->request.issued;
+                ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                               hub->devicePath, port, portRequest->request.error);
+                hub->scanFlags |= USB_HUB_SCAN_FAILED | USB_HUB_SCAN_PARTIAL;
+            }
+        }
+        if (limits != NULL && state->pending > 0) {
+            state->expires = GetTickCount64() + limits->ioctlTimeoutMs;
+        }
+    }
+    
+    // The port only fails to return a packet if it is itself broken, or in
+    // a bounded scan if a cancelled IOCTL never came back. Those requests'
+    // buffers are leaked rather than freed under the kernel. An unbounded
+    // scan gives up on the whole topology.
+    BOOL drained = (outstanding == 0);
+    if (!drained && limits == NULL) {
+        for (int hubIndex = 0; hubIndex < hubCount; hubIndex++) {
+            if (states[hubIndex].hHub != INVALID_HANDLE_VALUE) {
+                g_backend->CancelIo(states[hubIndex].hHub);
+                g_backend->CloseDevice(states[hubIndex].hHub);
+            }
+        }
+        CloseHandle(iocp);
+        free(hubs);
+        PublishScan(ctx, trace, NULL, 0, NULL, 0, 0);
+        return -1;
+    }
+    
+    // Emit results in hubIndex/port order
+    DeviceSlab slab = { NULL, 0, 0, TRUE };
+    for (int hubIndex = 0; hubIndex < hubCount; hubIndex++) {
+        AsyncHubState* state = &states[hubIndex];
+        HubEntry* hub = &hubs[hubIndex];
+        HubScanStats* hubStats = TraceHub(trace, hubIndex);
+        LONGLONG lastCompleted = 0;
+        
+        for (int port = 1; port <= state->numPorts; port++) {
+            AsyncPortRequest* portRequest = &state->ports[port - 1];
+            AsyncRequest* request = &portRequest->request;
+            DWORD error = request->succeeded ? ERROR_SUCCESS : request->error;
+            
+            if (!request->done) {
+                continue;
+            }
+            
+            if (request->succeeded &&
+                portRequest->connInfo.ConnectionStatus == DeviceConnected) {
+                USBDeviceRecord* dev = SlabAppend(&slab);
+                if (dev != NULL) {
+                    FillDeviceRecord(dev, hubIndex, port, &portRequest->connInfo);
+                    
+                    // A bounded scan doesn't go back to a hub that already
+                    // timed out, and never waits past the deadline. The
+                    // SuperSpeedPlus check is skipped then too.
+                    DWORD timeout = INFINITE;
+                    if (limits != NULL) {
+                        ULONGLONG now = GetTickCount64();
+                        ULONGLONG left = (now < deadline) ? deadline - now : 0;
+                        timeout = (hub->scanFlags & USB_HUB_SCAN_TIMED_OUT) ? 0 :
+                                  (left < limits->ioctlTimeoutMs) ? (DWORD)left :
+                                  limits->ioctlTimeoutMs;
+                    }
+                    
+                    if (timeout != 0) {
+                        DetectSuperSpeedPlus(state->hHub, TRUE, timeout, port, dev);
+                    }
+                    if (portRequest->connInfo.DeviceIsHub && timeout == 0) {
+                        hub->scanFlags |= USB_HUB_SCAN_PARTIAL;
+                    } else if (portRequest->connInfo.DeviceIsHub) {
+                        ETW_IOCTL_START(IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME,
+                                        hub->devicePath, port);
+                        dev->childHubIndex = ResolveChildHub(state->hHub, TRUE, timeout, port,
+                                                             hubs, hubCount, &error);
+                        ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME,
+                                       hub->devicePath, port, error);
+                        if (error == ERROR_OPERATION_ABORTED) {
+                            hub->scanFlags |= USB_HUB_SCAN_TIMED_OUT | USB_HUB_SCAN_PARTIAL;
+                        }
+                    }
+                }
+            }
+            
+            // Ports overlap, so the hub's port time runs from the first
+            // issue to the last completion
+            if (hubStats != NULL) {
+                TracePortSpan(trace, hubIndex, port, request->issued, request->completed, error);
+                if (request->completed > lastCompleted) {
+                    lastCompleted = request->completed;
+                }
+            }
+        }
+        if (hubStats != NULL && state->numPorts > 0) {
+            hubStats->portsUs = QpcMicros(state->ports[0].request.issued, lastCompleted);
+        }
+        
+        if (state->hHub != INVALID_HANDLE_VALUE) {
+            if (state->pending > 0) {
+                g_backend->CancelIo(state->hHub);
+            }
+            g_backend->CloseDevice(state->hHub);
+        }
+        if (state->pending == 0) {
+            free(state->ports);
+        }
+        
+        if (limits != NULL && state->hHub != INVALID_HANDLE_VALUE) {
+            RecordHubOutcome(ctx, hub->devicePath,
+                             (hub->scanFlags & USB_HUB_SCAN_TIMED_OUT) != 0, GetTickCount64());
+        }
+    }
+    
+    CloseHandle(iocp);
+    if (drained) {
+        free(states);
+    }
+    
+    int count = PublishScan(ctx, trace, hubs, hubCount, slab.devices, slab.count, slab.dropped);
+    free(slab.devices);
+    
+    return count;
+}
+
+// Run one full scan of the given mode into ctx, collecting stats if they
+// are enabled. limits is used by ENUM_MODE_BOUNDED, NULL for the defaults.
+// Returns the device count or -1 on failure.
+static int RunScan(MapperContext* ctx, int mode, int workerCount, const ScanLimits* limits) {
+    static const ScanLimits defaultLimits = {
+        USB_BOUNDED_DEFAULT_DEADLINE_MS, USB_BOUNDED_DEFAULT_IOCTL_MS
+    };
+    ScanTrace* trace = BeginScanTrace(mode);
+    int count;
+    
+    ETW_SCAN_START(mode);
+    
+    switch (mode) {
+        case ENUM_MODE_SERIAL:     count = EnumerateSerial(ctx, trace, NULL, NULL); break;
+        case ENUM_MODE_PARALLEL:   count = EnumerateParallel(ctx, trace, workerCount); break;
+        case ENUM_MODE_OVERLAPPED: count = EnumerateOverlapped(ctx, trace, NULL); break;
+        case ENUM_MODE_BOUNDED:
+            count = EnumerateOverlapped(ctx, trace, limits ? limits : &defaultLimits);
+            break;
+        default:
+            count = -1;
+            SetLastError(ERROR_INVALID_PARAMETER);
+            break;
+    }
+    ETW_SCAN_STOP(mode, count, (count < 0) ? GetLastError() : ERROR_SUCCESS);
+    
+    FinishScanTrace(ctx, trace, count);
+    return count;
+}
+
+// Main enumeration function - exported to Python
+__declspec(dllexport) int EnumerateUSBDevices() {
+    return RunScan(&g_defaultContext, ENUM_MODE_SERIAL, 0, NULL);
+}
+
+// Streaming enumeration into a context - exported to Python.
+// Scans like EnumerateUSBDevices() but hands each connected port to
+// callback as soon as it is queried, with the hub's path and description.
+// The record's string offsets and tree links aren't set yet, and it is only
+// valid during the call. If callback returns 0 the scan stops and the
+// context keeps its previous results; otherwise the full scan is published
+// as usual. NULL ctx scans into the legacy results. Returns the number of
+// devices reported, or -1 on failure.
+__declspec(dllexport) int EnumerateUSBDevicesStreaming(MapperContext* ctx,
+                                                       USBDeviceCallback callback,
+                                                       void* userData) {
+    ctx = ResolveContext(ctx);
+    ScanTrace* trace = BeginScanTrace(ENUM_MODE_SERIAL);
+    
+    ETW_SCAN_START(ENUM_MODE_SERIAL);
+    int count = EnumerateSerial(ctx, trace, callback, userData);
+    ETW_SCAN_STOP(ENUM_MODE_SERIAL, count, (count < 0) ? GetLastError() : ERROR_SUCCESS);
+    
+    FinishScanTrace(ctx, trace, count);
+    return count;
+}
+
+// Parallel enumeration - exported to Python.
+// Hubs are probed on workerCount threads (<= 0 picks the CPU count), then
+// merged in hubIndex order so results match EnumerateUSBDevices().
+__declspec(dllexport) int EnumerateUSBDevicesParallel(int workerCount) {
+    return RunScan(&g_defaultContext, ENUM_MODE_PARALLEL, workerCount, NULL);
+}
+
+// Overlapped enumeration - exported to Python.
+// Every port query is in flight at once through an I/O completion port,
+// so a scan costs about the slowest port rather than the sum of all
+// ports. Results are emitted in EnumerateUSBDevices() order.
+__declspec(dllexport) int EnumerateUSBDevicesAsync() {
+    return RunScan(&g_defaultContext, ENUM_MODE_OVERLAPPED, 0, NULL);
+}
+
+// InitializeMapper() flags
+#define USB_INIT_ASYNC 0x01           // warm up on a background thread and return at once
+
+// Read the hub list ahead of the first scan - exported to Python
+__declspec(dllexport) int InitializeMapper(int flags) {
+    if (InterlockedCompareExchange(&g_mapperInitialized, 1, 0) != 0) {
+        return (g_hubCacheNotify != NULL) ? 1 : 0;
+    }
+    
+    // Registered before the first query, so no change can slip in between
+    CM_NOTIFY_FILTER filter;
+    ZeroMemory(&filter, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_USB_HUB;
+    
+    HCMNOTIFICATION notify;
+    if (CM_Register_Notification(&filter, NULL, HubCacheNotifyProc, &notify) == CR_SUCCESS) {
+        AcquireSRWLockExclusive(&g_hubCacheLock);
+        g_hubCacheNotify = notify;
+        ReleaseSRWLockExclusive(&g_hubCacheLock);
+    }
+    
+    if (flags & USB_INIT_ASYNC) {
+        g_warmupThread = CreateThread(NULL, 0, WarmupThreadProc, NULL, 0, NULL);
+    }
+    if (g_warmupThread == NULL) {
+        WarmupThreadProc(NULL);
+    }
+    
+    AcquireSRWLockShared(&g_hubCacheLock);
+    BOOL warmed = (g_hubCacheCount >= 0) || (g_warmupThread != NULL);
+    ReleaseSRWLockShared(&g_hubCacheLock);
+    
+    // 1 while hub notifications keep the list current, 0 if it serves one scan
+    if (!warmed) {
+        return -1;
+    }
+    return (g_hubCacheNotify != NULL) ? 1 : 0;
+}
+
+// Undo InitializeMapper() - exported to Python. Stops the notification
+// and drops the cached hub list, so every scan queries SetupAPI again.
+// No scan may be running.
+__declspec(dllexport) void ShutdownMapper() {
+    if (g_warmupThread != NULL) {
+        WaitForSingleObject(g_warmupThread, INFINITE);
+        CloseHandle(g_warmupThread);
+        g_warmupThread = NULL;
+    }
+    
+    // Unregistering waits for in-flight callbacks
+    if (g_hubCacheNotify != NULL) {
+        CM_Unregister_Notification(g_hubCacheNotify);
+    }
+    
+    AcquireSRWLockExclusive(&g_hubCacheLock);
+    g_hubCacheNotify = NULL;
+    g_hubCacheEpoch++;
+    DropHubCache();
+    ReleaseSRWLockExclusive(&g_hubCacheLock);
+    InterlockedExchange(&g_mapperInitialized, 0);
+}
+
+// Create a result context - exported to Python.
+// A context owns its own published snapshot, so callers scanning into
+// separate contexts never see each other's results. Returns NULL if out of
+// memory.
+__declspec(dllexport) MapperContext* CreateMapperContext() {
+    MapperContext* ctx = (MapperContext*)calloc(1, sizeof(MapperContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    
+    InitializeSRWLock(&ctx->swapLock);
+    InitializeSRWLock(&ctx->writeLock);
+    InitializeSRWLock(&ctx->statsLock);
+    InitializeSRWLock(&ctx->extLock);
+    InitializeSRWLock(&ctx->breakerLock);
+    ctx->breakerThreshold = USB_BREAKER_DEFAULT_THRESHOLD;
+    ctx->breakerCooldownMs = USB_BREAKER_DEFAULT_COOLDOWN_MS;
+    return ctx;
+}
+
+// Destroy a result context - exported to Python.
+// Snapshots acquired from it stay valid until released. No scan, rescan or
+// session may still be using the context.
+__declspec(dllexport) void DestroyMapperContext(MapperContext* ctx) {
+    if (ctx == NULL || ctx == &g_defaultContext) {
+        return;
+    }
+    
+    ReleaseSnapshot(ctx->current);
+    ReleaseSnapshot(ctx->spare);
+    FreeScanStatsReport(ctx->stats);
+    while (ctx->extCount > 0) {
+        RemoveExtendedEntry(ctx, ctx->extCount - 1);
+    }
+    free(ctx->extCache);
+    for (int i = 0; i < ctx->breakerCount; i++) {
+        free(ctx->breakers[i].hubPath);
+    }
+    free(ctx->breakers);
+    free(ctx);
+}
+
+// Enumerate into a context - exported to Python.
+// mode is ENUM_MODE_SERIAL, ENUM_MODE_PARALLEL, ENUM_MODE_OVERLAPPED or
+// ENUM_MODE_BOUNDED (with the default limits); workerCount is used by
+// ENUM_MODE_PARALLEL like EnumerateUSBDevicesParallel(). NULL ctx scans
+// into the legacy results. Returns the device count or -1 on failure.
+__declspec(dllexport) int EnumerateUSBDevicesInContext(MapperContext* ctx, int mode,
+                                                       int workerCount) {
+    return RunScan(ResolveContext(ctx), mode, workerCount, NULL);
+}
+
+// Overlapped enumeration that returns within a deadline - exported to
+// Python. A hub whose IOCTLs are still outstanding ioctlTimeoutMs after
+// they were issued has them cancelled with CancelIoEx, and every hub's are
+// cancelled once deadlineMs has passed since the scan started. Whatever
+// completed is published; affected hubs carry USB_HUB_SCAN_* flags in
+// their USBHubRecord. Hubs that time out repeatedly are skipped for a
+// while, see SetHubCircuitBreaker(). Values <= 0 take the defaults (2000 ms
+// and 500 ms). NULL ctx scans into the legacy results. Returns the device
+// count or -1 on failure.
+__declspec(dllexport) int EnumerateUSBDevicesBounded(MapperContext* ctx, int deadlineMs,
+                                                     int ioctlTimeoutMs) {
+    ScanLimits limits;
+    limits.deadlineMs = (deadlineMs > 0) ? (DWORD)deadlineMs : USB_BOUNDED_DEFAULT_DEADLINE_MS;
+    limits.ioctlTimeoutMs = (ioctlTimeoutMs > 0) ? (DWORD)ioctlTimeoutMs :
+                                                   USB_BOUNDED_DEFAULT_IOCTL_MS;
+    return RunScan(ResolveContext(ctx), ENUM_MODE_BOUNDED, 0, &limits);
+}
+
+// Configure a context's circuit breaker for bounded scans - exported to
+// Python. A hub that times out in threshold bounded scans in a row is
+// skipped, flagged USB_HUB_SCAN_SKIPPED, for cooldownMs; the next scan
+// after that probes it again, and one more timeout trips it again.
+// threshold 0 turns the breaker off. Every hub's count is reset. NULL ctx
+// configures the legacy results. Returns 0.
+__declspec(dllexport) int SetHubCircuitBreaker(MapperContext* ctx, int threshold,
+                                               int cooldownMs) {
+    ctx = ResolveContext(ctx);
+    
+    AcquireSRWLockExclusive(&ctx->breakerLock);
+    ctx->breakerThreshold = (threshold > 0) ? threshold : 0;
+    ctx->breakerCooldownMs = (cooldownMs > 0) ? (DWORD)cooldownMs : 0;
+    for (int i = 0; i < ctx->breakerCount; i++) {
+        free(ctx->breakers[i].hubPath);
+    }
+    ctx->breakerCount = 0;
+    ReleaseSRWLockExclusive(&ctx->breakerLock);
+    return 0;
+}
+
+// Report which build variant this is - exported to Python. Returns the
+// USB_FEATURE_* bits, which gen_layouts.py also writes into the Python
+// structures it generates, so a DLL and layouts from different builds are
+// caught at load time.
+__declspec(dllexport) int GetMapperFeatures() {
+    return USB_MAPPER_FEATURES;
+}
+
+// Turn scan stats on or off for every context - exported to Python.
+// Off by default except in the instrumented build; when off the scan
+// takes no timestamps at all. Returns the previous setting, or -1 if the
+// DLL was built without stats.
+__declspec(dllexport) int SetScanStatsEnabled(int enabled) {
+    if (!USB_MAPPER_STATS) {
+        return -1;
+    }
+    return (int)InterlockedExchange(&g_scanStatsEnabled, enabled ? 1 : 0);
+}
+
+// Copy the stats of a context's last full scan - exported to Python.
+// NULL ctx reads the legacy results. Returns 1, or 0 if no scan has run
+// with stats enabled.
+__declspec(dllexport) int GetScanStats(MapperContext* ctx, ScanStats* out) {
+    ctx = ResolveContext(ctx);
+    int found = 0;
+    
+    AcquireSRWLockShared(&ctx->statsLock);
+    if (ctx->stats != NULL && out != NULL) {
+        *out = ctx->stats->summary;
+        found = 1;
+    }
+    ReleaseSRWLockShared(&ctx->statsLock);
+    
+    return found;
+}
+
+// Copy per-hub stats of a context's last full scan - exported to Python.
+// Writes at most capacity entries and returns the hub count.
+__declspec(dllexport) int GetHubScanStats(MapperContext* ctx, HubScanStats* out, int capacity) {
+    ctx = ResolveContext(ctx);
+    int count = 0;
+    
+    AcquireSRWLockShared(&ctx->statsLock);
+    if (ctx->stats != NULL && ctx->stats->hubs != NULL) {
+        count = ctx->stats->summary.hubCount;
+        int copied = (capacity < count) ? capacity : count;
+        if (out != NULL && copied > 0) {
+            memcpy(out, ctx->stats->hubs, copied * sizeof(HubScanStats));
+        }
+    }
+    ReleaseSRWLockShared(&ctx->statsLock);
+    
+    return count;
+}
+
+// Copy per-port stats of a context's last full scan - exported to Python.
+// Ports are grouped by hub; see HubScanStats.firstPortStat. Same contract
+// as GetHubScanStats().
+__declspec(dllexport) int GetPortScanStats(MapperContext* ctx, PortScanStats* out, int capacity) {
+    ctx = ResolveContext(ctx);
+    int count = 0;
+    
+    AcquireSRWLockShared(&ctx->statsLock);
+    if (ctx->stats != NULL) {
+        count = ctx->stats->portCount;
+        int copied = (capacity < count) ? capacity : count;
+        if (out != NULL && copied > 0) {
+            memcpy(out, ctx->stats->ports, copied * sizeof(PortScanStats));
+        }
+    }
+    ReleaseSRWLockShared(&ctx->statsLock);
+    
+    return count;
+}
+
+#if USB_MAPPER_EXTENDED
+
+#ifndef USB_REQUEST_GET_DESCRIPTOR
+#define USB_REQUEST_GET_DESCRIPTOR 0x06
+#endif
+
+// Read a descriptor from the device on a hub port into out. Returns the
+// number of bytes the hub returned, or -1 on failure.
+static int GetNodeDescriptor(HANDLE hHub, int port, UCHAR type, UCHAR index, USHORT langId,
+                             void* out, int capacity) {
+    DWORD size = sizeof(USB_DESCRIPTOR_REQUEST) + capacity;
+    PUSB_DESCRIPTOR_REQUEST request = (PUSB_DESCRIPTOR_REQUEST)calloc(1, size);
+    if (request == NULL) {
+        return -1;
+    }
+    
+    request->ConnectionIndex = port;
+    request->SetupPacket.bmRequest = 0x80;    // device to host, standard, device
+    request->SetupPacket.bRequest = USB_REQUEST_GET_DESCRIPTOR;
+    request->SetupPacket.wValue = (USHORT)((type << 8) | index);
+    request->SetupPacket.wIndex = langId;
+    request->SetupPacket.wLength = (USHORT)capacity;
+    
+    DWORD bytesReturned = 0;
+    int length = -1;
+    if (g_backend->IoControl(hHub, IOCTL_USB_GET_DESCRIPTOR_FROM_NODE_CONNECTION, request,
+                             size, &bytesReturned, NULL) &&
+        bytesReturned >= sizeof(USB_DESCRIPTOR_REQUEST)) {
+        length = (int)(bytesReturned - sizeof(USB_DESCRIPTOR_REQUEST));
+        memcpy(out, request->Data, length);
+    }
+    
+    free(request);
+    return length;
+}
+
+// Read the serial number string into out as UTF-8, using the device's
+// first language. A device without one gets an empty string.
+static BOOL ReadSerialNumber(HANDLE hHub, int port, UCHAR serialIndex, char* out, int capacity) {
+    USB_STRING_DESCRIPTOR* desc;
+    UCHAR buffer[256];
+    
+    out[0] = '\0';
+    if (serialIndex == 0) {
+        return TRUE;
+    }
+    
+    USHORT langId = 0x0409;
+    int length = GetNodeDescriptor(hHub, port, USB_STRING_DESCRIPTOR_TYPE, 0, 0,
+                                   buffer, sizeof(buffer));
+    desc = (USB_STRING_DESCRIPTOR*)buffer;
+    if (length >= 4 && desc->bLength >= 4) {
+        langId = desc->bString[0];
+    }
+    
+    length = GetNodeDescriptor(hHub, port, USB_STRING_DESCRIPTOR_TYPE, serialIndex, langId,
+                               buffer, sizeof(buffer));
+    if (length < 2 || desc->bLength < 2 || desc->bDescriptorType != USB_STRING_DESCRIPTOR_TYPE) {
+        return FALSE;
+    }
+    
+    int chars = ((desc->bLength < length ? desc->bLength : length) - 2) / (int)sizeof(WCHAR);
+    WideToUtf8(desc->bString, chars, out, capacity);
+    return TRUE;
+}
+
+// Read a port's connector flags and companion into the USB_EXT_PORT_CONNECTOR
+// fields of info, leaving companionHubIndex alone
+static BOOL QueryPortConnector(HANDLE hHub, int port, USBExtendedInfo* info) {
+    struct {
+        USB_PORT_CONNECTOR_PROPERTIES header;
+        WCHAR name[MAX_PATH_LEN];
+    } connector;
+    ZeroMemory(&connector, sizeof(connector));
+    connector.header.ConnectionIndex = port;
+    
+    if (!DeviceIoControlSync(hHub, FALSE, IOCTL_USB_GET_PORT_CONNECTOR_PROPERTIES,
+                             &connector, sizeof(connector), INFINITE)) {
+        return FALSE;
+    }
+    
+    info->portFlags = connector.header.UsbPortProperties.ul &
+                      (USB_EXT_PORT_USER_CONNECTABLE | USB_EXT_PORT_DEBUG_CAPABLE |
+                       USB_EXT_PORT_MULTIPLE_COMPANIONS | USB_EXT_PORT_TYPE_C);
+    info->companionIndex = connector.header.CompanionIndex;
+    info->companionPort = connector.header.CompanionPortNumber;
+    info->companionHubPath[0] = '\0';
+    
+    // The link name lacks the \\?\ prefix SetupAPI device paths have
+    char linkName[MAX_PATH_LEN];
+    if (info->companionPort != 0 &&
+        WideToUtf8(connector.header.CompanionHubSymbolicLinkName, -1, linkName,
+                   sizeof(linkName)) > 0) {
+        snprintf(info->companionHubPath, sizeof(info->companionHubPath), "%s%s",
+                 (strncmp(linkName, "\\\\", 2) == 0) ? "" : "\\\\?\\", linkName);
+    }
+    return TRUE;
+}
+
+// Read the requested extended fields of the device at rec's port into
+// entry. The port is re-queried first, so nothing is read from a device
+// other than the one rec describes. Returns the fields that were read.
+static unsigned int FetchExtendedInfo(const char* hubPath, const USBDeviceRecord* rec,
+                                      unsigned int mask, ExtendedEntry* entry) {
+    HANDLE hHub = OpenDeviceHandle(hubPath);
+    if (hHub == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    
+    int port = rec->portNumber;
+    unsigned int fetched = 0;
+    USB_NODE_CONNECTION_INFORMATION_EX connInfo;
+    ZeroMemory(&connInfo, sizeof(connInfo));
+    
+    if (!GetPortConnectorProperties(hHub, port, &connInfo) ||
+        connInfo.ConnectionStatus != DeviceConnected ||
+        connInfo.DeviceDescriptor.idVendor != rec->vendorId ||
+        connInfo.DeviceDescriptor.idProduct != rec->productId ||
+        connInfo.DeviceAddress != rec->deviceAddress) {
+        g_backend->CloseDevice(hHub);
+        return 0;
+    }
+    
+    if ((mask & USB_EXT_SERIAL_NUMBER) &&
+        ReadSerialNumber(hHub, port, connInfo.DeviceDescriptor.iSerialNumber,
+                         entry->info.serialNumber, sizeof(entry->info.serialNumber))) {
+        fetched |= USB_EXT_SERIAL_NUMBER;
+    }
+    
+    if (mask & USB_EXT_CONFIG_DESC) {
+        USB_CONFIGURATION_DESCRIPTOR header;
+        if (GetNodeDescriptor(hHub, port, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0,
+                              &header, sizeof(header)) >= (int)sizeof(header) &&
+            header.wTotalLength >= sizeof(header)) {
+            unsigned char* desc = (unsigned char*)malloc(header.wTotalLength);
+            int length = (desc != NULL) ?
+                GetNodeDescriptor(hHub, port, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0,
+                                  desc, header.wTotalLength) : -1;
+            if (length > 0) {
+                entry->configDesc = desc;
+                entry->info.configDescLength = length;
+                fetched |= USB_EXT_CONFIG_DESC;
+            } else {
+                free(desc);
+            }
+        }
+    }
+    
+    USB_NODE_CONNECTION_INFORMATION_EX_V2 v2;
+    if ((mask & USB_EXT_SPEED_V2) && QueryConnectionV2(hHub, FALSE, INFINITE, port, &v2)) {
+        entry->info.supportedProtocols = v2.SupportedUsbProtocols.ul;
+        entry->info.speedFlags = v2.Flags.ul;
+        fetched |= USB_EXT_SPEED_V2;
+    }
+    
+    if ((mask & USB_EXT_PORT_CONNECTOR) && QueryPortConnector(hHub, port, &entry->info)) {
+        fetched |= USB_EXT_PORT_CONNECTOR;
+    }
+    
+    g_backend->CloseDevice(hHub);
+    return fetched;
+}
+
+// Merge fetched fields from src into dst, taking over its buffers
+static void MergeExtendedEntry(ExtendedEntry* dst, ExtendedEntry* src, unsigned int fields) {
+    if (fields & USB_EXT_SERIAL_NUMBER) {
+        memcpy(dst->info.serialNumber, src->info.serialNumber, sizeof(dst->info.serialNumber));
+    }
+    if (fields & USB_EXT_CONFIG_DESC) {
+        free(dst->configDesc);
+        dst->configDesc = src->configDesc;
+        dst->info.configDescLength = src->info.configDescLength;
+        src->configDesc = NULL;
+    }
+    if (fields & USB_EXT_SPEED_V2) {
+        dst->info.supportedProtocols = src->info.supportedProtocols;
+        dst->info.speedFlags = src->info.speedFlags;
+    }
+    if (fields & USB_EXT_PORT_CONNECTOR) {
+        dst->info.portFlags = src->info.portFlags;
+        dst->info.companionIndex = src->info.companionIndex;
+        dst->info.companionPort = src->info.companionPort;
+        memcpy(dst->info.companionHubPath, src->info.companionHubPath,
+               sizeof(dst->info.companionHubPath));
+    }
+    dst->info.fields |= fields;
+}
+
+// Copy the fields of an entry asked for by mask to the caller
+static void CopyExtendedOut(const ExtendedEntry* entry, unsigned int mask, USBExtendedInfo* out,
+                            unsigned char* configOut, int configCapacity, int* configLength) {
+    if (out != NULL) {
+        *out = entry->info;
+        out->fields &= mask;
+    }
+    if ((entry->info.fields & mask & USB_EXT_CONFIG_DESC) && entry->configDesc != NULL) {
+        int length = entry->info.configDescLength;
+        if (configOut != NULL && configCapacity > 0) {
+            memcpy(configOut, entry->configDesc,
+                   (length < configCapacity) ? length : configCapacity);
+        }
+        *configLength = length;
+    }
+}
+
+// Serve the fields in mask for record index of snap, a snapshot of ctx the
+// caller holds, from the cache, fetching only what's missing. Fetched data
+// is cached unless a publish made the cache stale meanwhile. Returns the
+// fields available (or -1 for a bad index); *configLength gets the
+// configuration descriptor size if it was asked for and read.
+static int LookupExtendedInfo(MapperContext* ctx, const TopologySnapshot* snap, int index,
+                              unsigned int mask, USBExtendedInfo* out,
+                              unsigned char* configOut, int configCapacity,
+                              int* configLength) {
+    *configLength = -1;
+    if (snap == NULL || index < 0 || index >= snap->deviceCount) {
+        return -1;
+    }
+    
+    const USBDeviceRecord* rec = &snap->records[index];
+    const char* hubPath = snap->hubs[rec->hubIndex].devicePath;
+    unsigned long long pathHash = HashString64(hubPath);
+    ExtendedEntry result;
+    ZeroMemory(&result, sizeof(result));
+    mask &= USB_EXT_ALL;
+    
+    // Serve what the cache has, dropping entries left by an earlier device
+    AcquireSRWLockExclusive(&ctx->extLock);
+    int slot = FindExtendedEntry(ctx, pathHash, hubPath, rec->portNumber);
+    if (slot >= 0) {
+        const ExtendedEntry* entry = &ctx->extCache[slot];
+        if (entry->vendorId == rec->vendorId && entry->productId == rec->productId &&
+            entry->deviceAddress == rec->deviceAddress) {
+            CopyExtendedOut(entry, mask, &result.info, configOut, configCapacity, configLength);
+        } else {
+            RemoveExtendedEntry(ctx, slot);
+        }
+    }
+    LONG epoch = ctx->extEpoch;
+    ReleaseSRWLockExclusive(&ctx->extLock);
+    
+    unsigned int missing = mask & ~result.info.fields;
+    if (missing != 0) {
+        ExtendedEntry fetched;
+        ZeroMemory(&fetched, sizeof(fetched));
+        unsigned int got = FetchExtendedInfo(hubPath, rec, missing, &fetched);
+        
+        MergeExtendedEntry(&result, &fetched, got);
+        CopyExtendedOut(&result, got & USB_EXT_CONFIG_DESC, NULL, configOut, configCapacity,
+                        configLength);
+        
+        AcquireSRWLockExclusive(&ctx->extLock);
+        if (got != 0 && ctx->extEpoch == epoch) {
+            slot = FindExtendedEntry(ctx, pathHash, hubPath, rec->portNumber);
+            if (slot < 0 && ctx->extCount >= ctx->extCapacity) {
+                int newCapacity = ctx->extCapacity ? ctx->extCapacity * 2 : 32;
+                ExtendedEntry* grown = (ExtendedEntry*)realloc(ctx->extCache,
+                                                newCapacity * sizeof(ExtendedEntry));
+                if (grown != NULL) {
+                    ctx->extCache = grown;
+                    ctx->extCapacity = newCapacity;
+                }
+            }
+            
+            char* pathCopy = (slot < 0) ? _strdup(hubPath) : NULL;
+            if (slot < 0 && pathCopy != NULL && ctx->extCount < ctx->extCapacity) {
+                slot = ctx->extCount++;
+                ExtendedEntry* entry = &ctx->extCache[slot];
+                ZeroMemory(entry, sizeof(ExtendedEntry));
+                entry->pathHash = pathHash;
+                entry->hubPath = pathCopy;
+                entry->port = rec->portNumber;
+                entry->vendorId = rec->vendorId;
+                entry->productId = rec->productId;
+                entry->deviceAddress = rec->deviceAddress;
+            } else if (slot < 0) {
+                free(pathCopy);
+            }
+            
+            // The cache takes over the configuration descriptor buffer
+            const ExtendedEntry* entry = (slot >= 0) ? &ctx->extCache[slot] : NULL;
+            if (entry != NULL && entry->vendorId == rec->vendorId &&
+                entry->productId == rec->productId &&
+                entry->deviceAddress == rec->deviceAddress) {
+                MergeExtendedEntry(&ctx->extCache[slot], &result, got);
+            }
+        }
+        ReleaseSRWLockExclusive(&ctx->extLock);
+        free(result.configDesc);
+    }
+    
+    // Hub indexes change between scans, so the companion's is looked up
+    // in this snapshot rather than cached
+    result.info.companionHubIndex = (result.info.fields & USB_EXT_PORT_CONNECTOR) ?
+                                    SnapshotFindHub(snap, result.info.companionHubPath) : -1;
+    
+    if (out != NULL) {
+        *out = result.info;
+        out->fields &= mask;
+    }
+    return (int)(result.info.fields & mask);
+}
+
+// Read extended data of one device on demand - exported to Python.
+// fieldMask picks USB_EXT_* fields; each costs extra IOCTLs the first
+// time and is then cached per device until its port is seen removed or
+// changed by a later scan. index is a record of ctx's current snapshot;
+// NULL ctx reads the legacy results. Returns 1 if every requested field
+// was read, 0 if some were not, -1 for a bad index.
+__declspec(dllexport) int GetDeviceExtendedInfo(MapperContext* ctx, int index,
+                                                unsigned int fieldMask, USBExtendedInfo* out) {
+    ctx = ResolveContext(ctx);
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    int configLength;
+    int fields = LookupExtendedInfo(ctx, snap, index, fieldMask, out, NULL, 0, &configLength);
+    ReleaseSnapshot(snap);
+    if (fields < 0) {
+        return -1;
+    }
+    return ((unsigned int)fields == (fieldMask & USB_EXT_ALL)) ? 1 : 0;
+}
+
+// Copy one device's configuration descriptor - exported to Python.
+// Fetched and cached like GetDeviceExtendedInfo(USB_EXT_CONFIG_DESC).
+// Writes at most capacity bytes and returns the full length, or -1 if it
+// couldn't be read.
+__declspec(dllexport) int GetDeviceConfigDescriptor(MapperContext* ctx, int index,
+                                                    unsigned char* out, int capacity) {
+    ctx = ResolveContext(ctx);
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    int configLength;
+    LookupExtendedInfo(ctx, snap, index, USB_EXT_CONFIG_DESC, NULL, out, capacity,
+                       &configLength);
+    ReleaseSnapshot(snap);
+    return configLength;
+}
+
+#endif
+
+// Load of one root hub, from GetControllerLoad(). Bandwidth is what the
+// active configurations of the devices below it reserve.
+typedef struct {
+    int hubIndex;                 // the root hub
+    int rootOrdinal;
+    int controllerOrdinal;        // shared by the root hubs of one host controller
+    char controllerDesc[MAX_DESC_LEN];   // UTF-8, empty if the controller wasn't found
+    char controllerPath[MAX_PATH_LEN];
+    int deviceCount;              // devices anywhere below the root hub, hubs included
+    int unreadCount;              // devices whose configuration descriptor couldn't be read
+    int freePortCount;            // user-connectable ports with nothing attached
+    int bulkEndpoints;
+    unsigned long long linkKbps;  // sum of the devices' negotiated speeds
+    unsigned long long periodicBytesPerSec;   // isochronous and interrupt reservations
+    
+    // The same sums over every root hub of the host controller
+    int controllerDeviceCount;
+    unsigned long long controllerLinkKbps;
+    unsigned long long controllerPeriodicBytesPerSec;
+} USBRootLoad;
+
+// A free port, from FindFreePorts(), with the load already behind it
+typedef struct {
+    int hubIndex;
+    int portNumber;
+    int depth;                    // of the hub, 0 on a root hub
+    int rootOrdinal;
+    int controllerOrdinal;
+    int maxSpeed;                 // fastest device it can carry, as USBDeviceRecord.speed
+    unsigned int portFlags;       // USB_EXT_PORT_*, 0 if the hub doesn't report them
+    unsigned long long rootPeriodicBytesPerSec;
+    unsigned long long controllerLinkKbps;
+    unsigned long long controllerPeriodicBytesPerSec;
+} USBFreePort;
+
+#if USB_MAPPER_EXTENDED
+
+typedef struct {
+    USBRootLoad* roots;           // in rootOrdinal order
+    int rootCount;
+    USBFreePort* ports;
+    int portCount;
+    int portCapacity;
+} LoadReport;
+
+// Negotiated link rate by record speed. SuperSpeedPlus counts at 10 Gbps,
+// the lowest rate it runs at.
+static unsigned long long SpeedKbps(int speed) {
+    static const unsigned int kbps[] = { 1500, 12000, 480000, 5000000, 10000000 };
+    return (speed >= 0 && speed <= 4) ? kbps[speed] : 0;
+}
+
+// Bandwidth a periodic endpoint moving bytes per service interval reserves,
+// in bytes per second. High and SuperSpeed intervals are 2^(bInterval-1)
+// microframes; full and low speed count frames, linearly for interrupt
+// endpoints.
+static unsigned long long EndpointBytesPerSec(int speed, int transfer, int interval,
+                                              unsigned long long bytes) {
+    int exponent = (interval < 1) ? 0 : (interval > 16) ? 15 : interval - 1;
+    
+    if (speed >= 2) {
+        return bytes * 8000 / (1ull << exponent);
+    }
+    if (transfer == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+        return bytes * 1000 / (1ull << exponent);
+    }
+    return bytes * 1000 / (interval < 1 ? 1 : interval);
+}
+
+// Sum the periodic bandwidth a configuration descriptor reserves at the
+// given speed and count its bulk endpoints. Alternate settings of an
+// interface exclude each other, so each interface counts at its most
+// demanding one.
+static unsigned long long SumEndpointBandwidth(const unsigned char* desc, int length, int speed,
+                                               int* bulkEndpoints) {
+    unsigned long long total = 0;
+    unsigned long long interfaceMax = 0;
+    unsigned long long altSum = 0;
+    unsigned long long lastRate = 0;  // of the last periodic endpoint, for its companion
+    int lastTransfer = 0;
+    int lastInterval = 0;
+    int interfaceNumber = -1;
+    
+    for (int offset = 0; offset + 2 <= length; ) {
+        const unsigned char* d = &desc[offset];
+        if (d[0] < 2 || offset + d[0] > length) {
+            break;
+        }
+        
+        if (d[1] == USB_INTERFACE_DESCRIPTOR_TYPE && d[0] >= 9) {
+            if (altSum > interfaceMax) {
+                interfaceMax = altSum;
+            }
+            if (d[2] != interfaceNumber) {
+                total += interfaceMax;
+                interfaceMax = 0;
+                interfaceNumber = d[2];
+            }
+            altSum = 0;
+            lastTransfer = 0;
+        } else if (d[1] == USB_ENDPOINT_DESCRIPTOR_TYPE && d[0] >= 7) {
+            int transfer = d[3] & USB_ENDPOINT_TYPE_MASK;
+            unsigned int maxPacket = d[4] | (d[5] << 8);
+            lastTransfer = 0;
+            
+            if (transfer == USB_ENDPOINT_TYPE_BULK) {
+                (*bulkEndpoints)++;
+            } else if (transfer == USB_ENDPOINT_TYPE_ISOCHRONOUS ||
+                       transfer == USB_ENDPOINT_TYPE_INTERRUPT) {
+                // High speed packs up to three packets into a microframe
+                unsigned long long bytes = (maxPacket & 0x7FF) * (1 + ((maxPacket >> 11) & 3));
+                lastTransfer = transfer;
+                lastInterval = d[6];
+                lastRate = EndpointBytesPerSec(speed, transfer, lastInterval, bytes);
+                altSum += lastRate;
+            }
+        } else if (d[1] == USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE && d[0] >= 6 &&
+                   lastTransfer != 0 && speed >= 3) {
+            // SuperSpeed bursts several packets, so wBytesPerInterval is the real size
+            altSum -= lastRate;
+            lastRate = EndpointBytesPerSec(speed, lastTransfer, lastInterval,
+                                           d[4] | (d[5] << 8));
+            altSum += lastRate;
+        }
+        offset += d[0];
+    }
+    
+    if (altSum > interfaceMax) {
+        interfaceMax = altSum;
+    }
+    return total + interfaceMax;
+}
+
+// Root hub ordinal of the tree a hub sits in, or -1
+static int RootOrdinalOfHub(const TopologySnapshot* snap, int hubIndex) {
+    int parent = snap->hubs[hubIndex].parentRecord;
+    
+    for (int steps = 0; parent >= 0 && steps <= snap->hubCount; steps++) {
+        hubIndex = snap->records[parent].hubIndex;
+        parent = snap->hubs[hubIndex].parentRecord;
+    }
+    return snap->hubs[hubIndex].rootOrdinal;
+}
+
+// Find each root hub's host controller. A controller names its root hub
+// through IOCTL_USB_GET_ROOT_HUB_NAME, which is matched against the hub
+// paths; a root hub whose controller isn't found is its own group.
+static void MatchHostControllers(const TopologySnapshot* snap, LoadReport* report) {
+    SP_DEVICE_INTERFACE_DATA interfaceData;
+    interfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+    int controllerCount = 0;
+    
+    HDEVINFO deviceInfoSet = g_backend->GetClassDevs(&GUID_DEVINTERFACE_USB_HOST_CONTROLLER,
+                                                     DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    
+    while (deviceInfoSet != INVALID_HANDLE_VALUE &&
+           g_backend->EnumDeviceInterfaces(deviceInfoSet, &GUID_DEVINTERFACE_USB_HOST_CONTROLLER,
+                                           controllerCount, &interfaceData)) {
+        int ordinal = controllerCount++;
+        DWORD requiredSize = 0;
+        g_backend->GetDeviceInterfaceDetail(deviceInfoSet, &interfaceData, NULL, 0,
+                                            &requiredSize, NULL);
+        
+        PSP_DEVICE_INTERFACE_DETAIL_DATA_W detail =
+            (PSP_DEVICE_INTERFACE_DETAIL_DATA_W)malloc(requiredSize);
+        if (detail == NULL) {
+            continue;
+        }
+        detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+        
+        SP_DEVINFO_DATA deviceInfoData;
+        deviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+        char path[MAX_PATH_LEN];
+        path[0] = '\0';
+        if (g_backend->GetDeviceInterfaceDetail(deviceInfoSet, &interfaceData, detail,
+                                                requiredSize, NULL, &deviceInfoData)) {
+            WideToUtf8(detail->DevicePath, -1, path, sizeof(path));
+        }
+        free(detail);
+        
+        HANDLE hController = (path[0] != '\0') ? OpenDeviceHandle(path) : INVALID_HANDLE_VALUE;
+        if (hController == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+        
+        struct {
+            USB_ROOT_HUB_NAME header;
+            WCHAR name[MAX_PATH_LEN];
+        } rootName;
+        ZeroMemory(&rootName, sizeof(rootName));
+        
+        char hubPath[MAX_PATH_LEN];
+        int hubIndex = -1;
+        if (DeviceIoControlSync(hController, FALSE, IOCTL_USB_GET_ROOT_HUB_NAME, &rootName,
+                                sizeof(rootName), INFINITE)) {
+            // Like companion links, the name lacks the \\?\ prefix
+            char name[MAX_PATH_LEN];
+            WideToUtf8(rootName.header.RootHubName, -1, name, sizeof(name));
+            snprintf(hubPath, sizeof(hubPath), "\\\\?\\%s", name);
+            hubIndex = SnapshotFindHub(snap, hubPath);
+        }
+        g_backend->CloseDevice(hController);
+        
+        int root = (hubIndex >= 0) ? snap->hubs[hubIndex].rootOrdinal : -1;
+        if (root >= 0 && root < report->rootCount) {
+            USBRootLoad* load = &report->roots[root];
+            load->controllerOrdinal = ordinal;
+            strncpy(load->controllerPath, path, MAX_PATH_LEN - 1);
+            GetDeviceProperty(deviceInfoSet, &deviceInfoData, SPDRP_DEVICEDESC,
+                              load->controllerDesc, sizeof(load->controllerDesc));
+        }
+    }
+    
+    if (deviceInfoSet != INVALID_HANDLE_VALUE) {
+        g_backend->DestroyDeviceInfoList(deviceInfoSet);
+    }
+    
+    for (int r = 0; r < report->rootCount; r++) {
+        if (report->roots[r].controllerOrdinal < 0) {
+            report->roots[r].controllerOrdinal = controllerCount + r;
+        }
+    }
+}
+
+// Fastest device speed a free port can carry: what the port supports, but
+// no faster than the hub's own link. Without CONNECTION_INFORMATION_EX_V2
+// the hub's link speed is all there is to go on.
+static int FreePortMaxSpeed(const TopologySnapshot* snap, HANDLE hHub, int hubIndex, int port) {
+    int parent = snap->hubs[hubIndex].parentRecord;
+    int uplink = (parent >= 0) ? snap->records[parent].speed : -1;
+    int speed = (uplink >= 0) ? uplink : 2;
+    
+    USB_NODE_CONNECTION_INFORMATION_EX_V2 v2;
+    if (QueryConnectionV2(hHub, FALSE, INFINITE, port, &v2)) {
+        unsigned int protocols = v2.SupportedUsbProtocols.ul;
+        speed = (protocols & USB_EXT_PROTOCOL_USB300) ?
+                    (v2.Flags.DeviceIsSuperSpeedPlusCapableOrHigher ? 4 : 3) :
+                (protocols & USB_EXT_PROTOCOL_USB200) ? 2 :
+                (protocols & USB_EXT_PROTOCOL_USB110) ? 1 : speed;
+    }
+    return (uplink >= 0 && uplink < speed) ? uplink : speed;
+}
+
+// Add the free ports of one hub to the report. The hub is queried live, so
+// a port taken since the scan is skipped. The USB 2 half of a free USB 3
+// connector is left out, and a port whose companion is in use isn't free.
+static void CollectFreePorts(const TopologySnapshot* snap, int hubIndex, LoadReport* report) {
+    int root = RootOrdinalOfHub(snap, hubIndex);
+    if (root < 0 || root >= report->rootCount) {
+        return;
+    }
+    
+    HANDLE hHub = OpenDeviceHandle(snap->hubs[hubIndex].devicePath);
+    if (hHub == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    
+    USB_NODE_INFORMATION nodeInfo;
+    ZeroMemory(&nodeInfo, sizeof(nodeInfo));
+    int numPorts = GetHubNodeInfo(hHub, &nodeInfo) ?
+                   nodeInfo.u.HubInformation.HubDescriptor.bNumberOfPorts : 0;
+    USBRootLoad* load = &report->roots[root];
+    
+    for (int port = 1; port <= numPorts; port++) {
+        USB_NODE_CONNECTION_INFORMATION_EX connInfo;
+        ZeroMemory(&connInfo, sizeof(connInfo));
+        if (RecordAtPort(snap, hubIndex, port) >= 0 ||
+            !GetPortConnectorProperties(hHub, port, &connInfo) ||
+            connInfo.ConnectionStatus != NoDeviceConnected) {
+            continue;
+        }
+        
+        int maxSpeed = FreePortMaxSpeed(snap, hHub, hubIndex, port);
+        USBExtendedInfo connector;
+        ZeroMemory(&connector, sizeof(connector));
+        if (QueryPortConnector(hHub, port, &connector)) {
+            if (!(connector.portFlags & USB_EXT_PORT_USER_CONNECTABLE)) {
+                continue;
+            }
+            
+            int companionHub = (connector.companionPort != 0) ?
+                               SnapshotFindHub(snap, connector.companionHubPath) : -1;
+            if (companionHub >= 0 &&
+                (RecordAtPort(snap, companionHub, connector.companionPort) >= 0 ||
+                 maxSpeed < 3)) {
+                continue;
+            }
+        }
+        
+        if (report->portCount >= report->portCapacity) {
+            int newCapacity = report->portCapacity ? report->portCapacity * 2 : 32;
+            USBFreePort* grown = (USBFreePort*)realloc(report->ports,
+                                                       newCapacity * sizeof(USBFreePort));
+            if (grown == NULL) {
+                break;
+            }
+            report->ports = grown;
+            report->portCapacity = newCapacity;
+        }
+        
+        USBFreePort* entry = &report->ports[report->portCount++];
+        ZeroMemory(entry, sizeof(USBFreePort));
+        entry->hubIndex = hubIndex;
+        entry->portNumber = port;
+        entry->depth = snap->hubs[hubIndex].depth;
+        entry->rootOrdinal = root;
+        entry->maxSpeed = maxSpeed;
+        entry->portFlags = connector.portFlags;
+        load->freePortCount++;
+    }
+    
+    g_backend->CloseDevice(hHub);
+}
+
+// Least loaded first: the controller's reserved bandwidth, then its link
+// rates, then the root hub's bandwidth, then the shallowest hub
+static int CompareFreePorts(const void* a, const void* b) {
+    const USBFreePort* x = (const USBFreePort*)a;
+    const USBFreePort* y = (const USBFreePort*)b;
+    
+    if (x->controllerPeriodicBytesPerSec != y->controllerPeriodicBytesPerSec) {
+        return (x->controllerPeriodicBytesPerSec < y->controllerPeriodicBytesPerSec) ? -1 : 1;
+    }
+    if (x->controllerLinkKbps != y->controllerLinkKbps) {
+        return (x->controllerLinkKbps < y->controllerLinkKbps) ? -1 : 1;
+    }
+    if (x->rootPeriodicBytesPerSec != y->rootPeriodicBytesPerSec) {
+        return (x->rootPeriodicBytesPerSec < y->rootPeriodicBytesPerSec) ? -1 : 1;
+    }
+    if (x->depth != y->depth) {
+        return x->depth - y->depth;
+    }
+    if (x->hubIndex != y->hubIndex) {
+        return x->hubIndex - y->hubIndex;
+    }
+    return x->portNumber - y->portNumber;
+}
+
+static void FreeLoadReport(LoadReport* report) {
+    free(report->roots);
+    free(report->ports);
+}
+
+// Build the load of every root hub of ctx's current snapshot and its free
+// ports, sorted least loaded first. Configuration descriptors come from the
+// extended info cache. Returns FALSE before the first scan or if out of
+// memory.
+static BOOL BuildLoadReport(MapperContext* ctx, LoadReport* report) {
+    ZeroMemory(report, sizeof(LoadReport));
+    
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    if (snap == NULL) {
+        return FALSE;
+    }
+    
+    report->rootCount = snap->rootHubCount;
+    report->roots = (USBRootLoad*)calloc(report->rootCount ? report->rootCount : 1,
+                                         sizeof(USBRootLoad));
+    int configCapacity = 4096;
+    unsigned char* config = (unsigned char*)malloc(configCapacity);
+    if (report->roots == NULL || config == NULL) {
+        free(config);
+        FreeLoadReport(report);
+        ReleaseSnapshot(snap);
+        return FALSE;
+    }
+    
+    for (int r = 0; r < report->rootCount; r++) {
+        report->roots[r].hubIndex = snap->rootHubs[r];
+        report->roots[r].rootOrdinal = r;
+        report->roots[r].controllerOrdinal = -1;
+    }
+    MatchHostControllers(snap, report);
+    
+    for (int i = 0; i < snap->deviceCount; i++) {
+        const USBDeviceRecord* rec = &snap->records[i];
+        int root = RootOrdinalOfHub(snap, rec->hubIndex);
+        if (root < 0 || root >= report->rootCount) {
+            continue;
+        }
+        
+        USBRootLoad* load = &report->roots[root];
+        load->deviceCount++;
+        load->linkKbps += SpeedKbps(rec->speed);
+        
+        int length;
+        LookupExtendedInfo(ctx, snap, i, USB_EXT_CONFIG_DESC, NULL, config, configCapacity,
+                           &length);
+        if (length > configCapacity) {
+            unsigned char* grown = (unsigned char*)realloc(config, length);
+            if (grown != NULL) {
+                config = grown;
+                configCapacity = length;
+                LookupExtendedInfo(ctx, snap, i, USB_EXT_CONFIG_DESC, NULL, config,
+                                   configCapacity, &length);
+            }
+        }
+        
+        if (length <= 0 || length > configCapacity) {
+            load->unreadCount++;
+        } else {
+            load->periodicBytesPerSec += SumEndpointBandwidth(config, length, rec->speed,
+                                                              &load->bulkEndpoints);
+        }
+    }
+    free(config);
+    
+    for (int h = 0; h < snap->hubCount; h++) {
+        CollectFreePorts(snap, h, report);
+    }
+    ReleaseSnapshot(snap);
+    
+    // Controller totals, repeated on each of its root hubs
+    for (int r = 0; r < report->rootCount; r++) {
+        USBRootLoad* load = &report->roots[r];
+        for (int other = 0; other < report->rootCount; other++) {
+            const USBRootLoad* peer = &report->roots[other];
+            if (peer->controllerOrdinal == load->controllerOrdinal) {
+                load->controllerDeviceCount += peer->deviceCount;
+                load->controllerLinkKbps += peer->linkKbps;
+                load->controllerPeriodicBytesPerSec += peer->periodicBytesPerSec;
+            }
+        }
+    }
+    
+    for (int p = 0; p < report->portCount; p++) {
+        USBFreePort* port = &report->ports[p];
+        const USBRootLoad* load = &report->roots[port->rootOrdinal];
+        port->controllerOrdinal = load->controllerOrdinal;
+        port->rootPeriodicBytesPerSec = load->periodicBytesPerSec;
+        port->controllerLinkKbps = load->controllerLinkKbps;
+        port->controllerPeriodicBytesPerSec = load->controllerPeriodicBytesPerSec;
+    }
+    if (report->portCount > 1) {
+        qsort(report->ports, report->portCount, sizeof(USBFreePort), CompareFreePorts);
+    }
+    return TRUE;
+}
+
+// Group the devices of ctx's current snapshot by host controller and root
+// hub - exported to Python. Sums their negotiated link rates and the
+// isochronous and interrupt bandwidth their configuration descriptors
+// reserve, and counts free ports. Devices and hubs are queried, so this
+// costs IOCTLs; configuration descriptors are cached like
+// GetDeviceConfigDescriptor(). Hubs flagged USB_HUB_SCAN_UNRESOLVED and
+// what hangs off them are left out. NULL ctx reads the legacy results.
+// Writes at most capacity entries in root hub order and returns the root
+// hub count, or -1 before the first scan.
+__declspec(dllexport) int GetControllerLoad(MapperContext* ctx, USBRootLoad* out,
+                                            int capacity) {
+    LoadReport report;
+    if (!BuildLoadReport(ResolveContext(ctx), &report)) {
+        return -1;
+    }
+    
+    int count = report.rootCount;
+    if (out != NULL && capacity > 0) {
+        memcpy(out, report.roots, ((count < capacity) ? count : capacity) * sizeof(USBRootLoad));
+    }
+    FreeLoadReport(&report);
+    return count;
+}
+
+// List free ports that can carry a device of at least minSpeed (as
+// USBDeviceRecord.speed), least loaded host controller first - exported to
+// Python. Built like GetControllerLoad(). Only user-connectable ports are
+// listed, and a USB 3 connector once, by its SuperSpeed port. Writes at
+// most capacity entries and returns the number of matching ports, or -1
+// before the first scan.
+__declspec(dllexport) int FindFreePorts(MapperContext* ctx, int minSpeed, USBFreePort* out,
+                                        int capacity) {
+    LoadReport report;
+    if (!BuildLoadReport(ResolveContext(ctx), &report)) {
+        return -1;
+    }
+    
+    int count = 0;
+    for (int p = 0; p < report.portCount; p++) {
+        if (report.ports[p].maxSpeed < minSpeed) {
+            continue;
+        }
+        if (out != NULL && count < capacity) {
+            out[count] = report.ports[p];
+        }
+        count++;
+    }
+    FreeLoadReport(&report);
+    return count;
+}
+
+#endif
+
+// Called after watch mode patches the topology. hubIndex is the hub that
+// was re-queried, or -1 after a full rescan.
+typedef void (WINAPI *TopologyChangeCallback)(int hubIndex, int deviceCount);
+
+// Hubs queued by notifications before the watch thread picks them up
+#define MAX_PENDING_HUBS 64
+
+// Watch mode state
+static HCMNOTIFICATION g_hubNotify = NULL;
+static HCMNOTIFICATION g_deviceNotify = NULL;
+static HANDLE g_watchThread = NULL;
+static HANDLE g_watchWake = NULL;      // signaled by notifications
+static HANDLE g_watchChanged = NULL;   // signaled after each patch
+static volatile LONG g_watchStop = 0;
+static TopologyChangeCallback g_watchCallback = NULL;
+
+static SRWLOCK g_watchQueueLock = SRWLOCK_INIT;
+static DEVINST g_pendingHubs[MAX_PENDING_HUBS];
+static int g_pendingHubCount = 0;
+static BOOL g_pendingFullRescan = FALSE;
+
+// Replace hub hubIndex's records in an unpublished snapshot, keeping
+// hubIndex order
+static void SpliceHubRecords(TopologySnapshot* snap, int hubIndex,
+                             const USBDeviceRecord* devices, int count) {
+    int first = 0;
+    while (first < snap->deviceCount && snap->records[first].hubIndex < hubIndex) {
+        first++;
+    }
+    
+    int last = first;
+    while (last < snap->deviceCount && snap->records[last].hubIndex == hubIndex) {
+        last++;
+    }
+    
+    int tail = snap->deviceCount - last;
+    int needed = first + count + tail;
+    
+    // Keep the old records if the store can't grow
+    if (!ReserveRecords(snap, needed + needed / 4) && !ReserveRecords(snap, needed)) {
+        snap->droppedCount += count;
+        return;
+    }
+    
+    memmove(&snap->records[first + count], &snap->records[last],
+            tail * sizeof(USBDeviceRecord));
+    for (int i = 0; i < count; i++) {
+        snap->records[first + i] = devices[i];
+        snap->records[first + i].hubPathOffset = snap->hubs[hubIndex].pathOffset;
+        snap->records[first + i].hubDescOffset = snap->hubs[hubIndex].descOffset;
+    }
+    snap->deviceCount = first + count + tail;
+    snap->hubs[hubIndex].scanFlags = 0;
+    RebuildTree(snap);
+}
+
+// True if snap still caches the hub at hubIndex as expectInst
+static BOOL IsCachedHub(const TopologySnapshot* snap, int hubIndex, DEVINST expectInst) {
+    return snap != NULL && hubIndex >= 0 && hubIndex < snap->hubCount &&
+           snap->hubs[hubIndex].devInst == expectInst;
+}
+
+// Re-query cached hub hubIndex of ctx and publish a snapshot with its
+// records replaced. expectInst guards against a full scan replacing the
+// cache meanwhile. Returns the hub's record count, or -1 if it is no
+// longer cached.
+static int RescanCachedHubAt(MapperContext* ctx, int hubIndex, DEVINST expectInst) {
+    HubEntry* hubs = NULL;
+    int hubCount = 0;
+    
+    // Probe against a private copy so cascaded hubs can be linked without
+    // holding a snapshot across IOCTLs
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    if (IsCachedHub(snap, hubIndex, expectInst)) {
+        hubs = (HubEntry*)malloc(snap->hubCount * sizeof(HubEntry));
+        if (hubs != NULL) {
+            memcpy(hubs, snap->hubs, snap->hubCount * sizeof(HubEntry));
+            hubCount = snap->hubCount;
+        }
+    }
+    ReleaseSnapshot(snap);
+    
+    if (hubs == NULL) {
+        return -1;
+    }
+    
+    DeviceSlab slab = { NULL, 0, 0, TRUE };
+    int count = ProbeHub(hubs, hubCount, hubIndex, &slab, NULL);
+    free(hubs);
+    
+    // Patch a copy of whatever is current now; other hubs may have been
+    // patched while we were probing
+    TopologySnapshot* next = BeginSnapshot(ctx);
+    if (next == NULL) {
+        count = -1;
+    } else if (IsCachedHub(ctx->current, hubIndex, expectInst) &&
+               CopySnapshot(next, ctx->current)) {
+        SpliceHubRecords(next, hubIndex, slab.devices, slab.count);
+        CommitSnapshot(ctx, next);
+    } else {
+        AbandonSnapshot(ctx, next);
+        count = -1;
+    }
+    
+    free(slab.devices);
+    return count;
+}
+
+// Re-query one cached hub's ports and publish the patched topology.
+// Returns the hub's index, or -1 if the hub isn't in the cache.
+static int RescanCachedHub(MapperContext* ctx, DEVINST devInst) {
+    int hubIndex = -1;
+    
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    for (int i = 0; snap != NULL && i < snap->hubCount; i++) {
+        if (snap->hubs[i].devInst == devInst) {
+            hubIndex = i;
+            break;
+        }
+    }
+    ReleaseSnapshot(snap);
+    
+    if (hubIndex < 0 || RescanCachedHubAt(ctx, hubIndex, devInst) < 0) {
+        return -1;
+    }
+    return hubIndex;
+}
+
+// RescanHub() flags
+#define RESCAN_DESCENDANTS 0x01
+
+// Resolve a RescanHub() target to a cached hub
+static int FindHubTarget(const TopologySnapshot* snap, const char* target) {
+    if (_strnicmp(target, "root", 4) == 0) {
+        int hubIndex;
+        LookupPortPath(snap, target, &hubIndex);
+        return hubIndex;
+    }
+    
+    return SnapshotFindHub(snap, target);
+}
+
+// Rescan one hub of a context, and optionally everything below it -
+// exported to Python. NULL ctx rescans the legacy results. See RescanHub().
+__declspec(dllexport) int RescanHubInContext(MapperContext* ctx, const char* target,
+                                             int flags) {
+    if (target == NULL) {
+        return -1;
+    }
+    ctx = ResolveContext(ctx);
+    
+    TopologySnapshot* snap = AcquireSnapshot(ctx);
+    int hubIndex = FindHubTarget(snap, target);
+    DEVINST devInst = (hubIndex >= 0) ? snap->hubs[hubIndex].devInst : 0;
+    int hubCount = (snap != NULL) ? snap->hubCount : 0;
+    ReleaseSnapshot(snap);
+    
+    if (hubIndex < 0) {
+        return -1;
+    }
+    
+    // Breadth-first over the subtree; queue slots double as a visited list
+    int* queue = (int*)malloc(hubCount * sizeof(int));
+    DEVINST* queueInst = (DEVINST*)malloc(hubCount * sizeof(DEVINST));
+    int head = 0;
+    int tail = 0;
+    int total = 0;
+    
+    if (queue == NULL || queueInst == NULL) {
+        free(queue);
+        free(queueInst);
+        return -1;
+    }
+    
+    queue[tail] = hubIndex;
+    queueInst[tail++] = devInst;
+    
+    while (head < tail) {
+        int current = queue[head];
+        int count = RescanCachedHubAt(ctx, current, queueInst[head]);
+        head++;
+        
+        if (count < 0) {
+            if (current == hubIndex) {
+                total = -1;
+                break;
+            }
+            continue;
+        }
+        total += count;
+        
+        if (!(flags & RESCAN_DESCENDANTS)) {
+            break;
+        }
+        
+        // Queue the hubs hanging off the ports we just refreshed
+        snap = AcquireSnapshot(ctx);
+        if (IsCachedHub(snap, current, queueInst[head - 1])) {
+            const HubEntry* hub = &snap->hubs[current];
+            for (int i = hub->firstRecord; i >= 0; i = snap->records[i].nextSibling) {
+                int child = snap->records[i].childHubIndex;
+                BOOL seen = FALSE;
+                
+                for (int q = 0; child >= 0 && q < tail; q++) {
+                    if (queue[q] == child) {
+                        seen = TRUE;
+                        break;
+                    }
+                }
+                if (child >= 0 && !seen && tail < hubCount) {
+                    queue[tail] = child;
+                    queueInst[tail++] = snap->hubs[child].devInst;
+                }
+            }
+        }
+        ReleaseSnapshot(snap);
+    }
+    
+    free(queue);
+    free(queueInst);
+    return total;
+}
+
+// Rescan one hub, and optionally everything below it - exported to Python.
+// target is a hub device path, a location path (SPDRP_LOCATION_PATHS) or a
+// port path ("root3" for a root hub, "root3.2" for the hub on its port 2).
+// Only the targeted hubs' records are replaced and no lock is held while
+// probing, so workers refreshing different hubs don't serialize on IOCTLs.
+// Returns the number of records now in the subtree, or -1 if the target
+// is not a cached hub.
+__declspec(dllexport) int RescanHub(const char* target, int flags) {
+    return RescanHubInContext(&g_defaultContext, target, flags);
+}
+
+// Turn an interface path like \\?\USB#VID_1234&PID_5678#SN#{guid} into
+// its device instance ID, USB\VID_1234&PID_5678\SN
+static BOOL InstanceIdFromInterfacePath(PCWSTR path, WCHAR* out, int outLen) {
+    if (wcsncmp(path, L"\\\\?\\", 4) == 0) {
+        path += 4;
+    }
+    
+    const WCHAR* end = wcsrchr(path, L'#');
+    if (end == NULL || end - path >= outLen) {
+        return FALSE;
+    }
+    
+    int len = (int)(end - path);
+    for (int i = 0; i < len; i++) {
+        out[i] = (path[i] == L'#') ? L'\\' : path[i];
+    }
+    out[len] = L'\0';
+    return TRUE;
+}
+
+// Queue a hub for the watch thread, or a full rescan if hubInst is 0
+static void QueueWatchWork(DEVINST hubInst) {
+    AcquireSRWLockExclusive(&g_watchQueueLock);
+    if (hubInst == 0 || g_pendingHubCount >= MAX_PENDING_HUBS) {
+        g_pendingFullRescan = TRUE;
+    } else {
+        BOOL queued = FALSE;
+        for (int i = 0; i < g_pendingHubCount; i++) {
+            if (g_pendingHubs[i] == hubInst) {
+                queued = TRUE;
+                break;
+            }
+        }
+        if (!queued) {
+            g_pendingHubs[g_pendingHubCount++] = hubInst;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_watchQueueLock);
+    
+    SetEvent(g_watchWake);
+}
+
+// CM notification callback. Runs on a system thread pool thread, so it only
+// resolves the parent hub and leaves the IOCTLs to the watch thread.
+static DWORD CALLBACK WatchNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                      CM_NOTIFY_ACTION action,
+                                      PCM_NOTIFY_EVENT_DATA eventData,
+                                      DWORD eventDataSize) {
+    if (action != CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL &&
+        action != CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        return ERROR_SUCCESS;
+    }
+    
+    // A hub coming or going shifts hubIndex, so rebuild everything
+    if (context == (PVOID)&GUID_DEVINTERFACE_USB_HUB) {
+        QueueWatchWork(0);
+        return ERROR_SUCCESS;
+    }
+    
+    // A device changed; its devnode may already be a phantom on removal
+    WCHAR instanceId[MAX_DEVICE_ID_LEN];
+    DEVINST devInst;
+    DEVINST parentInst;
+    
+    if (!InstanceIdFromInterfacePath(eventData->u.DeviceInterface.SymbolicLink,
+                                     instanceId, MAX_DEVICE_ID_LEN) ||
+        CM_Locate_DevNodeW(&devInst, instanceId, CM_LOCATE_DEVNODE_PHANTOM) != CR_SUCCESS ||
+        CM_Get_Parent(&parentInst, devInst, 0) != CR_SUCCESS) {
+        QueueWatchWork(0);
+        return ERROR_SUCCESS;
+    }
+    
+    QueueWatchWork(parentInst);
+    return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI WatchThreadProc(LPVOID param) {
+    for (;;) {
+        WaitForSingleObject(g_watchWake, INFINITE);
+        if (g_watchStop) {
+            break;
+        }
+        
+        DEVINST pending[MAX_PENDING_HUBS];
+        
+        AcquireSRWLockExclusive(&g_watchQueueLock);
+        BOOL fullRescan = g_pendingFullRescan;
+        int pendingCount = g_pendingHubCount;
+        memcpy(pending, g_pendingHubs, pendingCount * sizeof(DEVINST));
+        g_pendingFullRescan = FALSE;
+        g_pendingHubCount = 0;
+        ReleaseSRWLockExclusive(&g_watchQueueLock);
+        
+        BOOL changed = FALSE;
+        
+        if (fullRescan) {
+            int count = EnumerateUSBDevices();
+            if (g_watchCallback != NULL) {
+                g_watchCallback(-1, count);
+            }
+            changed = TRUE;
+        } else {
+            for (int i = 0; i < pendingCount; i++) {
+                int hubIndex = RescanCachedHub(&g_defaultContext, pending[i]);
+                if (hubIndex < 0) {
+                    continue;
+                }
+                if (g_watchCallback != NULL) {
+                    g_watchCallback(hubIndex, GetDeviceCount());
+                }
+                changed = TRUE;
+            }
+        }
+        
+        if (changed) {
+            SetEvent(g_watchChanged);
+        }
+    }
+    
+    return 0;
+}
+
+static BOOL RegisterInterfaceNotification(const GUID* guid, HCMNOTIFICATION* outNotify) {
+    CM_NOTIFY_FILTER filter;
+    ZeroMemory(&filter, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = *guid;
+    
+    return CM_Register_Notification(&filter, (PVOID)guid, WatchNotifyProc,
+                                    outNotify) == CR_SUCCESS;
+}
+
+// Stop watch mode - exported to Python
+__declspec(dllexport) void StopTopologyWatch() {
+    // Unregistering waits for in-flight callbacks, so nothing queues after this
+    if (g_hubNotify != NULL) {
+        CM_Unregister_Notification(g_hubNotify);
+        g_hubNotify = NULL;
+    }
+    if (g_deviceNotify != NULL) {
+        CM_Unregister_Notification(g_deviceNotify);
+        g_deviceNotify = NULL;
+    }
+    
+    if (g_watchThread != NULL) {
+        InterlockedExchange(&g_watchStop, 1);
+        SetEvent(g_watchWake);
+        WaitForSingleObject(g_watchThread, INFINITE);
+        CloseHandle(g_watchThread);
+        g_watchThread = NULL;
+    }
+    
+    if (g_watchWake != NULL) {
+        CloseHandle(g_watchWake);
+        g_watchWake = NULL;
+    }
+    if (g_watchChanged != NULL) {
+        CloseHandle(g_watchChanged);
+        g_watchChanged = NULL;
+    }
+    
+    g_watchCallback = NULL;
+    g_pendingHubCount = 0;
+    g_pendingFullRescan = FALSE;
+}
+
+// Start watch mode - exported to Python.
+// Hub and device arrival/removal notifications re-query only the affected
+// hub and publish the patched topology. callback may be NULL; the event from
+// GetTopologyChangeEvent() is signaled either way. Watch mode keeps the
+// legacy results current, not other contexts. Returns 1 on success.
+__declspec(dllexport) int StartTopologyWatch(TopologyChangeCallback callback) {
+    if (g_watchThread != NULL) {
+        return 0;
+    }
+    
+    // Seed the hub cache so the first notification has something to patch
+    TopologySnapshot* snap = AcquireSnapshot(&g_defaultContext);
+    BOOL haveHubs = (snap != NULL);
+    ReleaseSnapshot(snap);
+    
+    if (!haveHubs && EnumerateUSBDevices() < 0) {
+        return 0;
+    }
+    
+    g_watchCallback = callback;
+    g_watchStop = 0;
+    g_watchWake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    g_watchChanged = CreateEventA(NULL, FALSE, FALSE, NULL);
+    
+    if (g_watchWake == NULL || g_watchChanged == NULL) {
+        StopTopologyWatch();
+        return 0;
+    }
+    
+    g_watchThread = CreateThread(NULL, 0, WatchThreadProc, NULL, 0, NULL);
+    
+    if (g_watchThread == NULL ||
+        !RegisterInterfaceNotification(&GUID_DEVINTERFACE_USB_HUB, &g_hubNotify) ||
+        !RegisterInterfaceNotification(&GUID_DEVINTERFACE_USB_DEVICE, &g_deviceNotify)) {
+        StopTopologyWatch();
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Auto-reset event signaled after each watch-mode patch - exported to Python.
+// Valid until StopTopologyWatch(); NULL when watch mode is off.
+__declspec(dllexport) HANDLE GetTopologyChangeEvent() {
+    return g_watchChanged;
+}
+
+// A hub kept open across refreshes by a topology session. The devices
+// found by its last probe are reused until a device under it comes or goes.
+typedef struct {
+    HubEntry hub;
+    HANDLE hHub;
+    int numPorts;
+    volatile LONG dirty;          // re-probe on the next refresh
+    USBDeviceRecord* devices;     // from the last probe
+    int deviceCount;
+} SessionHub;
+
+// Hub paths, handles and descriptors reused by RefreshTopology()
+typedef struct {
+    MapperContext* context;       // where refreshes are published
+    SRWLOCK hubsLock;             // shared by notifications, exclusive to swap hubs
+    SessionHub* hubs;
+    int hubCount;
+    volatile LONG hubSetChanged;
+    HCMNOTIFICATION hubNotify;
+    HCMNOTIFICATION deviceNotify;
+    HANDLE changeEvent;           // set on every notification, or NULL
+} TopologySession;
+
+// Hub interface notification for a session: just flag the hub set stale
+static DWORD CALLBACK SessionNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                        CM_NOTIFY_ACTION action,
+                                        PCM_NOTIFY_EVENT_DATA eventData,
+                                        DWORD eventDataSize) {
+    TopologySession* session = (TopologySession*)context;
+    
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ||
+        action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        InterlockedExchange(&session->hubSetChanged, 1);
+        if (session->changeEvent != NULL) {
+            SetEvent(session->changeEvent);
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Device interface notification for a session: flag the device's parent
+// hub for re-probing, or the whole hub set if the parent isn't known
+static DWORD CALLBACK SessionDeviceNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                              CM_NOTIFY_ACTION action,
+                                              PCM_NOTIFY_EVENT_DATA eventData,
+                                              DWORD eventDataSize) {
+    TopologySession* session = (TopologySession*)context;
+    
+    if (action != CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL &&
+        action != CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        return ERROR_SUCCESS;
+    }
+    
+    WCHAR instanceId[MAX_DEVICE_ID_LEN];
+    DEVINST devInst;
+    DEVINST parentInst;
+    BOOL found = FALSE;
+    
+    if (InstanceIdFromInterfacePath(eventData->u.DeviceInterface.SymbolicLink,
+                                    instanceId, MAX_DEVICE_ID_LEN) &&
+        CM_Locate_DevNodeW(&devInst, instanceId, CM_LOCATE_DEVNODE_PHANTOM) == CR_SUCCESS &&
+        CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
+        AcquireSRWLockShared(&session->hubsLock);
+        for (int i = 0; i < session->hubCount; i++) {
+            if (session->hubs[i].hub.devInst == parentInst) {
+                InterlockedExchange(&session->hubs[i].dirty, 1);
+                found = TRUE;
+                break;
+            }
+        }
+        ReleaseSRWLockShared(&session->hubsLock);
+    }
+    
+    if (!found) {
+        InterlockedExchange(&session->hubSetChanged, 1);
+    }
+    if (session->changeEvent != NULL) {
+        SetEvent(session->changeEvent);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Open a hub and read its port count into *outPorts. Returns
+// INVALID_HANDLE_VALUE if either fails.
+static HANDLE OpenHubNode(const char* devicePath, int* outPorts) {
+    *outPorts = 0;
+    
+    if (devicePath[0] == '\0') {
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    ETW_HUB_OPEN_START(devicePath);
+    HANDLE hHub = OpenDeviceHandle(devicePath);
+    ETW_HUB_OPEN_STOP(devicePath,
+                      (hHub == INVALID_HANDLE_VALUE) ? GetLastError() : ERROR_SUCCESS);
+    if (hHub == INVALID_HANDLE_VALUE) {
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    USB_NODE_INFORMATION nodeInfo;
+    ZeroMemory(&nodeInfo, sizeof(nodeInfo));
+    
+    ETW_IOCTL_START(IOCTL_USB_GET_NODE_INFORMATION, devicePath, 0);
+    BOOL ok = GetHubNodeInfo(hHub, &nodeInfo);
+    ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_INFORMATION, devicePath, 0,
+                   ok ? ERROR_SUCCESS : GetLastError());
+    if (!ok) {
+        g_backend->CloseDevice(hHub);
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    *outPorts = nodeInfo.u.HubInformation.HubDescriptor.bNumberOfPorts;
+    return hHub;
+}
+
+// Open a session hub and read its port count
+static void SessionOpenHub(SessionHub* entry) {
+    entry->hHub = OpenHubNode(entry->hub.devicePath, &entry->numPorts);
+}
+
+// Re-read the hub set, keeping handles for hubs that are still present.
+// Reloads follow hub notifications, so they skip the cached hub list,
+// which the same notification may not have dropped yet.
+static BOOL SessionReloadHubs(TopologySession* session) {
+    HubEntry* found;
+    
+    int foundCount = QueryHubs(&found);
+    if (foundCount < 0) {
+        return FALSE;
+    }
+    
+    SessionHub* hubs = (SessionHub*)calloc(foundCount ? foundCount : 1, sizeof(SessionHub));
+    if (hubs == NULL) {
+        free(found);
+        return FALSE;
+    }
+    
+    // Hub indices may have shifted, so every hub is probed again
+    for (int i = 0; i < foundCount; i++) {
+        hubs[i].hub = found[i];
+        hubs[i].hHub = INVALID_HANDLE_VALUE;
+        hubs[i].dirty = 1;
+        
+        for (int j = 0; j < session->hubCount; j++) {
+            SessionHub* old = &session->hubs[j];
+            if (old->hHub != INVALID_HANDLE_VALUE &&
+                _stricmp(old->hub.devicePath, found[i].devicePath) == 0) {
+                hubs[i].hHub = old->hHub;
+                hubs[i].numPorts = old->numPorts;
+                old->hHub = INVALID_HANDLE_VALUE;
+                break;
+            }
+        }
+        
+        if (hubs[i].hHub == INVALID_HANDLE_VALUE) {
+            SessionOpenHub(&hubs[i]);
+        }
+    }
+    
+    AcquireSRWLockExclusive(&session->hubsLock);
+    SessionHub* oldHubs = session->hubs;
+    int oldCount = session->hubCount;
+    session->hubs = hubs;
+    session->hubCount = foundCount;
+    ReleaseSRWLockExclusive(&session->hubsLock);
+    
+    // Whatever is still open belongs to a hub that went away
+    for (int j = 0; j < oldCount; j++) {
+        if (oldHubs[j].hHub != INVALID_HANDLE_VALUE) {
+            g_backend->CloseDevice(oldHubs[j].hHub);
+        }
+        free(oldHubs[j].devices);
+    }
+    
+    free(oldHubs);
+    free(found);
+    return TRUE;
+}
+
+// Close a topology session - exported to Python
+__declspec(dllexport) void CloseTopologySession(TopologySession* session) {
+    if (session == NULL) {
+        return;
+    }
+    
+    if (session->hubNotify != NULL) {
+        CM_Unregister_Notification(session->hubNotify);
+    }
+    if (session->deviceNotify != NULL) {
+        CM_Unregister_Notification(session->deviceNotify);
+    }
+    
+    for (int i = 0; i < session->hubCount; i++) {
+        if (session->hubs[i].hHub != INVALID_HANDLE_VALUE) {
+            g_backend->CloseDevice(session->hubs[i].hHub);
+        }
+        free(session->hubs[i].devices);
+    }
+    
+    free(session->hubs);
+    free(session);
+}
+
+// Open a session into ctx whose notifications also set changeEvent
+static TopologySession* OpenSession(MapperContext* ctx, HANDLE changeEvent) {
+    TopologySession* session = (TopologySession*)calloc(1, sizeof(TopologySession));
+    if (session == NULL) {
+        return NULL;
+    }
+    session->context = ResolveContext(ctx);
+    session->changeEvent = changeEvent;
+    InitializeSRWLock(&session->hubsLock);
+    
+    CM_NOTIFY_FILTER filter;
+    ZeroMemory(&filter, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_USB_HUB;
+    
+    if (CM_Register_Notification(&filter, session, SessionNotifyProc,
+                                 &session->hubNotify) != CR_SUCCESS) {
+        session->hubNotify = NULL;
+    }
+    
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_USB_DEVICE;
+    if (CM_Register_Notification(&filter, session, SessionDeviceNotifyProc,
+                                 &session->deviceNotify) != CR_SUCCESS) {
+        session->deviceNotify = NULL;
+    }
+    
+    if (!SessionReloadHubs(session)) {
+        CloseTopologySession(session);
+        return NULL;
+    }
+    
+    return session;
+}
+
+// Open a topology session that publishes into ctx - exported to Python.
+// NULL ctx publishes to the legacy results. The session must be closed
+// before ctx is destroyed.
+__declspec(dllexport) TopologySession* OpenTopologySessionInContext(MapperContext* ctx) {
+    return OpenSession(ctx, NULL);
+}
+
+// Open a topology session - exported to Python.
+// The session keeps hub paths, open hub handles and port counts so that
+// RefreshTopology() only has to issue the per-port IOCTLs. The hub set is
+// re-read only after a hub interface arrives or goes away, and only hubs
+// that had a device arrive or leave since the last refresh are queried.
+__declspec(dllexport) TopologySession* OpenTopologySession() {
+    return OpenTopologySessionInContext(&g_defaultContext);
+}
+
+// Remember the devices a session hub's probe appended to a slab. Returns
+// FALSE if they couldn't be kept.
+static BOOL SessionKeepDevices(SessionHub* entry, const USBDeviceRecord* devices, int count) {
+    if (count > entry->deviceCount || entry->devices == NULL) {
+        USBDeviceRecord* grown = (USBDeviceRecord*)realloc(entry->devices,
+                                        (count ? count : 1) * sizeof(USBDeviceRecord));
+        if (grown == NULL) {
+            entry->deviceCount = 0;
+            return FALSE;
+        }
+        entry->devices = grown;
+    }
+    
+    memcpy(entry->devices, devices, count * sizeof(USBDeviceRecord));
+    entry->deviceCount = count;
+    return TRUE;
+}
+
+// Re-query the changed hubs through a session's handles and publish them
+// together with the devices kept for every other hub
+static int SessionRefresh(TopologySession* session, ScanTrace* trace) {
+    // Without notifications we can't tell when hubs arrive, so always reload
+    BOOL reload = InterlockedExchange(&session->hubSetChanged, 0) ||
+                  session->hubNotify == NULL;
+    if (reload && !SessionReloadHubs(session)) {
+        TraceHubsCollected(trace, -1);
+        return -1;
+    }
+    TraceHubsCollected(trace, session->hubCount);
+    
+    HubEntry* hubs = (HubEntry*)malloc((session->hubCount ? session->hubCount : 1) *
+                                       sizeof(HubEntry));
+    if (hubs == NULL) {
+        return -1;
+    }
+    
+    for (int hubIndex = 0; hubIndex < session->hubCount; hubIndex++) {
+        hubs[hubIndex] = session->hubs[hubIndex].hub;
+    }
+    
+    // Without device notifications a quiet hub can't be told from a changed one
+    BOOL probeAll = (session->deviceNotify == NULL);
+    
+    DeviceSlab slab = { NULL, 0, 0, TRUE };
+    for (int hubIndex = 0; hubIndex < session->hubCount; hubIndex++) {
+        SessionHub* entry = &session->hubs[hubIndex];
+        
+        // Report hubs without a handle as failed opens
+        if (entry->hHub == INVALID_HANDLE_VALUE) {
+            HubScanStats* hubStats = TraceHub(trace, hubIndex);
+            if (hubStats != NULL) {
+                hubStats->openFailed = 1;
+            }
+            continue;
+        }
+        
+        // Clear the flag before probing so a change during the probe is
+        // picked up next time
+        BOOL dirty = InterlockedExchange(&entry->dirty, 0) || probeAll;
+        if (!dirty) {
+            for (int i = 0; i < entry->deviceCount; i++) {
+                USBDeviceRecord* dev = SlabAppend(&slab);
+                if (dev != NULL) {
+                    *dev = entry->devices[i];
+                }
+            }
+            if (trace != NULL) {
+                trace->summary.cachedHubs++;
+            }
+            continue;
+        }
+        
+        BOOL hubGone = FALSE;
+        int failedPorts = 0;
+        int first = slab.count;
+        int dropped = slab.dropped;
+        ProbePorts(entry->hHub, hubIndex, entry->numPorts, hubs, session->hubCount,
+                   &slab, &hubGone, &failedPorts, trace);
+        
+        // Only a complete probe can stand in for the next one
+        if (failedPorts > 0 || slab.dropped != dropped ||
+            !SessionKeepDevices(entry, slab.devices + first, slab.count - first)) {
+            InterlockedExchange(&entry->dirty, 1);
+        }
+        
+        if (hubGone) {
+            g_backend->CloseDevice(entry->hHub);
+            entry->hHub = INVALID_HANDLE_VALUE;
+            InterlockedExchange(&session->hubSetChanged, 1);
+        }
+    }
+    
+    int count = PublishScan(session->context, trace, hubs, session->hubCount,
+                            slab.devices, slab.count, slab.dropped);
+    free(slab.devices);
+    
+    return count;
+}
+
+// Have the next RefreshTopology() query every hub again - exported to Python.
+// Sessions opened without device notifications query every hub anyway.
+__declspec(dllexport) void InvalidateTopologySession(TopologySession* session) {
+    if (session == NULL) {
+        return;
+    }
+    
+    AcquireSRWLockShared(&session->hubsLock);
+    for (int i = 0; i < session->hubCount; i++) {
+        InterlockedExchange(&session->hubs[i].dirty, 1);
+    }
+    ReleaseSRWLockShared(&session->hubsLock);
+}
+
+// Refresh through a session - exported to Python.
+// Publishes to the session's context, which for OpenTopologySession() is
+// the same results as EnumerateUSBDevices(). Stats are reported with mode
+// ENUM_MODE_SESSION. Returns the device count or -1 on failure.
+__declspec(dllexport) int RefreshTopology(TopologySession* session) {
+    if (session == NULL) {
+        return -1;
+    }
+    
+    ScanTrace* trace = BeginScanTrace(ENUM_MODE_SESSION);
+    ETW_SCAN_START(ENUM_MODE_SESSION);
+    int count = SessionRefresh(session, trace);
+    ETW_SCAN_STOP(ENUM_MODE_SESSION, count, (count < 0) ? GetLastError() : ERROR_SUCCESS);
+    FinishScanTrace(session->context, trace, count);
+    return count;
+}
+
+// StartBackgroundScanner() flags
+#define USB_SCANNER_ON_CHANGE 0x01    // also rescan after plug/unplug, debounced
+#define USB_SCANNER_FULL      0x02    // query every hub on every scan
+
+// How long a notification burst may keep postponing a scan, in debounce windows
+#define MAX_DEBOUNCE_WINDOWS 8
+
+// Background scanner state, from GetBackgroundScannerStatus()
+typedef struct {
+    int running;
+    int scanCount;                // scans since the scanner started
+    int notificationScans;        // of those, started by notifications
+    int coalescedNotifications;   // notifications folded into an earlier scan
+    int lastDeviceCount;          // -1 if the last scan failed
+    unsigned int lastError;       // GetLastError() of the last failed scan
+    double lastScanUs;
+} BackgroundScannerStatus;
+
+static HANDLE g_scannerThread = NULL;
+static HANDLE g_scannerStop = NULL;           // manual-reset, set to stop the thread
+static HANDLE g_scannerChange = NULL;         // auto-reset, set by session notifications
+static HANDLE g_scannerScanned = NULL;        // auto-reset, set after each scan
+static TopologySession* g_scannerSession = NULL;
+static DWORD g_scannerInterval = 0;
+static DWORD g_scannerDebounce = 0;
+static int g_scannerFlags = 0;
+static SRWLOCK g_scannerStatusLock = SRWLOCK_INIT;
+static BackgroundScannerStatus g_scannerStatus;
+
+// Refresh once through the scanner's session and record the outcome
+static void BackgroundScan(BOOL fromNotification) {
+    if (g_scannerFlags & USB_SCANNER_FULL) {
+        InvalidateTopologySession(g_scannerSession);
+    }
+    
+    LONGLONG start = QpcNow();
+    int count = RefreshTopology(g_scannerSession);
+    DWORD error = (count < 0) ? GetLastError() : ERROR_SUCCESS;
+    double elapsedUs = QpcMicros(start, QpcNow());
+    
+    AcquireSRWLockExclusive(&g_scannerStatusLock);
+    g_scannerStatus.scanCount++;
+    if (fromNotification) {
+        g_scannerStatus.notificationScans++;
+    }
+    g_scannerStatus.lastDeviceCount = count;
+    g_scannerStatus.lastError = error;
+    g_scannerStatus.lastScanUs = elapsedUs;
+    ReleaseSRWLockExclusive(&g_scannerStatusLock);
+    
+    SetEvent(g_scannerScanned);
+}
+
+// Wait out a notification burst: each new notification restarts the
+// debounce window, up to MAX_DEBOUNCE_WINDOWS. Returns FALSE if asked to
+// stop meanwhile.
+static BOOL DebounceNotifications(HANDLE* waits) {
+    int coalesced = 0;
+    
+    for (int window = 0; window < MAX_DEBOUNCE_WINDOWS; window++) {
+        DWORD result = WaitForMultipleObjects(2, waits, FALSE, g_scannerDebounce);
+        if (result == WAIT_OBJECT_0) {
+            return FALSE;
+        }
+        if (result != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        coalesced++;
+    }
+    
+    AcquireSRWLockExclusive(&g_scannerStatusLock);
+    g_scannerStatus.coalescedNotifications += coalesced;
+    ReleaseSRWLockExclusive(&g_scannerStatusLock);
+    return TRUE;
+}
+
+static DWORD WINAPI ScannerThreadProc(LPVOID param) {
+    HANDLE waits[2] = { g_scannerStop, g_scannerChange };
+    DWORD waitCount = (g_scannerChange != NULL) ? 2 : 1;
+    DWORD interval = g_scannerInterval ? g_scannerInterval : INFINITE;
+    
+    // Start from a known topology
+    BackgroundScan(FALSE);
+    
+    for (;;) {
+        DWORD result = WaitForMultipleObjects(waitCount, waits, FALSE, interval);
+        if (result == WAIT_OBJECT_0) {
+            break;
+        }
+        
+        BOOL fromNotification = (result == WAIT_OBJECT_0 + 1);
+        if (fromNotification && !DebounceNotifications(waits)) {
+            break;
+        }
+        BackgroundScan(fromNotification);
+    }
+    return 0;
+}
+
+// Stop the background scanner - exported to Python.
+// Waits for a scan in progress to finish. The last published snapshot stays.
+__declspec(dllexport) void StopBackgroundScanner() {
+    if (g_scannerThread != NULL) {
+        SetEvent(g_scannerStop);
+        WaitForSingleObject(g_scannerThread, INFINITE);
+        CloseHandle(g_scannerThread);
+        g_scannerThread = NULL;
+    }
+    
+    // Closing the session unregisters its notifications before the event goes
+    CloseTopologySession(g_scannerSession);
+    g_scannerSession = NULL;
+    
+    if (g_scannerStop != NULL) {
+        CloseHandle(g_scannerStop);
+        g_scannerStop = NULL;
+    }
+    if (g_scannerChange != NULL) {
+        CloseHandle(g_scannerChange);
+        g_scannerChange = NULL;
+    }
+    if (g_scannerScanned != NULL) {
+        CloseHandle(g_scannerScanned);
+        g_scannerScanned = NULL;
+    }
+    
+    AcquireSRWLockExclusive(&g_scannerStatusLock);
+    g_scannerStatus.running = 0;
+    ReleaseSRWLockExclusive(&g_scannerStatusLock);
+}
+
+// Start a background scanner for ctx - exported to Python.
+// A native thread refreshes ctx through a topology session every
+// intervalMs (0 = only on notifications) and, with USB_SCANNER_ON_CHANGE,
+// after plug/unplug bursts have been quiet for debounceMs (<= 0 picks
+// 250). Results are published as snapshots, so readers never wait for a
+// scan. One scanner per process; it must be stopped before ctx is
+// destroyed. NULL ctx keeps the legacy results current. Returns 1 on
+// success, 0 on failure.
+__declspec(dllexport) int StartBackgroundScannerInContext(MapperContext* ctx, int intervalMs,
+                                                          int debounceMs, int flags) {
+    if (g_scannerThread != NULL) {
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return 0;
+    }
+    if (intervalMs < 0 || (intervalMs == 0 && !(flags & USB_SCANNER_ON_CHANGE))) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    
+    g_scannerInterval = (DWORD)intervalMs;
+    g_scannerDebounce = (debounceMs > 0) ? (DWORD)debounceMs : 250;
+    g_scannerFlags = flags;
+    
+    g_scannerStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    g_scannerScanned = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (flags & USB_SCANNER_ON_CHANGE) {
+        g_scannerChange = CreateEventA(NULL, FALSE, FALSE, NULL);
+    }
+    if (g_scannerStop == NULL || g_scannerScanned == NULL ||
+        ((flags & USB_SCANNER_ON_CHANGE) && g_scannerChange == NULL)) {
+        StopBackgroundScanner();
+        return 0;
+    }
+    
+    g_scannerSession = OpenSession(ctx, g_scannerChange);
+    if (g_scannerSession == NULL) {
+        StopBackgroundScanner();
+        return 0;
+    }
+    
+    AcquireSRWLockExclusive(&g_scannerStatusLock);
+    ZeroMemory(&g_scannerStatus, sizeof(g_scannerStatus));
+    g_scannerStatus.running = 1;
+    g_scannerStatus.lastDeviceCount = -1;
+    ReleaseSRWLockExclusive(&g_scannerStatusLock);
+    
+    g_scannerThread = CreateThread(NULL, 0, ScannerThreadProc, NULL, 0, NULL);
+    if (g_scannerThread == NULL) {
+        StopBackgroundScanner();
+        return 0;
+    }
+    return 1;
+}
+
+// Start a background scanner for the legacy results - exported to Python.
+// See StartBackgroundScannerInContext(); notification bursts are
+// debounced for 250 ms.
+__declspec(dllexport) int StartBackgroundScanner(int intervalMs, int flags) {
+    return StartBackgroundScannerInContext(&g_defaultContext, intervalMs, 0, flags);
+}
+
+// Copy the background scanner's counters - exported to Python
+__declspec(dllexport) void GetBackgroundScannerStatus(BackgroundScannerStatus* out) {
+    if (out == NULL) {
+        return;
+    }
+    
+    AcquireSRWLockShared(&g_scannerStatusLock);
+    *out = g_scannerStatus;
+    ReleaseSRWLockShared(&g_scannerStatusLock);
+}
+
+// Auto-reset event signaled after each background scan - exported to
+// Python. Valid until StopBackgroundScanner(); NULL when it isn't running.
+__declspec(dllexport) HANDLE GetBackgroundScanEvent() {
+    return g_scannerScanned;
+}
+
+// Port monitor: connection history for every hub port, kept from
+// notifications and per-port rescans rather than full enumerations
+
+// Events kept per port; older ones are overwritten
+#define PORT_MONITOR_RING 32
+
+// USBPortEvent.kind
+#define USB_PORT_EVENT_STATUS       1 // ConnectionStatus changed
+#define USB_PORT_EVENT_REENUMERATED 2 // still connected, but with a new address or device
+#define USB_PORT_EVENT_HUB_LOST     3 // the hub went away; the port reads NoDeviceConnected
+
+// A connection change on a monitored port, from GetPortMonitorEvents()
+typedef struct {
+    unsigned long long time;      // FILETIME, UTC
+    int kind;                     // USB_PORT_EVENT_*
+    int previousStatus;           // USB_CONNECTION_STATUS
+    int status;
+    int deviceAddress;            // after the change, 0 without a device
+    unsigned short vendorId;
+    unsigned short productId;
+} USBPortEvent;
+
+// Counters of one monitored port, from GetPortMonitorCounters(). They
+// count events since the monitor started or ResetPortMonitorCounters().
+typedef struct {
+    char hubPath[MAX_PATH_LEN];
+    int port;
+    int hubPresent;
+    int status;                   // current USB_CONNECTION_STATUS
+    int deviceAddress;
+    unsigned short vendorId;
+    unsigned short productId;
+    int connects;                 // became DeviceConnected
+    int disconnects;              // left DeviceConnected, also with the hub
+    int reenumerations;           // USB_PORT_EVENT_REENUMERATED
+    int resets;                   // became DeviceReset or DeviceEnumerating
+    int enumerationFailures;      // became DeviceFailedEnumeration
+    int overcurrents;             // became DeviceCausedOvercurrent
+    int powerFailures;            // became DeviceNotEnoughPower
+    int otherFailures;            // any other error status
+    int queryErrors;              // connection IOCTLs that failed
+    int eventCount;               // events in the ring, at most PORT_MONITOR_RING
+    unsigned long long lastChange; // FILETIME of the latest event, 0 if none
+} USBPortCounters;
+
+// Port monitor state, from GetPortMonitorStatus()
+typedef struct {
+    int running;
+    int passCount;                // rescans since the monitor started
+    int notificationPasses;       // of those, started by notifications
+    int hubReloads;               // times the hub set was re-read
+    int hubCount;                 // hubs being monitored, absent ones included
+    int portCount;
+    long long portQueries;        // connection IOCTLs issued
+    double lastPassUs;
+} PortMonitorStatus;
+
+// One monitored port. counters.hubPath is filled in only when copied out.
+typedef struct {
+    USBPortCounters counters;
+    USBPortEvent ring[PORT_MONITOR_RING];
+    int ringNext;                 // slot the next event goes to
+    BOOL seen;                    // counters.status holds a reading
+} MonitorPort;
+
+// A hub the monitor keeps open. Hubs that go away stay listed, so a flaky
+// hub keeps its ports' history when it comes back.
+typedef struct {
+    HubEntry hub;
+    HANDLE hHub;                  // INVALID_HANDLE_VALUE unless present
+    BOOL present;                 // listed by SetupAPI and open
+    BOOL openFailed;              // listed, but wouldn't open; retried by rescans
+    volatile LONG dirty;          // re-query on the next notification pass
+    MonitorPort* ports;           // indexed by port - 1
+    int portCount;
+} MonitorHub;
+
+// One port's connection query, taken outside g_monitorLock
+typedef struct {
+    BOOL ok;
+    int status;
+    int deviceAddress;
+    unsigned short vendorId;
+    unsigned short productId;
+} MonitorReading;
+
+static HANDLE g_monitorThread = NULL;
+static HANDLE g_monitorStop = NULL;           // manual-reset, set to stop the thread
+static HANDLE g_monitorChange = NULL;         // auto-reset, set by notifications
+static HCMNOTIFICATION g_monitorHubNotify = NULL;
+static HCMNOTIFICATION g_monitorDeviceNotify = NULL;
+static volatile LONG g_monitorHubSetChanged = 0;
+static DWORD g_monitorInterval = 0;
+
+// Guards the hub list, the ports and the status. Only the monitor thread
+// changes them, so it reads the list without the lock.
+static SRWLOCK g_monitorLock = SRWLOCK_INIT;
+static MonitorHub* g_monitorHubs = NULL;
+static int g_monitorHubCount = 0;
+static PortMonitorStatus g_monitorStatus;
+
+static unsigned long long MonitorNow() {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((unsigned long long)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// Append an event to a port's ring and count it. Needs g_monitorLock.
+static void MonitorAddEvent(MonitorPort* port, int kind, const MonitorReading* reading,
+                            unsigned long long now) {
+    USBPortCounters* counters = &port->counters;
+    
+    USBPortEvent* event = &port->ring[port->ringNext];
+    event->time = now;
+    event->kind = kind;
+    event->previousStatus = counters->status;
+    event->status = reading->status;
+    event->deviceAddress = reading->deviceAddress;
+    event->vendorId = reading->vendorId;
+    event->productId = reading->productId;
+    port->ringNext = (port->ringNext + 1) % PORT_MONITOR_RING;
+    if (counters->eventCount < PORT_MONITOR_RING) {
+        counters->eventCount++;
+    }
+    counters->lastChange = now;
+    
+    if (kind == USB_PORT_EVENT_REENUMERATED) {
+        counters->reenumerations++;
+    } else {
+        if (counters->status == DeviceConnected) {
+            counters->disconnects++;
+        }
+        switch (reading->status) {
+        case NoDeviceConnected:
+            break;
+        case DeviceConnected:
+            counters->connects++;
+            break;
+        case DeviceReset:
+        case DeviceEnumerating:
+            counters->resets++;
+            break;
+        case DeviceFailedEnumeration:
+            counters->enumerationFailures++;
+            break;
+        case DeviceCausedOvercurrent:
+            counters->overcurrents++;
+            break;
+        case DeviceNotEnoughPower:
+            counters->powerFailures++;
+            break;
+        default:
+            counters->otherFailures++;
+            break;
+        }
+    }
+    
+    counters->status = reading->status;
+    counters->deviceAddress = reading->deviceAddress;
+    counters->vendorId = reading->vendorId;
+    counters->productId = reading->productId;
+}
+
+// Compare a fresh reading with what the port held before. The first
+// reading of a port is only a baseline. Needs g_monitorLock.
+static void MonitorApplyReading(MonitorPort* port, const MonitorReading* reading,
+                                unsigned long long now) {
+    USBPortCounters* counters = &port->counters;
+    
+    if (!reading->ok) {
+        counters->queryErrors++;
+        return;
+    }
+    
+    if (!port->seen) {
+        counters->status = reading->status;
+        counters->deviceAddress = reading->deviceAddress;
+        counters->vendorId = reading->vendorId;
+        counters->productId = reading->productId;
+        port->seen = TRUE;
+        return;
+    }
+    
+    if (reading->status != counters->status) {
+        MonitorAddEvent(port, USB_PORT_EVENT_STATUS, reading, now);
+    } else if (reading->status == DeviceConnected &&
+               (reading->deviceAddress != counters->deviceAddress ||
+                reading->vendorId != counters->vendorId ||
+                reading->productId != counters->productId)) {
+        MonitorAddEvent(port, USB_PORT_EVENT_REENUMERATED, reading, now);
+    }
+}
+
+// Mark every port of a hub that went away as disconnected. Needs
+// g_monitorLock.
+static void MonitorLoseHub(MonitorHub* entry, unsigned long long now) {
+    MonitorReading gone;
+    ZeroMemory(&gone, sizeof(gone));
+    gone.ok = TRUE;
+    gone.status = NoDeviceConnected;
+    
+    for (int p = 0; p < entry->portCount; p++) {
+        MonitorPort* port = &entry->ports[p];
+        if (port->seen && port->counters.status != NoDeviceConnected) {
+            MonitorAddEvent(port, USB_PORT_EVENT_HUB_LOST, &gone, now);
+        }
+    }
+    
+    if (entry->hHub != INVALID_HANDLE_VALUE) {
+        g_backend->CloseDevice(entry->hHub);
+        entry->hHub = INVALID_HANDLE_VALUE;
+    }
+    entry->present = FALSE;
+}
+
+// Open a hub that is present again and size its port table. Ports it
+// already had keep their history. Needs g_monitorLock.
+static void MonitorOpenHub(MonitorHub* entry) {
+    int numPorts;
+    entry->hHub = OpenHubNode(entry->hub.devicePath, &numPorts);
+    entry->openFailed = (entry->hHub == INVALID_HANDLE_VALUE);
+    if (entry->openFailed) {
+        return;
+    }
+    
+    if (numPorts > entry->portCount) {
+        MonitorPort* ports = (MonitorPort*)realloc(entry->ports, numPorts * sizeof(MonitorPort));
+        if (ports == NULL) {
+            // Retried by the next rescan like a failed open
+            g_backend->CloseDevice(entry->hHub);
+            entry->hHub = INVALID_HANDLE_VALUE;
+            entry->openFailed = TRUE;
+            return;
+        }
+        ZeroMemory(&ports[entry->portCount],
+                   (numPorts - entry->portCount) * sizeof(MonitorPort));
+        for (int p = entry->portCount; p < numPorts; p++) {
+            ports[p].counters.port = p + 1;
+        }
+        entry->ports = ports;
+        entry->portCount = numPorts;
+    }
+    
+    entry->present = TRUE;
+    entry->dirty = 1;
+}
+
+// Re-read the hub set. Known hubs are matched by path; new ones are
+// appended, missing ones are kept as absent. Returns FALSE if the hubs
+// couldn't be read.
+static BOOL MonitorReloadHubs() {
+    HubEntry* found;
+    int foundCount = QueryHubs(&found);
+    if (foundCount < 0) {
+        return FALSE;
+    }
+    
+    unsigned long long now = MonitorNow();
+    
+    AcquireSRWLockExclusive(&g_monitorLock);
+    MonitorHub* hubs = (MonitorHub*)realloc(g_monitorHubs,
+                            (g_monitorHubCount + foundCount + 1) * sizeof(MonitorHub));
+    if (hubs == NULL) {
+        ReleaseSRWLockExclusive(&g_monitorLock);
+        free(found);
+        return FALSE;
+    }
+    g_monitorHubs = hubs;
+    
+    int knownCount = g_monitorHubCount;
+    BOOL* matched = (BOOL*)calloc(knownCount + 1, sizeof(BOOL));
+    
+    for (int i = 0; i < foundCount; i++) {
+        int h = 0;
+        while (h < knownCount && _stricmp(hubs[h].hub.devicePath, found[i].devicePath) != 0) {
+            h++;
+        }
+        
+        if (h == knownCount) {
+            h = g_monitorHubCount++;
+            ZeroMemory(&hubs[h], sizeof(MonitorHub));
+            hubs[h].hHub = INVALID_HANDLE_VALUE;
+        } else if (matched != NULL) {
+            matched[h] = TRUE;
+        }
+        
+        // devInst is renewed when a hub is re-plugged
+        hubs[h].hub = found[i];
+        if (!hubs[h].present) {
+            MonitorOpenHub(&hubs[h]);
+        }
+    }
+    
+    for (int h = 0; h < knownCount; h++) {
+        if (matched != NULL && !matched[h]) {
+            hubs[h].openFailed = FALSE;
+            if (hubs[h].present) {
+                MonitorLoseHub(&hubs[h], now);
+            }
+        }
+    }
+    
+    g_monitorStatus.hubReloads++;
+    g_monitorStatus.hubCount = g_monitorHubCount;
+    g_monitorStatus.portCount = 0;
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        g_monitorStatus.portCount += hubs[h].portCount;
+    }
+    ReleaseSRWLockExclusive(&g_monitorLock);
+    
+    free(matched);
+    free(found);
+    return TRUE;
+}
+
+// Query every port of one hub and fold the readings into its ports.
+// Returns FALSE if the hub has disappeared, after marking it lost.
+static BOOL MonitorQueryHub(MonitorHub* entry, MonitorReading* readings, long long* queries) {
+    BOOL gone = FALSE;
+    
+    for (int p = 0; p < entry->portCount; p++) {
+        MonitorReading* reading = &readings[p];
+        USB_NODE_CONNECTION_INFORMATION_EX connInfo;
+        ZeroMemory(&connInfo, sizeof(connInfo));
+        ZeroMemory(reading, sizeof(*reading));
+        
+        ETW_IOCTL_START(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                        entry->hub.devicePath, p + 1);
+        reading->ok = GetPortConnectorProperties(entry->hHub, p + 1, &connInfo);
+        DWORD error = reading->ok ? ERROR_SUCCESS : GetLastError();
+        ETW_IOCTL_STOP(IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX,
+                       entry->hub.devicePath, p + 1, error);
+        (*queries)++;
+        
+        if (!reading->ok) {
+            if (IsDeviceGoneError(error)) {
+                gone = TRUE;
+                break;
+            }
+            continue;
+        }
+        
+        reading->status = connInfo.ConnectionStatus;
+        if (connInfo.ConnectionStatus == DeviceConnected) {
+            reading->deviceAddress = connInfo.DeviceAddress;
+            reading->vendorId = connInfo.DeviceDescriptor.idVendor;
+            reading->productId = connInfo.DeviceDescriptor.idProduct;
+        }
+    }
+    
+    unsigned long long now = MonitorNow();
+    
+    AcquireSRWLockExclusive(&g_monitorLock);
+    if (gone) {
+        MonitorLoseHub(entry, now);
+    } else {
+        for (int p = 0; p < entry->portCount; p++) {
+            MonitorApplyReading(&entry->ports[p], &readings[p], now);
+        }
+    }
+    ReleaseSRWLockExclusive(&g_monitorLock);
+    return !gone;
+}
+
+// One monitor pass: re-read the hub set if it changed, then query every
+// present hub, or with dirtyOnly just those notifications pointed at.
+// Every pass also re-reads it while a listed hub wouldn't open.
+static void MonitorPass(BOOL dirtyOnly) {
+    LONGLONG start = QpcNow();
+    long long queries = 0;
+    
+    BOOL reload = InterlockedExchange(&g_monitorHubSetChanged, 0);
+    for (int h = 0; !reload && h < g_monitorHubCount; h++) {
+        reload = g_monitorHubs[h].openFailed;
+    }
+    if (reload) {
+        MonitorReloadHubs();
+    }
+    
+    int maxPorts = 0;
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        if (g_monitorHubs[h].portCount > maxPorts) {
+            maxPorts = g_monitorHubs[h].portCount;
+        }
+    }
+    MonitorReading* readings = (MonitorReading*)malloc((maxPorts ? maxPorts : 1) *
+                                                       sizeof(MonitorReading));
+    
+    for (int h = 0; readings != NULL && h < g_monitorHubCount; h++) {
+        MonitorHub* entry = &g_monitorHubs[h];
+        BOOL dirty = InterlockedExchange(&entry->dirty, 0);
+        if (!entry->present || entry->hHub == INVALID_HANDLE_VALUE || (dirtyOnly && !dirty)) {
+            continue;
+        }
+        
+        // Lost now; the next pass re-reads the hub set in case it came
+        // back under the same path before its notification
+        if (!MonitorQueryHub(entry, readings, &queries)) {
+            InterlockedExchange(&g_monitorHubSetChanged, 1);
+        }
+    }
+    free(readings);
+    
+    AcquireSRWLockExclusive(&g_monitorLock);
+    g_monitorStatus.passCount++;
+    if (dirtyOnly) {
+        g_monitorStatus.notificationPasses++;
+    }
+    g_monitorStatus.portQueries += queries;
+    g_monitorStatus.lastPassUs = QpcMicros(start, QpcNow());
+    ReleaseSRWLockExclusive(&g_monitorLock);
+}
+
+// Hub interface notification for the monitor: re-read the hub set
+static DWORD CALLBACK MonitorHubNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                           CM_NOTIFY_ACTION action,
+                                           PCM_NOTIFY_EVENT_DATA eventData,
+                                           DWORD eventDataSize) {
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ||
+        action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        InterlockedExchange(&g_monitorHubSetChanged, 1);
+        SetEvent(g_monitorChange);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Device interface notification for the monitor: re-query the device's
+// parent hub, or the whole hub set if the parent isn't known
+static DWORD CALLBACK MonitorDeviceNotifyProc(HCMNOTIFICATION hNotify, PVOID context,
+                                              CM_NOTIFY_ACTION action,
+                                              PCM_NOTIFY_EVENT_DATA eventData,
+                                              DWORD eventDataSize) {
+    if (action != CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL &&
+        action != CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+        return ERROR_SUCCESS;
+    }
+    
+    WCHAR instanceId[MAX_DEVICE_ID_LEN];
+    DEVINST devInst;
+    DEVINST parentInst;
+    BOOL found = FALSE;
+    
+    if (InstanceIdFromInterfacePath(eventData->u.DeviceInterface.SymbolicLink,
+                                    instanceId, MAX_DEVICE_ID_LEN) &&
+        CM_Locate_DevNodeW(&devInst, instanceId, CM_LOCATE_DEVNODE_PHANTOM) == CR_SUCCESS &&
+        CM_Get_Parent(&parentInst, devInst, 0) == CR_SUCCESS) {
+        AcquireSRWLockShared(&g_monitorLock);
+        for (int i = 0; i < g_monitorHubCount; i++) {
+            if (g_monitorHubs[i].present && g_monitorHubs[i].hub.devInst == parentInst) {
+                InterlockedExchange(&g_monitorHubs[i].dirty, 1);
+                found = TRUE;
+                break;
+            }
+        }
+        ReleaseSRWLockShared(&g_monitorLock);
+    }
+    
+    // Without the parent, re-query every hub so the change isn't missed
+    if (!found) {
+        AcquireSRWLockShared(&g_monitorLock);
+        for (int i = 0; i < g_monitorHubCount; i++) {
+            if (g_monitorHubs[i].present) {
+                InterlockedExchange(&g_monitorHubs[i].dirty, 1);
+            }
+        }
+        ReleaseSRWLockShared(&g_monitorLock);
+        InterlockedExchange(&g_monitorHubSetChanged, 1);
+    }
+    SetEvent(g_monitorChange);
+    return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI MonitorThreadProc(LPVOID param) {
+    HANDLE waits[2] = { g_monitorStop, g_monitorChange };
+    DWORD interval = g_monitorInterval ? g_monitorInterval : INFINITE;
+    
+    for (;;) {
+        DWORD result = WaitForMultipleObjects(2, waits, FALSE, interval);
+        if (result == WAIT_OBJECT_0) {
+            break;
+        }
+        MonitorPass(result == WAIT_OBJECT_0 + 1);
+    }
+    return 0;
+}
+
+// Stop the port monitor - exported to Python.
+// The counters and events are dropped with it.
+__declspec(dllexport) void StopPortMonitor() {
+    // Unregistering waits for in-flight callbacks, so nothing signals after this
+    if (g_monitorHubNotify != NULL) {
+        CM_Unregister_Notification(g_monitorHubNotify);
+        g_monitorHubNotify = NULL;
+    }
+    if (g_monitorDeviceNotify != NULL) {
+        CM_Unregister_Notification(g_monitorDeviceNotify);
+        g_monitorDeviceNotify = NULL;
+    }
+    
+    if (g_monitorThread != NULL) {
+        SetEvent(g_monitorStop);
+        WaitForSingleObject(g_monitorThread, INFINITE);
+        CloseHandle(g_monitorThread);
+        g_monitorThread = NULL;
+    }
+    
+    if (g_monitorStop != NULL) {
+        CloseHandle(g_monitorStop);
+        g_monitorStop = NULL;
+    }
+    if (g_monitorChange != NULL) {
+        CloseHandle(g_monitorChange);
+        g_monitorChange = NULL;
+    }
+    
+    AcquireSRWLockExclusive(&g_monitorLock);
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        if (g_monitorHubs[h].hHub != INVALID_HANDLE_VALUE) {
+            g_backend->CloseDevice(g_monitorHubs[h].hHub);
+        }
+        free(g_monitorHubs[h].ports);
+    }
+    free(g_monitorHubs);
+    g_monitorHubs = NULL;
+    g_monitorHubCount = 0;
+    ZeroMemory(&g_monitorStatus, sizeof(g_monitorStatus));
+    ReleaseSRWLockExclusive(&g_monitorLock);
+    
+    g_monitorHubSetChanged = 0;
+}
+
+// Start the port monitor - exported to Python.
+// Hub handles stay open, and each pass issues one connection IOCTL per
+// port, recording status changes in a ring buffer per port. Device
+// arrivals and removals re-query just their hub. A rescan of every hub
+// every intervalMs (0 = only on notifications) catches what raises no
+// notification, like overcurrent or a failed enumeration. The monitor
+// takes its baseline before returning. One monitor per process. Returns 1
+// on success, 0 on failure.
+__declspec(dllexport) int StartPortMonitor(int intervalMs) {
+    if (g_monitorThread != NULL) {
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return 0;
+    }
+    if (intervalMs < 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+    
+    g_monitorInterval = (DWORD)intervalMs;
+    g_monitorStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    g_monitorChange = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (g_monitorStop == NULL || g_monitorChange == NULL) {
+        StopPortMonitor();
+        return 0;
+    }
+    
+    // Registered before the baseline, so no change can slip in between
+    CM_NOTIFY_FILTER filter;
+    ZeroMemory(&filter, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_USB_HUB;
+    
+    if (CM_Register_Notification(&filter, NULL, MonitorHubNotifyProc,
+                                 &g_monitorHubNotify) != CR_SUCCESS) {
+        g_monitorHubNotify = NULL;
+    }
+    
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_USB_DEVICE;
+    if (CM_Register_Notification(&filter, NULL, MonitorDeviceNotifyProc,
+                                 &g_monitorDeviceNotify) != CR_SUCCESS) {
+        g_monitorDeviceNotify = NULL;
+    }
+    
+    if (!MonitorReloadHubs()) {
+        StopPortMonitor();
+        return 0;
+    }
+    MonitorPass(FALSE);
+    
+    AcquireSRWLockExclusive(&g_monitorLock);
+    g_monitorStatus.running = 1;
+    ReleaseSRWLockExclusive(&g_monitorLock);
+    
+    g_monitorThread = CreateThread(NULL, 0, MonitorThreadProc, NULL, 0, NULL);
+    if (g_monitorThread == NULL) {
+        StopPortMonitor();
+        return 0;
+    }
+    return 1;
+}
+
+// Copy the port monitor's own counters - exported to Python
+__declspec(dllexport) void GetPortMonitorStatus(PortMonitorStatus* out) {
+    if (out == NULL) {
+        return;
+    }
+    
+    AcquireSRWLockShared(&g_monitorLock);
+    *out = g_monitorStatus;
+    ReleaseSRWLockShared(&g_monitorLock);
+}
+
+// Copy the counters of every monitored port - exported to Python.
+// Ports are grouped by hub in the order the monitor found the hubs.
+// Writes at most capacity entries and returns the port count.
+__declspec(dllexport) int GetPortMonitorCounters(USBPortCounters* out, int capacity) {
+    int count = 0;
+    
+    AcquireSRWLockShared(&g_monitorLock);
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        const MonitorHub* entry = &g_monitorHubs[h];
+        for (int p = 0; p < entry->portCount; p++) {
+            if (out != NULL && count < capacity) {
+                out[count] = entry->ports[p].counters;
+                strncpy(out[count].hubPath, entry->hub.devicePath, MAX_PATH_LEN - 1);
+                out[count].hubPresent = entry->present;
+            }
+            count++;
+        }
+    }
+    ReleaseSRWLockShared(&g_monitorLock);
+    
+    return count;
+}
+
+// Copy a port's recent events, oldest first - exported to Python.
+// Writes at most capacity entries and returns how many the ring holds, or
+// -1 if the port isn't monitored.
+__declspec(dllexport) int GetPortMonitorEvents(const char* hubPath, int port,
+                                               USBPortEvent* out, int capacity) {
+    int count = -1;
+    
+    if (hubPath == NULL) {
+        return -1;
+    }
+    
+    AcquireSRWLockShared(&g_monitorLock);
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        const MonitorHub* entry = &g_monitorHubs[h];
+        if (port < 1 || port > entry->portCount ||
+            _stricmp(entry->hub.devicePath, hubPath) != 0) {
+            continue;
+        }
+        
+        const MonitorPort* monitored = &entry->ports[port - 1];
+        count = monitored->counters.eventCount;
+        int first = (monitored->ringNext - count + PORT_MONITOR_RING) % PORT_MONITOR_RING;
+        for (int i = 0; out != NULL && i < count && i < capacity; i++) {
+            out[i] = monitored->ring[(first + i) % PORT_MONITOR_RING];
+        }
+        break;
+    }
+    ReleaseSRWLockShared(&g_monitorLock);
+    
+    return count;
+}
+
+// Zero every port's counters and events - exported to Python.
+// Current statuses are kept, so the next change is still caught.
+__declspec(dllexport) void ResetPortMonitorCounters() {
+    AcquireSRWLockExclusive(&g_monitorLock);
+    for (int h = 0; h < g_monitorHubCount; h++) {
+        const MonitorHub* entry = &g_monitorHubs[h];
+        for (int p = 0; p < entry->portCount; p++) {
+            MonitorPort* monitored = &entry->ports[p];
+            USBPortCounters* counters = &monitored->counters;
+            
+            counters->connects = 0;
+            counters->disconnects = 0;
+            counters->reenumerations = 0;
+            counters->resets = 0;
+            counters->enumerationFailures = 0;
+            counters->overcurrents = 0;
+            counters->powerFailures = 0;
+            counters->otherFailures = 0;
+            counters->queryErrors = 0;
+            counters->eventCount = 0;
+            counters->lastChange = 0;
+            monitored->ringNext = 0;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_monitorLock);
+}
+
+#ifdef USB_MAPPER_ETW
+// Register the provider for as long as the DLL is loaded. It has to be
+// unregistered before unload so ETW never calls into unmapped code.
+BOOL WINAPI DllMain(HINSTANCE instance, DWORD reason, LPVOID reserved) {
+    if (reason == DLL_PROCESS_ATTACH) {
+        TraceLoggingRegister(g_etwProvider);
+    } else if (reason == DLL_PROCESS_DETACH) {
+        TraceLoggingUnregister(g_etwProvider);
+    }
+    return TRUE;
+}
+#endif
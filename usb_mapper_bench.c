@@ -0,0 +1,622 @@
+// Enumeration benchmark for usb_mapper.c - run with "make bench"
+//
+// The mapper is compiled straight into this program and its Win32 backend
+// is swapped for a synthetic topology: N hubs with M ports each, with
+// injected latencies for hub discovery, CreateFile and every IOCTL. That
+// makes scans repeatable on any machine, so the serial, parallel,
+// overlapped, bounded and session paths can be compared and tracked for
+// regressions without a real hub rig.
+//
+// Like a real hub, a mock hub answers one control request at a time, so
+// overlapped I/O only overlaps requests to different hubs.
+
+#include "usb_mapper.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+#define MOCK_MAX_PORTS 255
+#define MOCK_PATH_PREFIX "\\\\?\\usb#mockhub#"
+
+// Synthetic topology and latency settings
+typedef struct {
+    int hubCount;
+    int portCount;                // per hub
+    int fanout;                   // child hubs per hub, on its first ports
+    int fillPercent;              // share of remaining ports with a device
+    int enumUs;                   // SetupDi cost per hub
+    int openUs;                   // CreateFile
+    int ioctlUs;                  // every DeviceIoControl
+} MockConfig;
+
+typedef struct {
+    char path[MAX_PATH_LEN];
+    char driverKey[64];
+    int* childHub;                // per port (1-based), -1 if none
+    unsigned char* hasDevice;     // per port (1-based)
+    SRWLOCK busy;                 // one control request at a time
+} MockHub;
+
+typedef struct MockRequest {
+    struct MockRequest* next;
+    LPOVERLAPPED overlapped;
+    DWORD ioctl;
+    LPVOID buffer;
+    DWORD bufferSize;
+} MockRequest;
+
+// An open hub handle. Once bound to a completion port, overlapped requests
+// are queued to a worker thread that completes them in order.
+typedef struct {
+    MockHub* hub;
+    HANDLE iocp;
+    ULONG_PTR key;
+    HANDLE worker;
+    SRWLOCK lock;
+    CONDITION_VARIABLE ready;
+    MockRequest* head;
+    MockRequest* tail;
+    BOOL closing;
+} MockHandle;
+
+static MockConfig g_mockConfig;
+static MockHub* g_mockHubs;
+static int g_mockExpectedDevices;
+
+// Block for about us microseconds without spinning, so worker threads
+// behave like threads waiting on hardware
+static void MockDelay(int us) {
+    if (us <= 0) {
+        return;
+    }
+    
+    HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                          TIMER_ALL_ACCESS);
+    if (timer == NULL) {
+        // Before Windows 10 1803; the default timer rounds up to a tick
+        timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+    if (timer == NULL) {
+        Sleep((us + 999) / 1000);
+        return;
+    }
+    
+    LARGE_INTEGER due;
+    due.QuadPart = -10LL * us;    // relative, in 100 ns units
+    if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+        WaitForSingleObject(timer, INFINITE);
+    }
+    CloseHandle(timer);
+}
+
+// Build the hub tree: hub h > 0 hangs off port (h - 1) % fanout + 1 of hub
+// (h - 1) / fanout. With fanout 0 every hub is a root hub.
+static BOOL BuildMockTopology(const MockConfig* config) {
+    g_mockConfig = *config;
+    g_mockExpectedDevices = 0;
+    g_mockHubs = (MockHub*)calloc(config->hubCount, sizeof(MockHub));
+    if (g_mockHubs == NULL) {
+        return FALSE;
+    }
+    
+    for (int h = 0; h < config->hubCount; h++) {
+        MockHub* hub = &g_mockHubs[h];
+        snprintf(hub->path, sizeof(hub->path),
+                 MOCK_PATH_PREFIX "%d#{f18a0e88-c30c-11d0-8815-00a0c906bed8}", h);
+        snprintf(hub->driverKey, sizeof(hub->driverKey),
+                 "{36fc9e60-c465-11cf-8056-444553540000}\\%04d", h);
+        hub->childHub = (int*)malloc((config->portCount + 1) * sizeof(int));
+        hub->hasDevice = (unsigned char*)calloc(config->portCount + 1, 1);
+        if (hub->childHub == NULL || hub->hasDevice == NULL) {
+            return FALSE;
+        }
+        for (int port = 0; port <= config->portCount; port++) {
+            hub->childHub[port] = -1;
+        }
+        InitializeSRWLock(&hub->busy);
+    }
+    
+    for (int h = 1; h < config->hubCount && config->fanout > 0; h++) {
+        MockHub* parent = &g_mockHubs[(h - 1) / config->fanout];
+        parent->childHub[(h - 1) % config->fanout + 1] = h;
+        g_mockExpectedDevices++;
+    }
+    
+    // Spread devices evenly over the ports that have no child hub
+    unsigned int slot = 0;
+    for (int h = 0; h < config->hubCount; h++) {
+        for (int port = 1; port <= config->portCount; port++) {
+            if (g_mockHubs[h].childHub[port] >= 0) {
+                continue;
+            }
+            if ((slot++ * config->fillPercent) % 100 + config->fillPercent >= 100) {
+                g_mockHubs[h].hasDevice[port] = 1;
+                g_mockExpectedDevices++;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static void FreeMockTopology(void) {
+    for (int h = 0; g_mockHubs != NULL && h < g_mockConfig.hubCount; h++) {
+        free(g_mockHubs[h].childHub);
+        free(g_mockHubs[h].hasDevice);
+    }
+    free(g_mockHubs);
+    g_mockHubs = NULL;
+}
+
+// Answer one hub IOCTL, holding the hub for the injected latency
+static BOOL MockExecute(MockHub* hub, DWORD ioctl, LPVOID buffer, DWORD bufferSize,
+                        DWORD* bytesReturned) {
+    BOOL ok = TRUE;
+    DWORD error = ERROR_SUCCESS;
+    
+    AcquireSRWLockExclusive(&hub->busy);
+    MockDelay(g_mockConfig.ioctlUs);
+    *bytesReturned = 0;
+    
+    if (ioctl == IOCTL_USB_GET_NODE_INFORMATION &&
+        bufferSize >= sizeof(USB_NODE_INFORMATION)) {
+        PUSB_NODE_INFORMATION nodeInfo = (PUSB_NODE_INFORMATION)buffer;
+        ZeroMemory(nodeInfo, sizeof(USB_NODE_INFORMATION));
+        nodeInfo->NodeType = UsbHub;
+        nodeInfo->u.HubInformation.HubDescriptor.bNumberOfPorts =
+            (UCHAR)g_mockConfig.portCount;
+        *bytesReturned = sizeof(USB_NODE_INFORMATION);
+    } else if (ioctl == IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX &&
+               bufferSize >= sizeof(USB_NODE_CONNECTION_INFORMATION_EX)) {
+        PUSB_NODE_CONNECTION_INFORMATION_EX connInfo =
+            (PUSB_NODE_CONNECTION_INFORMATION_EX)buffer;
+        ULONG port = connInfo->ConnectionIndex;
+        
+        if (port < 1 || port > (ULONG)g_mockConfig.portCount) {
+            ok = FALSE;
+            error = ERROR_INVALID_PARAMETER;
+        } else {
+            ZeroMemory(connInfo, sizeof(USB_NODE_CONNECTION_INFORMATION_EX));
+            connInfo->ConnectionIndex = port;
+            connInfo->ConnectionStatus = NoDeviceConnected;
+            if (hub->childHub[port] >= 0) {
+                connInfo->ConnectionStatus = DeviceConnected;
+                connInfo->DeviceIsHub = TRUE;
+                connInfo->Speed = UsbHighSpeed;
+                connInfo->DeviceDescriptor.idVendor = 0x05E3;
+                connInfo->DeviceDescriptor.idProduct = 0x0610;
+            } else if (hub->hasDevice[port]) {
+                connInfo->ConnectionStatus = DeviceConnected;
+                connInfo->Speed = UsbHighSpeed;
+                connInfo->DeviceDescriptor.idVendor = 0x1209;
+                connInfo->DeviceDescriptor.idProduct = (USHORT)port;
+            }
+            *bytesReturned = sizeof(USB_NODE_CONNECTION_INFORMATION_EX);
+        }
+    } else if (ioctl == IOCTL_USB_GET_NODE_CONNECTION_DRIVERKEY_NAME &&
+               bufferSize > sizeof(USB_NODE_CONNECTION_DRIVERKEY_NAME)) {
+        PUSB_NODE_CONNECTION_DRIVERKEY_NAME keyName =
+            (PUSB_NODE_CONNECTION_DRIVERKEY_NAME)buffer;
+        ULONG port = keyName->ConnectionIndex;
+        
+        if (port < 1 || port > (ULONG)g_mockConfig.portCount || hub->childHub[port] < 0) {
+            ok = FALSE;
+            error = ERROR_INVALID_PARAMETER;
+        } else {
+            DWORD nameChars = (bufferSize - offsetof(USB_NODE_CONNECTION_DRIVERKEY_NAME,
+                                                     DriverKeyName)) / sizeof(WCHAR);
+            int written = MultiByteToWideChar(CP_ACP, 0,
+                                              g_mockHubs[hub->childHub[port]].driverKey, -1,
+                                              keyName->DriverKeyName, (int)nameChars);
+            keyName->ActualLength = offsetof(USB_NODE_CONNECTION_DRIVERKEY_NAME,
+                                             DriverKeyName) + written * sizeof(WCHAR);
+            *bytesReturned = bufferSize;
+        }
+    } else {
+        ok = FALSE;
+        error = ERROR_INVALID_FUNCTION;
+    }
+    
+    ReleaseSRWLockExclusive(&hub->busy);
+    
+    if (!ok) {
+        SetLastError(error);
+    }
+    return ok;
+}
+
+static DWORD WINAPI MockWorkerProc(LPVOID param) {
+    MockHandle* handle = (MockHandle*)param;
+    
+    for (;;) {
+        AcquireSRWLockExclusive(&handle->lock);
+        while (handle->head == NULL && !handle->closing) {
+            SleepConditionVariableSRW(&handle->ready, &handle->lock, INFINITE, 0);
+        }
+        MockRequest* request = handle->head;
+        if (request != NULL) {
+            handle->head = request->next;
+            if (handle->head == NULL) {
+                handle->tail = NULL;
+            }
+        }
+        ReleaseSRWLockExclusive(&handle->lock);
+        
+        // Closing only stops the worker once its queue is drained
+        if (request == NULL) {
+            return 0;
+        }
+        
+        DWORD bytesReturned;
+        BOOL ok = MockExecute(handle->hub, request->ioctl, request->buffer,
+                              request->bufferSize, &bytesReturned);
+        request->overlapped->Internal = ok ? ERROR_SUCCESS : GetLastError();
+        request->overlapped->InternalHigh = bytesReturned;
+        PostQueuedCompletionStatus(handle->iocp, bytesReturned, handle->key,
+                                   request->overlapped);
+        free(request);
+    }
+}
+
+static HDEVINFO MockGetClassDevs(const GUID* classGuid, DWORD flags) {
+    return (HDEVINFO)&g_mockHubs;
+}
+
+static BOOL MockEnumDeviceInterfaces(HDEVINFO deviceInfoSet, const GUID* classGuid,
+                                     DWORD memberIndex,
+                                     PSP_DEVICE_INTERFACE_DATA interfaceData) {
+    if (memberIndex >= (DWORD)g_mockConfig.hubCount) {
+        SetLastError(ERROR_NO_MORE_ITEMS);
+        return FALSE;
+    }
+    
+    MockDelay(g_mockConfig.enumUs);
+    interfaceData->Reserved = memberIndex;
+    return TRUE;
+}
+
+static BOOL MockGetDeviceInterfaceDetail(HDEVINFO deviceInfoSet,
+                                         PSP_DEVICE_INTERFACE_DATA interfaceData,
+                                         PSP_DEVICE_INTERFACE_DETAIL_DATA_W detail,
+                                         DWORD detailSize, PDWORD requiredSize,
+                                         PSP_DEVINFO_DATA deviceInfoData) {
+    const MockHub* hub = &g_mockHubs[interfaceData->Reserved];
+    DWORD needed = (DWORD)(offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA_W, DevicePath) +
+                           (strlen(hub->path) + 1) * sizeof(WCHAR));
+    
+    if (requiredSize != NULL) {
+        *requiredSize = needed;
+    }
+    if (detail == NULL || detailSize < needed) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    
+    MultiByteToWideChar(CP_UTF8, 0, hub->path, -1, detail->DevicePath,
+                        (int)strlen(hub->path) + 1);
+    if (deviceInfoData != NULL) {
+        deviceInfoData->DevInst = (DWORD)interfaceData->Reserved + 1;
+        deviceInfoData->Reserved = interfaceData->Reserved;
+    }
+    return TRUE;
+}
+
+static BOOL MockGetDeviceRegistryProperty(HDEVINFO deviceInfoSet,
+                                          PSP_DEVINFO_DATA deviceInfoData,
+                                          DWORD property, PBYTE buffer, DWORD bufferSize) {
+    int h = (int)deviceInfoData->Reserved;
+    const MockHub* hub = &g_mockHubs[h];
+    char value[MAX_PATH_LEN];
+    
+    switch (property) {
+        case SPDRP_DEVICEDESC:
+            snprintf(value, sizeof(value), "Mock USB Hub %d", h);
+            break;
+        case SPDRP_DRIVER:
+            snprintf(value, sizeof(value), "%s", hub->driverKey);
+            break;
+        case SPDRP_LOCATION_INFORMATION:
+            snprintf(value, sizeof(value), "Port_#%04d.Hub_#%04d", h, h + 1);
+            break;
+        case SPDRP_LOCATION_PATHS:
+            snprintf(value, sizeof(value), "PCIROOT(0)#PCI(1400)#USBROOT(%d)", h);
+            break;
+        default:
+            SetLastError(ERROR_INVALID_DATA);
+            return FALSE;
+    }
+    
+    // Registry strings come back as UTF-16, like SetupDiGetDeviceRegistryPropertyW
+    if (MultiByteToWideChar(CP_UTF8, 0, value, -1, (WCHAR*)buffer,
+                            (int)(bufferSize / sizeof(WCHAR))) == 0) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL MockDestroyDeviceInfoList(HDEVINFO deviceInfoSet) {
+    return TRUE;
+}
+
+static HANDLE MockOpenDevice(const char* devicePath, DWORD flags) {
+    int h;
+    
+    MockDelay(g_mockConfig.openUs);
+    if (sscanf(devicePath, MOCK_PATH_PREFIX "%d", &h) != 1 ||
+        h < 0 || h >= g_mockConfig.hubCount) {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+    
+    MockHandle* handle = (MockHandle*)calloc(1, sizeof(MockHandle));
+    if (handle == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    handle->hub = &g_mockHubs[h];
+    InitializeSRWLock(&handle->lock);
+    InitializeConditionVariable(&handle->ready);
+    return (HANDLE)handle;
+}
+
+// Requests complete inline unless they are overlapped on a handle bound to
+// a completion port. An event with its low bit set opts out of the port,
+// as it does for real handles.
+static BOOL MockIoControl(HANDLE hDevice, DWORD ioctl, LPVOID buffer, DWORD bufferSize,
+                          LPDWORD bytesReturned, LPOVERLAPPED overlapped) {
+    MockHandle* handle = (MockHandle*)hDevice;
+    
+    if (overlapped == NULL || handle->iocp == NULL ||
+        ((ULONG_PTR)overlapped->hEvent & 1) != 0) {
+        DWORD returned;
+        BOOL ok = MockExecute(handle->hub, ioctl, buffer, bufferSize, &returned);
+        if (bytesReturned != NULL) {
+            *bytesReturned = returned;
+        }
+        if (overlapped != NULL) {
+            overlapped->Internal = ok ? ERROR_SUCCESS : GetLastError();
+            overlapped->InternalHigh = returned;
+        }
+        return ok;
+    }
+    
+    MockRequest* request = (MockRequest*)calloc(1, sizeof(MockRequest));
+    if (request == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    request->overlapped = overlapped;
+    request->ioctl = ioctl;
+    request->buffer = buffer;
+    request->bufferSize = bufferSize;
+    
+    AcquireSRWLockExclusive(&handle->lock);
+    if (handle->tail != NULL) {
+        handle->tail->next = request;
+    } else {
+        handle->head = request;
+    }
+    handle->tail = request;
+    ReleaseSRWLockExclusive(&handle->lock);
+    WakeConditionVariable(&handle->ready);
+    
+    SetLastError(ERROR_IO_PENDING);
+    return FALSE;
+}
+
+static BOOL MockGetOverlappedResult(HANDLE hDevice, LPOVERLAPPED overlapped,
+                                    LPDWORD bytesReturned, BOOL wait) {
+    *bytesReturned = (DWORD)overlapped->InternalHigh;
+    if (overlapped->Internal != ERROR_SUCCESS) {
+        SetLastError((DWORD)overlapped->Internal);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL MockBindCompletionPort(HANDLE hDevice, HANDLE iocp, ULONG_PTR key) {
+    MockHandle* handle = (MockHandle*)hDevice;
+    
+    handle->iocp = iocp;
+    handle->key = key;
+    handle->worker = CreateThread(NULL, 0, MockWorkerProc, handle, 0, NULL);
+    return handle->worker != NULL;
+}
+
+// Queued requests always complete; there is nothing to cancel
+static BOOL MockCancelIo(HANDLE hDevice) {
+    SetLastError(ERROR_NOT_FOUND);
+    return FALSE;
+}
+
+static BOOL MockCloseDevice(HANDLE hDevice) {
+    MockHandle* handle = (MockHandle*)hDevice;
+    
+    if (handle->worker != NULL) {
+        AcquireSRWLockExclusive(&handle->lock);
+        handle->closing = TRUE;
+        ReleaseSRWLockExclusive(&handle->lock);
+        WakeConditionVariable(&handle->ready);
+        WaitForSingleObject(handle->worker, INFINITE);
+        CloseHandle(handle->worker);
+    }
+    free(handle);
+    return TRUE;
+}
+
+static const UsbBackend g_mockBackend = {
+    MockGetClassDevs,
+    MockEnumDeviceInterfaces,
+    MockGetDeviceInterfaceDetail,
+    MockGetDeviceRegistryProperty,
+    MockDestroyDeviceInfoList,
+    MockOpenDevice,
+    MockIoControl,
+    MockGetOverlappedResult,
+    MockBindCompletionPort,
+    MockCancelIo,
+    MockCloseDevice
+};
+
+// Session refreshes with nothing plugged or unplugged in between
+#define BENCH_MODE_CACHED 5
+
+static int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Time iterations scans of one mode into a fresh context. Session scans
+// re-query every hub; BENCH_MODE_CACHED lets a session reuse them, as it
+// would with no device notifications in between. Returns FALSE if any scan
+// failed or found the wrong number of devices.
+static BOOL BenchMode(int mode, int workers, int iterations, double* times) {
+    MapperContext* ctx = CreateMapperContext();
+    TopologySession* session = NULL;
+    BOOL ok = (ctx != NULL);
+    
+    if (ok && (mode == ENUM_MODE_SESSION || mode == BENCH_MODE_CACHED)) {
+        session = OpenTopologySessionInContext(ctx);
+        ok = (session != NULL);
+    }
+    
+    for (int i = 0; ok && i < iterations; i++) {
+        if (mode == ENUM_MODE_SESSION) {
+            InvalidateTopologySession(session);
+        }
+        
+        LONGLONG start = QpcNow();
+        int count = (session != NULL) ? RefreshTopology(session) :
+                                        EnumerateUSBDevicesInContext(ctx, mode, workers);
+        times[i] = QpcMicros(start, QpcNow()) / 1000.0;
+        
+        if (count != g_mockExpectedDevices) {
+            fprintf(stderr, "mode %d: found %d devices, expected %d\n",
+                    mode, count, g_mockExpectedDevices);
+            ok = FALSE;
+        }
+    }
+    
+    CloseTopologySession(session);
+    DestroyMapperContext(ctx);
+    return ok;
+}
+
+static void PrintUsage(void) {
+    printf("usage: usb_mapper_bench [options]\n"
+           "  --hubs N        hubs in the synthetic topology (40)\n"
+           "  --ports M       ports per hub (8)\n"
+           "  --fanout F      child hubs per hub, 0 for all root hubs (2)\n"
+           "  --fill P        percent of free ports with a device (50)\n"
+           "  --enum-us T     SetupDi latency per hub (50)\n"
+           "  --open-us T     CreateFile latency (500)\n"
+           "  --ioctl-us T    DeviceIoControl latency (200)\n"
+           "  --workers W     threads for the parallel mode, 0 = CPU count (0)\n"
+           "  --iterations K  scans per mode (10)\n"
+           "  --sweep         also run 1, 2, 4, ... hubs up to --hubs\n");
+}
+
+int main(int argc, char** argv) {
+    MockConfig config = { 40, 8, 2, 50, 50, 500, 200 };
+    int workers = 0;
+    int iterations = 10;
+    BOOL sweep = FALSE;
+    
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        int* target = NULL;
+        
+        if (strcmp(arg, "--hubs") == 0) target = &config.hubCount;
+        else if (strcmp(arg, "--ports") == 0) target = &config.portCount;
+        else if (strcmp(arg, "--fanout") == 0) target = &config.fanout;
+        else if (strcmp(arg, "--fill") == 0) target = &config.fillPercent;
+        else if (strcmp(arg, "--enum-us") == 0) target = &config.enumUs;
+        else if (strcmp(arg, "--open-us") == 0) target = &config.openUs;
+        else if (strcmp(arg, "--ioctl-us") == 0) target = &config.ioctlUs;
+        else if (strcmp(arg, "--workers") == 0) target = &workers;
+        else if (strcmp(arg, "--iterations") == 0) target = &iterations;
+        else if (strcmp(arg, "--sweep") == 0) {
+            sweep = TRUE;
+            continue;
+        } else {
+            PrintUsage();
+            return strcmp(arg, "--help") == 0 ? 0 : 2;
+        }
+        
+        if (i + 1 >= argc) {
+            PrintUsage();
+            return 2;
+        }
+        *target = atoi(argv[++i]);
+    }
+    
+    if (config.hubCount < 1 || config.portCount < 1 || config.portCount > MOCK_MAX_PORTS ||
+        config.fanout < 0 || config.fanout > config.portCount || iterations < 1) {
+        PrintUsage();
+        return 2;
+    }
+    if (config.fillPercent < 0) config.fillPercent = 0;
+    if (config.fillPercent > 100) config.fillPercent = 100;
+    
+    static const int modes[] = {
+        ENUM_MODE_SERIAL, ENUM_MODE_PARALLEL, ENUM_MODE_OVERLAPPED, ENUM_MODE_BOUNDED,
+        ENUM_MODE_SESSION, BENCH_MODE_CACHED
+    };
+    static const char* modeNames[] = {
+        "serial", "parallel", "async", "bounded", "session", "cached"
+    };
+    double* times = (double*)malloc(iterations * sizeof(double));
+    if (times == NULL) {
+        return 1;
+    }
+    
+    g_backend = &g_mockBackend;
+    printf("ports/hub %d, fanout %d, fill %d%%, latency enum/open/ioctl %d/%d/%d us\n\n",
+           config.portCount, config.fanout, config.fillPercent,
+           config.enumUs, config.openUs, config.ioctlUs);
+    printf("%6s %8s  %-9s %10s %10s %10s\n", "hubs", "devices", "mode",
+           "min ms", "median ms", "mean ms");
+    
+    int failures = 0;
+    int hubTarget = config.hubCount;
+    int hubs = sweep ? 1 : hubTarget;
+    for (;;) {
+        MockConfig run = config;
+        run.hubCount = hubs;
+        if (!BuildMockTopology(&run)) {
+            fprintf(stderr, "out of memory building %d hubs\n", hubs);
+            return 1;
+        }
+        
+        for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+            if (!BenchMode(modes[m], workers, iterations, times)) {
+                failures++;
+                continue;
+            }
+            
+            double total = 0;
+            for (int i = 0; i < iterations; i++) {
+                total += times[i];
+            }
+            qsort(times, iterations, sizeof(double), CompareDoubles);
+            printf("%6d %8d  %-9s %10.2f %10.2f %10.2f\n", hubs, g_mockExpectedDevices,
+                   modeNames[m], times[0], times[iterations / 2], total / iterations);
+        }
+        FreeMockTopology();
+        
+        // Always finish on the requested size, even if it isn't a power of two
+        if (hubs >= hubTarget) {
+            break;
+        }
+        hubs = (hubs * 2 < hubTarget) ? hubs * 2 : hubTarget;
+    }
+    
+    free(times);
+    return failures ? 1 : 0;
+}